@@ -0,0 +1,91 @@
+// Client of the shell's server mode (`shell -s socket`): runs a command line
+// there with this process's standard input, output, error and working
+// directory, and exits with its status. Only needs libc, so it starts faster than the shell itself.
+//
+//   shell_client socket command line...
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int fail(const char* what) {
+	int error = errno;
+	fprintf(stderr, "shell_client: %s: %s\n", what, strerror(error));
+	return error;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: shell_client socket command line...\n");
+		return 2;
+	}
+	size_t size = 0;
+	for (int i = 2; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+	char* line = static_cast<char*>(malloc(size));
+	size = 0;
+	for (int i = 2; i < argc; i++) {
+		if (i > 2) line[size++] = ' ';
+		size_t n = strlen(argv[i]);
+		memcpy(line + size, argv[i], n);
+		size += n;
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server == -1 || connect(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+		return fail(argv[1]);
+	}
+
+	// The length, with our standard input, output, error and directory attached.
+	uint32_t length = size;
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd == -1) {
+		return fail(".");
+	}
+	int fds[4] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd};
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	iovec header = {&length, sizeof(length)};
+	msghdr message = {};
+	message.msg_iov = &header;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	cmsghdr* c = CMSG_FIRSTHDR(&message);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+	if (sendmsg(server, &message, MSG_NOSIGNAL) != sizeof(length)) {
+		return fail("sendmsg");
+	}
+	for (size_t sent = 0; sent < size;) {
+		ssize_t n = send(server, line + sent, size - sent, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return fail("send");
+		}
+		sent += n;
+	}
+
+	int32_t status;
+	size_t got = 0;
+	while (got < sizeof(status)) {
+		ssize_t n = read(server, reinterpret_cast<char*>(&status) + got, sizeof(status) - got);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) {
+			fprintf(stderr, "shell_client: %s: connection closed\n", argv[1]);
+			return 1;
+		}
+		got += n;
+	}
+	return status;
+}
@@ -1,6 +1,24 @@
+#include <cstring>
+
 extern int shell(bool prompt);
+extern int shell_script(const char* path);
+extern int shell_server(const char* path);
+extern bool explain_pipelines;
 
 int main(int argc, char** argv) {
+	// `shell -f script` runs a script file in batch mode (`-f -` reads it from standard input).
+	if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+		return shell_script(argv[2]);
+	}
+	// `shell -s socket` serves command lines to clients (see shell_client).
+	if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+		return shell_server(argv[2]);
+	}
+	// `shell -n` prints the plan of every pipeline it reads instead of running it.
+	if (argc == 2 && strcmp(argv[1], "-n") == 0) {
+		explain_pipelines = true;
+		return shell(false);
+	}
 	bool showPrompt = argc == 1;
 	return shell(showPrompt);
 }
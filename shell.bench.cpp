@@ -0,0 +1,463 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <vector>
+
+#include "shell.h"
+
+// shell binary and the client of its server mode
+#ifndef SHELL
+#define SHELL "./shell"
+#endif
+#ifndef CLIENT
+#define CLIENT "./shell_client"
+#endif
+
+using namespace std;
+
+namespace {
+
+// Keeps `mb` megabytes of touched heap alive, so fork() has page tables to copy
+// just like a long-running shell that has grown.
+struct Ballast {
+	vector<char> bytes;
+	explicit Ballast(size_t mb) : bytes(mb << 20) { memset(bytes.data(), 1, bytes.size()); }
+};
+
+void run_true(LaunchBackend backend, benchmark::State& state) {
+	Ballast ballast(size_t(state.range(0)));
+	launch_backend = backend;
+	vector<Command> commands = {{{"true"}}};
+	JobTable jobs;
+	string in, out;
+	for (auto _ : state) {
+		execute_commands(commands, jobs, in, out, false);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+// Latency of launching and reaping a single `true`, per backend.
+void BM_SpawnLatencyFork(benchmark::State& state) { run_true(LaunchBackend::Fork, state); }
+void BM_SpawnLatencySpawn(benchmark::State& state) { run_true(LaunchBackend::Spawn, state); }
+
+BENCHMARK(BM_SpawnLatencyFork)->Arg(0)->Arg(256)->Arg(1024)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_SpawnLatencySpawn)->Arg(0)->Arg(256)->Arg(1024)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// Cost of setting up (and reaping) an N-stage pipeline of `true`, per backend.
+// Pipes are created one stage at a time, so the cost per stage stays the same
+// and even thousands of stages run with RLIMIT_NOFILE lowered to 64.
+void run_pipeline(LaunchBackend backend, benchmark::State& state) {
+	rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	rlimit lowered = {64, files.rlim_max};
+	setrlimit(RLIMIT_NOFILE, &lowered);
+	launch_backend = backend;
+	vector<Command> commands(size_t(state.range(0)), Command{{"true"}});
+	JobTable jobs;
+	string in, out;
+	for (auto _ : state) {
+		execute_commands(commands, jobs, in, out, false);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	setrlimit(RLIMIT_NOFILE, &files);
+}
+
+void BM_PipelineSetupFork(benchmark::State& state) { run_pipeline(LaunchBackend::Fork, state); }
+void BM_PipelineSetupSpawn(benchmark::State& state) { run_pipeline(LaunchBackend::Spawn, state); }
+
+BENCHMARK(BM_PipelineSetupFork)->RangeMultiplier(4)->Range(2, 4096)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_PipelineSetupSpawn)->RangeMultiplier(4)->Range(2, 4096)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// Writes a file of `mb` megabytes to copy around.
+string make_file(size_t mb) {
+	string name = "bench_input_" + to_string(mb);
+	FILE* f = fopen(name.c_str(), "w");
+	vector<char> block(1 << 20, 'x');
+	for (size_t i = 0; i < mb; i++) {
+		fwrite(block.data(), 1, block.size(), f);
+	}
+	fclose(f);
+	return name;
+}
+
+// Throughput of `line` with the input file as `<` redirect and `bench_output` as
+// `>` redirect, with and without the in-process data movers.
+void run_copy(vector<Command> commands, bool movers, benchmark::State& state) {
+	string in = make_file(size_t(state.range(0)));
+	string out = "bench_output";
+	JobTable jobs;
+	use_data_movers = movers;
+	for (auto _ : state) {
+		execute_commands(commands, jobs, in, out, false);
+	}
+	use_data_movers = true;
+	state.SetBytesProcessed(state.iterations() * (state.range(0) << 20));
+	unlink(in.c_str());
+	unlink(out.c_str());
+}
+
+// `cat < f > g`
+void BM_CatFileToFileForked(benchmark::State& state) { run_copy({{{"cat"}}}, false, state); }
+void BM_CatFileToFileInProcess(benchmark::State& state) { run_copy({{{"cat"}}}, true, state); }
+// `cat < f | cat > g`
+void BM_CatPipeForked(benchmark::State& state) { run_copy({{{"cat"}}, {{"cat"}}}, false, state); }
+void BM_CatPipeInProcess(benchmark::State& state) { run_copy({{{"cat"}}, {{"cat"}}}, true, state); }
+// `cat < f | cat | cat > g`
+void BM_CatChainForked(benchmark::State& state) { run_copy({{{"cat"}}, {{"cat"}}, {{"cat"}}}, false, state); }
+void BM_CatChainInProcess(benchmark::State& state) { run_copy({{{"cat"}}, {{"cat"}}, {{"cat"}}}, true, state); }
+
+BENCHMARK(BM_CatFileToFileForked)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_CatFileToFileInProcess)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_CatPipeForked)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_CatPipeInProcess)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_CatChainForked)->Arg(1)->Arg(16)->Arg(256)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_CatChainInProcess)->Arg(1)->Arg(16)->Arg(256)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Throughput of writing a `mb` megabyte file to two files: fanned out by the
+// shell with tee(2)/splice(2) (`cat < f > a > b`) or by a tee process
+// (`cat < f | tee a > b`).
+void run_fan_out(const string& line, benchmark::State& state) {
+	string in = make_file(size_t(state.range(0)));
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	string command = "cat < " + in + line;
+	for (auto _ : state) {
+		session.run(command);
+	}
+	state.SetBytesProcessed(state.iterations() * (state.range(0) << 20));
+	close(null);
+	unlink(in.c_str());
+	unlink("bench_fan_a");
+	unlink("bench_fan_b");
+}
+
+void BM_FanOutShell(benchmark::State& state) { run_fan_out(" > bench_fan_a > bench_fan_b", state); }
+void BM_FanOutTee(benchmark::State& state) { run_fan_out(" | tee bench_fan_a > bench_fan_b", state); }
+
+BENCHMARK(BM_FanOutShell)->Arg(1)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_FanOutTee)->Arg(1)->Arg(64)->Arg(512)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Expanding a pattern in a directory of `count` files, `true` being a builtin
+// that runs without a process.
+void BM_GlobDirectory(benchmark::State& state) {
+	string dir = "bench_glob";
+	mkdir(dir.c_str(), 0755);
+	for (long i = 0; i < state.range(0); i++) {
+		close(open((dir + "/file" + to_string(i) + ".log").c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644));
+	}
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	for (auto _ : state) {
+		session.run("true bench_glob/*7.log");
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	close(null);
+	session.run("rm -r bench_glob");
+}
+
+BENCHMARK(BM_GlobDirectory)->Arg(1000)->Arg(100000)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// A line that runs the builtin `true` inside the shell, with tracing off (0)
+// and on (1). Off, every span is a branch; on, every line records its parse
+// and pipeline span into the ring buffer and the histograms.
+void BM_TraceOverhead(benchmark::State& state) {
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	session.run(state.range(0) ? "stats on" : "stats off");
+	for (auto _ : state) {
+		session.run("true");
+	}
+	session.run("stats off");
+	close(null);
+}
+
+BENCHMARK(BM_TraceOverhead)->Arg(0)->Arg(1)->Unit(benchmark::kNanosecond);
+
+// `sort | uniq -c` over a million lines into a file, run every time (0) or
+// replayed from the result cache (1), which clones or copies the stored output.
+void BM_ResultCache(benchmark::State& state) {
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	setenv("BSHELL_CACHE_DIR", "bench_cache", 1);
+	session.run("seq 1 1000000 > bench_cache_input");
+	string line = string(state.range(0) ? "cache " : "") + "sort -r < bench_cache_input | uniq -c > bench_cache_output";
+	session.run(line);
+	for (auto _ : state) {
+		session.run(line);
+	}
+	session.run("rm -r bench_cache bench_cache_input bench_cache_output");
+	close(null);
+}
+
+BENCHMARK(BM_ResultCache)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// `cat file | cat | wc -c` over 64 MB as written (0) and as the optimizer
+// rewrites it (1): `wc -c < file`, one process and no copies through pipes.
+void BM_UselessCat(benchmark::State& state) {
+	string in = make_file(64);
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	optimize_pipelines = state.range(0) != 0;
+	string line = "cat " + in + " | cat | wc -c";
+	for (auto _ : state) {
+		session.run(line);
+	}
+	optimize_pipelines = true;
+	state.SetBytesProcessed(state.iterations() * (int64_t(64) << 20));
+	close(null);
+	unlink(in.c_str());
+}
+
+BENCHMARK(BM_UselessCat)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// `sort file | grep (` over 16 MB, where grep fails on its pattern right away:
+// sort runs until it has sorted everything and hits the closed pipe (0), or
+// failfast terminates it as soon as grep exits (1).
+void BM_DoomedPipeline(benchmark::State& state) {
+	string in = make_file(16);
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	failfast = state.range(0) != 0;
+	string line = "sort " + in + " | grep -E (";
+	for (auto _ : state) {
+		session.run(line);
+	}
+	failfast = false;
+	close(null);
+	unlink(in.c_str());
+}
+
+BENCHMARK(BM_DoomedPipeline)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Megabytes of `path` that are in the page cache.
+double resident_mb(const string& path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	double mb = 0;
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		size_t page = sysconf(_SC_PAGESIZE);
+		vector<unsigned char> pages((st.st_size + page - 1) / page);
+		if (map != MAP_FAILED && mincore(map, st.st_size, pages.data()) == 0) {
+			for (unsigned char p : pages) mb += (p & 1) * double(page) / (1 << 20);
+		}
+		if (map != MAP_FAILED) munmap(map, st.st_size);
+	}
+	if (fd != -1) close(fd);
+	return mb;
+}
+
+// `tr x y < file > output` over 64 MB without hints (0) and with drop-behind
+// on both sides (1), from a cold (0) or warm (1) page cache. `cached_mb` is
+// how much of the two files the pipeline leaves in the page cache, which
+// otherwise pushes out what other programs on the machine have cached.
+void BM_RedirectHints(benchmark::State& state) {
+	string in = make_file(64);
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	string prefix = state.range(0) ? "io -i sequential,dontneed -o dontneed,throttle=16M " : "";
+	string line = prefix + "tr x y < " + in + " > bench_output";
+	bool warm = state.range(1) != 0;
+	double cached = 0;
+	for (auto _ : state) {
+		state.PauseTiming();
+		// Written back first: dirty pages cannot be dropped.
+		int fd = open(in.c_str(), O_RDONLY | O_CLOEXEC);
+		fdatasync(fd);
+		if (warm) {
+			vector<char> buffer(1 << 20);
+			while (read(fd, buffer.data(), buffer.size()) > 0) {}
+		} else {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		}
+		close(fd);
+		state.ResumeTiming();
+		session.run(line);
+		state.PauseTiming();
+		cached += resident_mb(in) + resident_mb("bench_output");
+		state.ResumeTiming();
+	}
+	state.counters["cached_mb"] = cached / state.iterations();
+	state.SetBytesProcessed(state.iterations() * (int64_t(64) << 20));
+	close(null);
+	unlink(in.c_str());
+	unlink("bench_output");
+}
+
+BENCHMARK(BM_RedirectHints)->ArgsProduct({{0, 1}, {0, 1}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// 100 background jobs that write about 100 KB each, straight to the session's
+// output (0) or captured into 64 KB ring buffers that the shell drains (1).
+void BM_ChattyJobs(benchmark::State& state) {
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	Session session({null, null, null});
+	job_output_size = state.range(0) ? 64 << 10 : 0;
+	for (auto _ : state) {
+		for (int i = 0; i < 100; i++) {
+			session.run("seq 1 20000 &");
+		}
+		session.run("wait");
+	}
+	job_output_size = 0;
+	close(null);
+}
+
+BENCHMARK(BM_ChattyJobs)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Runs `argv` to completion with `input` as standard input and the output
+// discarded.
+void run_program(const vector<const char*>& argv, const char* input) {
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, input, O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	pid_t pid;
+	if (posix_spawn(&pid, argv[0], &actions, nullptr, const_cast<char**>(argv.data()), environ) == 0) {
+		waitpid(pid, nullptr, 0);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+}
+
+// Command lines for the server benchmarks: a builtin (just the startup cost)
+// and a pipeline.
+const char* server_lines[] = {"true", "echo hi | cat"};
+
+// Latency of running one command line by starting `shell -t` for it, the
+// way an orchestration layer would without the server.
+void BM_ColdShell(benchmark::State& state) {
+	FILE* f = fopen("bench_line", "w");
+	fprintf(f, "%s\n", server_lines[state.range(0)]);
+	fclose(f);
+	for (auto _ : state) {
+		run_program({SHELL, "-t", nullptr}, "bench_line");
+	}
+	unlink("bench_line");
+}
+
+// The same command line through shell_client and a `shell -s` server.
+void BM_ServerClient(benchmark::State& state) {
+	const char* socket = "bench_server.sock";
+	pid_t server = fork();
+	if (server == 0) {
+		_exit(shell_server(socket));
+	}
+	while (access(socket, F_OK) != 0) {
+		usleep(1000);
+	}
+	for (auto _ : state) {
+		run_program({CLIENT, socket, server_lines[state.range(0)], nullptr}, "/dev/null");
+	}
+	kill(server, SIGTERM);
+	waitpid(server, nullptr, 0);
+	unlink(socket);
+}
+
+BENCHMARK(BM_ColdShell)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_ServerClient)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// Writes a history file of `count` entries, about 40 bytes each.
+string make_history(size_t count) {
+	string name = "bench_history_" + to_string(count);
+	FILE* f = fopen(name.c_str(), "w");
+	for (size_t i = 0; i < count; i++) {
+		fprintf(f, "\x1e" "grep -r pattern%zu src/module%zu | wc -l\n", i % 1000, i);
+	}
+	fclose(f);
+	return name;
+}
+
+// Opening a history file and closing it again: constant, whatever its size,
+// since the thread that splits it stops after at most a megabyte.
+void BM_HistoryOpen(benchmark::State& state) {
+	string name = make_history(size_t(state.range(0)));
+	for (auto _ : state) {
+		History history;
+		benchmark::DoNotOptimize(open_history(history, name));
+	}
+	unlink(name.c_str());
+}
+
+// Latency of a substring (kind 0) or prefix (kind 1) search once the index
+// is built, walking back through every match like repeated reverse searches.
+void BM_HistorySearch(benchmark::State& state) {
+	string name = make_history(size_t(state.range(1)));
+	History history;
+	open_history(history, name);
+	bool prefix = state.range(0) == 1;
+	string_view text = prefix ? "grep -r pattern42" : "module4242";
+	search_history(history, text, prefix, history.entries.size());
+	for (auto _ : state) {
+		long found = search_history(history, text, prefix, size_t(-1));
+		while (found > 0) found = search_history(history, text, prefix, size_t(found));
+		benchmark::DoNotOptimize(found);
+	}
+	unlink(name.c_str());
+}
+
+// The first search of a session right after it opened the file: it waits for
+// the thread that splits the file into entries and builds the index, which a
+// session does not keep for the next one.
+void BM_HistoryFirstSearch(benchmark::State& state) {
+	string name = make_history(size_t(state.range(1)));
+	bool prefix = state.range(0) == 1;
+	string_view text = prefix ? "grep -r pattern42" : "module4242";
+	for (auto _ : state) {
+		History history;
+		open_history(history, name);
+		benchmark::DoNotOptimize(search_history(history, text, prefix, size_t(-1)));
+	}
+	unlink(name.c_str());
+}
+
+BENCHMARK(BM_HistoryOpen)->Arg(1000)->Arg(1000000)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_HistoryFirstSearch)->ArgNames({"prefix", "entries"})
+	->Args({0, 1000})->Args({0, 100000})->Args({0, 1000000})->Args({1, 1000000})->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_HistorySearch)->ArgNames({"prefix", "entries"})
+	->Args({0, 1000})->Args({0, 1000000})->Args({1, 1000})->Args({1, 1000000})->Unit(benchmark::kMicrosecond);
+
+// Lines for the parser benchmarks, by kind and approximate size in bytes.
+string parse_input(int kind, size_t size) {
+	string line;
+	switch (kind) {
+	case 0: // Typical interactive line.
+		return "cat < input.txt | grep -v 'some pattern' | sort -k2 | uniq -c > counts.txt &";
+	case 1: // Machine generated: many plain arguments.
+		line = "echo";
+		while (line.size() < size) line += " argument" + to_string(line.size());
+		return line;
+	case 2: // Many quoted arguments with embedded spaces and pipes.
+		line = "printf";
+		while (line.size() < size) line += " \"a | b\" 'c d'";
+		return line;
+	default: // Pathological: a long pipeline of tiny commands.
+		line = "a";
+		while (line.size() < size) line += " | a";
+		return line;
+	}
+}
+
+// Bytes per second parsed into a reused arena.
+void BM_Parse(benchmark::State& state) {
+	string line = parse_input(int(state.range(0)), size_t(state.range(1)));
+	ParseArena arena;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(parse_command_line(line, arena));
+	}
+	state.SetBytesProcessed(state.iterations() * line.size());
+}
+
+BENCHMARK(BM_Parse)->ArgNames({"kind", "size"})
+	->Args({0, 0})->Args({1, 4096})->Args({1, 4 << 20})->Args({2, 4096})->Args({2, 4 << 20})->Args({3, 4096})->Args({3, 1 << 20});
+
+}
+
+BENCHMARK_MAIN();
@@ -27,23 +27,114 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <spawn.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <linux/fs.h>
+
 #include <vector>
 #include <array>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
+#include <bitset>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "shell.h"
 
 // although it is good habit, you don't have to type 'std' before many objects by including this line
 using namespace std;
 
-struct Command {
-  vector<string> parts = {};
-};
+#ifdef BSHELL_DEFAULT_LAUNCH_FORK
+LaunchBackend launch_backend = LaunchBackend::Fork;
+#else
+LaunchBackend launch_backend = LaunchBackend::Spawn;
+#endif
+
+bool use_data_movers = true;
+bool optimize_pipelines = true;
+size_t job_output_size = 0;
+string job_spill_dir;
+bool explain_pipelines = false;
+bool pipefail = false;
+bool failfast = false;
+IoPolicy io_input_policy, io_output_policy;
+
+// I/O of the session that is running. What the shell prints itself goes
+// through shell_out and shell_err, which write to these fds.
+SessionIO shell_io;
+History* active_history = nullptr; // History of the running session.
+
+// Writes all of `data` to `fd`. Returns false on failure (EPIPE included).
+bool write_all(int fd, string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+  return true;
+}
+
+// Stream buffer of shell_out/shell_err: collects a message and writes it to
+// the fd of the running session when the stream is flushed (std::endl).
+struct SessionBuffer : streambuf {
+  int SessionIO::*fd;
+  string buffer;
 
-struct Expression {
-  vector<Command> commands;
-  string inputFromFile;
-  string outputToFile;
-  bool background = false;
+  explicit SessionBuffer(int SessionIO::*fd) : fd(fd) {}
+
+  int overflow(int c) override {
+    if (c != EOF) buffer += char(c);
+    return traits_type::not_eof(c);
+  }
+  streamsize xsputn(const char* data, streamsize n) override {
+    buffer.append(data, n);
+    return n;
+  }
+  int sync() override {
+    write_all(shell_io.*fd, buffer); // Like cerr, a closed output is not an error of the shell.
+    buffer.clear();
+    return 0;
+  }
 };
 
+SessionBuffer shell_out_buffer(&SessionIO::out), shell_err_buffer(&SessionIO::err);
+ostream shell_out(&shell_out_buffer);
+ostream shell_err(&shell_err_buffer);
+
+// perror on the error output of the session. Keeps errno.
+void print_error(const string& what) {
+  int error = errno;
+  shell_err << what << ": " << strerror(error) << endl;
+  errno = error;
+}
+
 // wrapper around the C execvp so it can be called with C++ strings (easier to work with)
 // always start with the command itself
 // DO NOT CHANGE THIS FUNCTION UNDER ANY CIRCUMSTANCE
@@ -64,453 +155,6784 @@ int execvp(const vector<string>& args) {
   return rc;
 }
 
-// Executes a command with arguments. In case of failure, returns error code.
-int execute_command(const Command& cmd) {
-  auto& parts = cmd.parts;
-  if (parts.size() == 0)
-    return EINVAL;
-
-  // execute external commands
-  int retval = execvp(parts);
-  return retval ? errno : 0;
+// The arguments that run the file at `path` as a script of /bin/sh, for a file
+// that the kernel does not know how to execute (ENOEXEC: a script without a
+// `#!` line), as execvp(3) does.
+vector<string> script_arguments(const string& path, const vector<string>& args) {
+  vector<string> script = {"/bin/sh", path};
+  script.insert(script.end(), args.begin() + 1, args.end());
+  return script;
 }
 
-void display_prompt() {
-  char buffer[512];
-  char* dir = getcwd(buffer, sizeof(buffer));
-  if (dir) {
-    cout << "\e[32m" << dir << "\e[39m"; // the strings starting with '\e' are escape codes, that the terminal application interpets in this case as "set color to green"/"set color to default"
+// Same as the wrapper above, but executes the file at `path` directly without
+// searching $PATH.
+int execv(const string& path, const vector<string>& args) {
+  vector<const char*> c_args;
+  for (const string& arg : args) {
+    c_args.push_back(arg.c_str());
   }
-  cout << "$ ";
-  flush(cout);
-}
-
-string request_command_line(bool showPrompt) {
-  if (showPrompt) {
-    display_prompt();
+  c_args.push_back(nullptr);
+  int rc = ::execv(path.c_str(), const_cast<char**>(c_args.data()));
+  if (errno == ENOEXEC && path != "/bin/sh") {
+    execv("/bin/sh", script_arguments(path, args));
+    errno = ENOEXEC;
   }
-  string retval;
-  getline(cin, retval);
-  return retval;
+  return rc;
 }
 
-bool empty_or_whitespace(string str) {
-  return str.find_first_not_of(' ') == std::string::npos;
-}
+// Execution tracing, off unless BSHELL_TRACE or `stats on` turns it on. While
+// it is on, every phase of running a command line records a span (its start
+// and duration) into a ring buffer and adds its duration to a histogram of that
+// phase. Both live in a shared anonymous mapping, so forked children record
+// into the same buffer as the shell; writers claim a slot with one atomic add
+// and never wait for each other. While it is off, a phase costs one branch.
+enum TracePhase {
+  TRACE_PARSE,    // parse_command_line.
+  TRACE_LOOKUP,   // Looking a command up in $PATH (or the cache).
+  TRACE_LAUNCH,   // fork() or posix_spawn() of a stage, in the shell.
+  TRACE_EXEC,     // A forked child setting itself up, until it calls execve.
+  TRACE_WAIT,     // Waiting for a foreground pipeline.
+  TRACE_REAP,     // Reaping background jobs.
+  TRACE_PIPELINE, // A whole pipeline, from launch to its exit status.
+  TRACE_PHASES
+};
+const char* const trace_phase_names[TRACE_PHASES] = {"parse", "lookup", "launch", "exec", "wait", "reap", "pipeline"};
 
-// Split a string by a delimiter, respecting quotes.
-// success = false iff there is an odd number of one of the quote types.
-// Keep empty signals whether any empty splits should be recorded. 
-vector<string> split_respecting_quotes(const string& line, const char delimiter, bool& success, bool keep_empty = false) {
-  vector<string> parts;
-  string current;
-  bool in_single = false, in_double = false;
+struct TraceEvent {
+  atomic<uint64_t> sequence; // Ticket + 1 once the event is written, 0 while it is.
+  uint64_t start, duration;  // Nanoseconds of CLOCK_MONOTONIC.
+  int32_t pid;
+  uint8_t phase;
+  char detail[35];           // Command name, truncated, NUL-terminated.
+};
+static_assert(sizeof(TraceEvent) == 64, "one cache line per event");
+const size_t trace_capacity = 1 << 16; // Events kept; older ones are overwritten.
 
-  for (char c : line) {
-    if (c == '\'' && !in_double) {
-      in_single = !in_single; // toggle, don't add quote to charlist.
-    }
-    else if (c == '"' && !in_single) {
-      in_double = !in_double; // toggle, don't add quote to charlist.
-    }
-    else if (!in_single && !in_double) { // Not in quote
-      if (isspace(c) && delimiter == ' ') {
-        // Special case: splitting on spaces
-        if (keep_empty || !empty_or_whitespace(current)) {
-          parts.push_back( current );
-        }
-        current.clear();
-      }
-      else if (c == delimiter) {
-        // Not in quote
-        if (keep_empty || !empty_or_whitespace(current)) {
-          parts.push_back( current );
-        }
-        current.clear();
-      } else {
-        current.push_back( c );
-      }
-    }
-    else { // In quote: Just add the character.
-      current.push_back( c );
-    }
-  }
+// Durations below 16ns get a bucket each, longer ones 8 per power of two, so a
+// percentile is off by at most 1/8.
+const int trace_buckets = 16 + 60 * 8;
+struct TraceHistogram {
+  atomic<uint64_t> count, max;
+  atomic<uint64_t> buckets[trace_buckets];
+};
 
-  // Open quote: this is a syntax error.
-  // Only set to false since it's true by default, and other sources may edit it.
-  if (in_single || in_double)
-    success = false;
+struct TraceBuffer {
+  atomic<uint64_t> head; // Tickets handed out so far.
+  TraceHistogram histograms[TRACE_PHASES];
+  TraceEvent events[trace_capacity];
+};
 
-  // Only if the string doesn't have characters and keep empty is on, save to the vector.
-  if (keep_empty || !empty_or_whitespace(current))
-    parts.push_back( current );
+TraceBuffer* trace_buffer = nullptr;
+bool tracing = false;
+string trace_file; // BSHELL_TRACE: where the trace is written when the shell ends.
 
-  return parts;
+uint64_t trace_clock() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+int trace_bucket(uint64_t duration) {
+  if (duration < 16) {
+    return int(duration);
+  }
+  int exponent = 63 - __builtin_clzll(duration);
+  return 16 + (exponent - 4) * 8 + int((duration >> (exponent - 3)) & 7);
 }
 
-// Trims the given string of any leading or trailing whitespaces.
-std::string trim(const string &s) {
-    size_t start = s.find_first_not_of(" \t");
-    size_t end = s.find_last_not_of(" \t");
-    return start == string::npos ? "" : s.substr(start, end - start + 1);
+// Largest duration that falls into `bucket`.
+uint64_t trace_bucket_limit(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+  int exponent = (bucket - 16) / 8 + 4;
+  return ((uint64_t(8 + (bucket - 16) % 8 + 1) << (exponent - 3))) - 1;
 }
 
-// Checks whether there are any empty (or whtespace) elements. If there are any,
-// returns true. Strips any nonempty arguments of leading or trailing whitespaces.
-bool process_commands(vector<string>& commands) {
-  bool exists_empty = false;
-  int n_commands = commands.size();
+// Maps a new, empty buffer (dropping the old one) and turns tracing on.
+// The pages are only touched as events are written.
+bool start_tracing() {
+  void* memory = mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    print_error("stats");
+    return false;
+  }
+  if (trace_buffer) {
+    munmap(trace_buffer, sizeof(TraceBuffer));
+  }
+  trace_buffer = new (memory) TraceBuffer;
+  tracing = true;
+  return true;
+}
+
+void trace_record(TracePhase phase, uint64_t start, string_view detail) {
+  uint64_t duration = trace_clock() - start;
+  TraceHistogram& histogram = trace_buffer->histograms[phase];
+  histogram.count.fetch_add(1, memory_order_relaxed);
+  histogram.buckets[trace_bucket(duration)].fetch_add(1, memory_order_relaxed);
+  uint64_t max = histogram.max.load(memory_order_relaxed);
+  while (duration > max && !histogram.max.compare_exchange_weak(max, duration, memory_order_relaxed)) {}
 
-  for (auto it = commands.begin(); it != commands.end();) {
-    // cout << "checking command split for `" << cmd << "`" << endl;
+  // A reader takes an event only if its sequence is the ticket of that slot
+  // both before and after copying it.
+  uint64_t ticket = trace_buffer->head.fetch_add(1, memory_order_relaxed);
+  TraceEvent& event = trace_buffer->events[ticket % trace_capacity];
+  event.sequence.store(0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  event.start = start;
+  event.duration = duration;
+  event.pid = getpid();
+  event.phase = phase;
+  size_t length = min(detail.size(), sizeof(event.detail) - 1);
+  memcpy(event.detail, detail.data(), length);
+  event.detail[length] = '\0';
+  event.sequence.store(ticket + 1, memory_order_release);
+}
 
-    string cmd = *it;
-    *it = trim(cmd); // Trim the command of any whitespaces.
+// Records the time from its construction to its destruction as a span of
+// `phase`, if tracing is on when it is constructed.
+struct TraceSpan {
+  TracePhase phase;
+  string_view detail;
+  uint64_t start;
 
-    // Check if command is empty
-    if (it->find_first_not_of(" \t") == string::npos) {
-      it = commands.erase(it);
-      exists_empty = true;
-    } else {
-      it++; // No removal necessary.
+  explicit TraceSpan(TracePhase phase, string_view detail = {})
+      : phase(phase), detail(detail), start(__builtin_expect(tracing, 0) ? trace_clock() : 0) {}
+  ~TraceSpan() {
+    if (__builtin_expect(start != 0, 0)) {
+      trace_record(phase, start, detail);
     }
   }
+};
 
-  return exists_empty && n_commands > 1;
-}
+// Result of looking up a command name in $PATH.
+struct Resolution {
+  string path;   // File to execute. Empty if the lookup failed.
+  int error = 0; // Error execvp would have reported if the lookup failed.
+};
 
-// note: For such a simple shell, there is little need for a full-blown parser (as in an LL or LR capable parser).
-// Here, the user input can be parsed using the following approach.
-// First, divide the input into the distinct commands (as they can be chained, separated by `|`).
-// Next, these commands are parsed separately. The first command is checked for the `<` operator, and the last command for the `>` operator.
-Expression parse_command_line(string commandLine, bool& success) {
-  Expression expression;
+PathCache shell_path_cache;
+PathCache* active_path_cache = &shell_path_cache; // Of the running session.
 
-  // Split according to quotes.
-  bool balanced_quotes = true; // Separate variable used in case other parse failures are added in the future.
-  vector<string> commands = split_respecting_quotes( commandLine, '|', balanced_quotes, true );
-  
-  // Check if there are any empty strings: If this is the case remove them from commands.
-  bool incorrect_pipe_usage = process_commands( commands );
+// Modification time of a directory, or zero if it cannot be stat'ed.
+timespec dir_mtime(const string& dir) {
+  struct stat st;
+  if (stat(dir.empty() ? "." : dir.c_str(), &st) == -1) {
+    return {0, 0};
+  }
+  return st.st_mtim;
+}
 
-  for (size_t i = 0; i < commands.size(); ++i) {
-    string& line = commands[i];
+// Drops the cache if $PATH or any of its directories changed since the
+// entries were resolved.
+void validate_path_cache() {
+  const char* env = getenv("PATH");
+  string path_var = env ? env : "/bin:/usr/bin"; // Default used by execvp.
 
-    // Same as splitting on '|', keep quotes in mind.
-    vector<string> args = split_respecting_quotes( line, ' ', balanced_quotes );
+  bool stale = path_var != active_path_cache->path_var;
+  if (stale) {
+    active_path_cache->path_var = path_var;
+    active_path_cache->dirs.clear();
+    // Empty entries stand for the current directory, so keep them.
+    size_t start = 0;
+    while (true) {
+      size_t end = path_var.find(':', start);
+      string dir = path_var.substr(start, end == string::npos ? string::npos : end - start);
+      active_path_cache->dirs.push_back({dir, dir_mtime(dir)});
+      if (end == string::npos) break;
+      start = end + 1;
+    }
+  } else {
+    for (auto& [dir, mtime] : active_path_cache->dirs) {
+      timespec now = dir_mtime(dir);
+      if (now.tv_sec != mtime.tv_sec || now.tv_nsec != mtime.tv_nsec) {
+        mtime = now;
+        stale = true;
+      }
+    }
+  }
 
-    if (i == commands.size() - 1 && args.size() > 1 && args[args.size()-1] == "&") {
-      expression.background = true;
-      args.resize(args.size()-1);
+  if (stale) {
+    active_path_cache->hits.clear();
+    active_path_cache->misses.clear();
+    active_path_cache->ahead.clear();
+  }
+}
+
+// Searches the directories of $PATH for `name` the way execvp does. `cacheable`
+// is cleared if the result depends on the current directory.
+Resolution search_path(const string& name, bool& cacheable) {
+  bool found_unexecutable = false;
+  for (const auto& [dir, mtime] : active_path_cache->dirs) {
+    if (dir.empty() || dir[0] != '/') {
+      cacheable = false;
     }
-    if (i == commands.size() - 1 && args.size() > 2 && args[args.size()-2] == ">") {
-      expression.outputToFile = args[args.size()-1];
-      args.resize(args.size()-2);
+    string candidate = dir.empty() ? name : dir + "/" + name;
+    struct stat st;
+    if (stat(candidate.c_str(), &st) == -1 || S_ISDIR(st.st_mode)) {
+      continue;
     }
-    if (i == 0 && args.size() > 2 && args[args.size()-2] == "<") {
-      expression.inputFromFile = args[args.size()-1];
-      args.resize(args.size()-2);
+    if (access(candidate.c_str(), X_OK) == 0) {
+      return {candidate, 0};
     }
-    expression.commands.push_back({args});
+    found_unexecutable = true;
   }
+  return {"", found_unexecutable ? EACCES : ENOENT};
+}
 
-  if (!balanced_quotes) {
-    cerr << "Parse error: Unbalanced quotes in one or more commands." << endl;
-    success = false;
+// Looks up the file to execute for command `name`. Call validate_path_cache()
+// before a batch of lookups.
+Resolution resolve_command(const string& name) {
+  TraceSpan span(TRACE_LOOKUP, name);
+  // Paths are executed as given, like execvp does.
+  if (name.find('/') != string::npos) {
+    return {name, 0};
   }
 
-  if (incorrect_pipe_usage) {
-    cerr << "Parse error: Incorrect usage of `|`." << endl;
-    success = false;
+  auto hit = active_path_cache->hits.find(name);
+  if (hit != active_path_cache->hits.end()) {
+    hit->second.second++;
+    return {hit->second.first, 0};
+  }
+  auto ahead = active_path_cache->ahead.find(name);
+  if (ahead != active_path_cache->ahead.end()) {
+    // First use of a command looked up ahead: from now on `hash` lists it.
+    auto& entry = active_path_cache->hits[name] = {move(ahead->second), 1};
+    active_path_cache->ahead.erase(ahead);
+    return {entry.first, 0};
+  }
+  auto miss = active_path_cache->misses.find(name);
+  if (miss != active_path_cache->misses.end()) {
+    return {"", miss->second};
   }
 
-  return expression;
+  bool cacheable = true;
+  Resolution resolved = search_path(name, cacheable);
+  if (cacheable && resolved.error == 0) {
+    active_path_cache->hits[name] = {resolved.path, 1};
+  } else if (cacheable) {
+    active_path_cache->misses[name] = resolved.error;
+  }
+  return resolved;
 }
 
-// Assumes the leading spaces/tabs are stripped. Checks whether the string starts with `cd` or `exit`.
-bool is_internal_command(string& string) {
-  return string.substr(0,2) == "cd" || string.substr(0, 4) == "exit";
+// Looks up `name` for a command that runs later (the lines of a script), so
+// that resolve_command finds it in the cache. It is not counted as used, so
+// `hash` does not list it before it runs.
+void resolve_ahead(const string& name) {
+  TraceSpan span(TRACE_LOOKUP, name);
+  if (name.find('/') != string::npos || active_path_cache->hits.count(name) || active_path_cache->ahead.count(name) ||
+      active_path_cache->misses.count(name)) {
+    return;
+  }
+  bool cacheable = true;
+  Resolution resolved = search_path(name, cacheable);
+  if (cacheable && resolved.error == 0) {
+    active_path_cache->ahead[name] = resolved.path;
+  } else if (cacheable) {
+    active_path_cache->misses[name] = resolved.error;
+  }
 }
 
-// Return -1 if no commands were triggered. Otherwise return status code.
-int handle_internal_commands(Expression& expression) {
-  // If there is a singular command
-  if (expression.commands.size() != 1) return -1;
-  vector<string> cmdParts = expression.commands[0].parts;
+// Executes a command with arguments, using the file found by resolve_command.
+// In case of failure, returns error code.
+int execute_command(const Command& cmd, const Resolution& resolved) {
+  auto& parts = cmd.parts;
+  if (parts.size() == 0)
+    return EINVAL;
+
+  // The shell already knows the lookup fails: don't scan $PATH again.
+  if (resolved.error) {
+    errno = resolved.error;
+    return errno;
+  }
 
-  //  If it is exit, exit the terminal
-  if (cmdParts.size() == 1 && cmdParts[0] == "exit") {
-    exit(0);
+  // execute external commands
+  int retval = execv(resolved.path, parts);
+  if (retval && errno == ENOENT) {
+    // The cached file disappeared in the meantime: fall back to a full search.
+    retval = execvp(parts);
+  }
+  return retval ? errno : 0;
+}
 
-    // Something went wrong: forward error code
-    perror("exit");
+// Moves all bytes from `in` to `out` without copying them through user space
+// where the kernel allows it: copy_file_range between regular files, sendfile
+// from a regular file, splice to or from a pipe. Each method falls back to the
+// next one if the kernel refuses this combination of fds, ending with a plain
+// read/write loop. Returns 0 or the errno of the failure.
+int copy_fd(int in, int out) {
+  const size_t chunk = 1 << 30;
+  struct stat st_in, st_out;
+  if (fstat(in, &st_in) == -1 || fstat(out, &st_out) == -1) {
     return errno;
   }
 
-  //  If it is cd, change the current directory.
-  if (cmdParts.size() == 2 && cmdParts[0] == "cd") {
-    int sc = chdir(cmdParts[1].c_str());
+  auto unsupported = [](int error) {
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP || error == EBADF;
+  };
 
-    if (sc != 0) {
-      perror("cd");
-      return errno; // Something went wrong.
+  // A signal only interrupts a call: each loop goes on after EINTR.
+  if (S_ISREG(st_in.st_mode) && S_ISREG(st_out.st_mode)) {
+    ssize_t n;
+    while ((n = copy_file_range(in, nullptr, out, nullptr, chunk, 0)) > 0 || (n == -1 && errno == EINTR)) {}
+    if (n == 0) return 0;
+    if (!unsupported(errno)) return errno;
+  }
+  if (S_ISREG(st_in.st_mode)) {
+    ssize_t n;
+    while ((n = sendfile(out, in, nullptr, chunk)) > 0 || (n == -1 && errno == EINTR)) {}
+    if (n == 0) return 0;
+    if (!unsupported(errno)) return errno;
+  }
+  if (S_ISFIFO(st_in.st_mode) || S_ISFIFO(st_out.st_mode)) {
+    // Between two pipes, splice() raises SIGPIPE when the output has no reader
+    // even if the input has ended, where read() would just return 0: wait for
+    // data on an input pipe first, and stop at its end like read().
+    ssize_t n;
+    while (true) {
+      if (S_ISFIFO(st_in.st_mode)) {
+        struct pollfd ready = {in, POLLIN, 0};
+        if (poll(&ready, 1, -1) == -1) {
+          if (errno == EINTR) continue;
+          return errno;
+        }
+        if (!(ready.revents & POLLIN)) return 0;
+      }
+      n = splice(in, nullptr, out, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
     }
+    if (n == 0) return 0;
+    if (!unsupported(errno)) return errno;
+  }
 
-    return sc;
+  vector<char> buffer(1 << 17);
+  while (true) {
+    ssize_t n = read(in, buffer.data(), buffer.size());
+    if (n == 0) return 0;
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    for (ssize_t done = 0; done < n;) {
+      ssize_t written = write(out, buffer.data() + done, n - done);
+      if (written == -1) {
+        if (errno == EINTR) continue;
+        return errno;
+      }
+      done += written;
+    }
   }
+}
 
-  return -1;
+// Whether a string looks like an option rather than an operand.
+bool is_option(const string& arg) {
+  return arg.size() > 1 && arg[0] == '-';
 }
 
+string prompt_text() {
+  char buffer[512];
+  char* dir = getcwd(buffer, sizeof(buffer));
+  string prompt;
+  if (dir) {
+    prompt = string("\e[32m") + dir + "\e[39m"; // the strings starting with '\e' are escape codes, that the terminal application interpets in this case as "set color to green"/"set color to default"
+  }
+  return prompt + "$ ";
+}
 
-// Redirects standard input of the current process to the input file (if not
-// empty or whitespace). Closes standard input if background is set to true.
-void setup_input(const string &file_in, bool background) {
-  if (!empty_or_whitespace(file_in)) {
-    // There is an input file. Redirect standard in to this file.
-    int fd = open(file_in.c_str(), O_RDONLY);
-    if (fd == -1) {
-      perror("open input");
-      exit(errno);
-    }
+void display_prompt() {
+  shell_out << prompt_text();
+  flush(shell_out);
+}
 
-    // Use the dup2 syscall to redirect standard input to the input file.
-    if (dup2(fd, STDIN_FILENO) == -1) {
-      perror("dup2 input");
-      exit(errno);
-    }
+// Signal mask for new processes. When SIGCHLD is blocked for the signalfd, the
+// children must not inherit that.
+sigset_t launch_sigmask;
+bool restore_launch_sigmask = false;
 
-    // Afterwards, close the fd for the file itself since it is not needed
-    // anymore.
-    close(fd);
-  } else if (background) {
-    // For background jobs with no input redirection, close stdin (this was a
-    // project requirement)
-    if (close(STDIN_FILENO) == -1) {
-      perror("close stdin");
-      exit(errno);
-    }
-  }
-}
+// epoll data for the entries that are not a pidfd.
+const uint64_t EVENT_INPUT = UINT64_MAX;
+const uint64_t EVENT_SIGCHLD = UINT64_MAX - 1;
+// The output pipe of a job: this bit and the job id in the upper half.
+const uint64_t EVENT_OUTPUT = uint64_t(1) << 63;
 
-// Redirects standard output of the current process to the output file (if not
-// empty or whitespace).
-void setup_output(const string &file_out) {
-  if (!empty_or_whitespace(file_out)) {
-    // There is an output file: redirect standard output to this file.
-    // O_WRONLY: You need to write, not read.
-    // O_CREAT: Create the file if not present.
-    // O_TRUNC: Overwrite existing files of the same name.
-    // 0644: Seems to be standard permission flag if you want to create and
-    // write to files.
-    int fd = open(file_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd == -1) {
-      perror("open output");
-      exit(errno);
-    }
+// The standard output and error of a background job go into a pipe that the
+// shell drains whenever it is readable, into a ring buffer in a memfd (which
+// sendfile copies from when it is shown). Bytes that a full ring is about to
+// overwrite are appended to a spill file if there is a spill directory, or
+// dropped.
+struct JobOutput {
+  int pipe = -1;        // Read end, non-blocking; -1 after the end of the output.
+  int memfd = -1;
+  char* ring = nullptr;
+  size_t size = 0;
+  uint64_t total = 0;   // Bytes captured; the ring holds the last min(total, size).
+  uint64_t dropped = 0; // Overwritten bytes that were not spilled.
+  int spill = -1;
+  string spill_path;
+  bool forward = false; // In the foreground: drained output goes to the session's.
+  pid_t owner = 0;      // Only the shell drains the pipe, not its forked children.
+  string description;
 
-    // Use the dup2 syscall to redirect standard output to the output file.
-    if (dup2(fd, STDOUT_FILENO) == -1) {
-      perror("dup2 output");
-      exit(errno);
-    }
+  ~JobOutput() {
+    if (pipe != -1) close(pipe);
+    if (spill != -1) close(spill);
+    if (ring) munmap(ring, size);
+    if (memfd != -1) close(memfd);
+  }
+};
 
-    // Close file's fd since it is not needed anymore.
-    close(fd);
+// Sets up the capture of a job's output. Returns nullptr on errors, else
+// `write_end` is the O_CLOEXEC write end of its pipe.
+shared_ptr<JobOutput> open_job_output(int& write_end) {
+  auto output = make_shared<JobOutput>();
+  int p[2];
+  output->memfd = memfd_create("bshell-job-output", MFD_CLOEXEC);
+  void* ring = MAP_FAILED;
+  if (output->memfd != -1 && ftruncate(output->memfd, job_output_size) == 0) {
+    ring = mmap(nullptr, job_output_size, PROT_READ | PROT_WRITE, MAP_SHARED, output->memfd, 0);
+  }
+  if (ring == MAP_FAILED) {
+    print_error("job output");
+    return nullptr;
   }
+  // From here on the destructor unmaps the ring, on errors as well.
+  output->ring = static_cast<char*>(ring);
+  output->size = job_output_size;
+  if (pipe2(p, O_CLOEXEC) == -1) {
+    print_error("job output");
+    return nullptr;
+  }
+  output->pipe = p[0];
+  output->owner = getpid();
+  fcntl(p[0], F_SETFL, O_NONBLOCK);
+  fcntl(p[1], F_SETPIPE_SZ, 1 << 20); // Room for bursts while the shell is busy. Best effort.
+  write_end = p[1];
+  return output;
 }
 
-// Closes all pipes as given as arguments.
-void close_all_pipes(const vector<array<int, 2>> &pipes) {
-  for (const auto &p : pipes) {
-    // Close both ends.
-    close(p[0]);
-    close(p[1]);
+// The bytes the ring of `output` holds, oldest first: up to two pieces.
+array<string_view, 2> job_output_pieces(const JobOutput& output) {
+  if (output.total <= output.size) {
+    return {string_view(output.ring, output.total), string_view()};
   }
+  size_t start = output.total % output.size;
+  return {string_view(output.ring + start, output.size - start), string_view(output.ring, start)};
 }
 
-void execute_commands(
-    vector<Command> &commands, // Commands as split with pipes
-    vector<pid_t> &bg_pids,    // All pids of subprocesses that are ran in the
-                               // background. Only write to.
-    string &file_in,  // Input file name in case the first command uses an input
-                      // file.
-    string &file_out, // Output file name in case the last command uses an
-                      // output file.
-    bool background   // Whether `&` is used in the command (in this case run
-                      // processes in the background).
-) {
-  int n_commands =
-      commands.size(); // To remove overhead of calling .size() every time.
-  vector<pid_t>
-      pids; // To keep track of which subprocesses to wait for later on.
+// Spills or drops the oldest `n` bytes of the ring, which are about to be
+// overwritten.
+void spill_job_output(JobOutput& output, size_t n) {
+  if (output.spill == -1 && !job_spill_dir.empty()) {
+    static int serial = 0;
+    output.spill_path = job_spill_dir + "/bshell-" + to_string(getpid()) + "-" + to_string(++serial) + ".log";
+    output.spill = open(output.spill_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (output.spill == -1) {
+      print_error(output.spill_path);
+      output.spill_path.clear();
+    }
+  }
+  size_t start = output.total % output.size;
+  size_t first = min(n, output.size - start);
+  if (output.spill == -1 || !write_all(output.spill, string_view(output.ring + start, first)) ||
+      !write_all(output.spill, string_view(output.ring, n - first))) {
+    output.dropped += n;
+  }
+}
 
-  if (n_commands == 0) {
+// Moves what the pipe of `output` holds into the ring (or, in the foreground,
+// to the session's output) without blocking. Closes the pipe at its end.
+void drain_job_output(JobOutput& output) {
+  if (output.pipe == -1 || getpid() != output.owner) {
     return;
   }
-  
-  // Create pipes. Only do so if there is more than one command,
-  // and make one less since pipes are inbetween processes.
-  // The standard output of process i redirected to the write end of pipe i.
-  // The standard input of process i is redirected to the read end of pipe i-1.
-  vector<array<int, 2>> pipes(n_commands > 1 ? n_commands - 1 : 0);
-
-  for (int i = 0; i < n_commands - 1; i++) {
-    // Initialize the pipe to the pipes vector.
-    if (pipe(pipes[i].data()) == -1) {
-      perror("pipe");
+  while (true) {
+    int available = 0;
+    if (ioctl(output.pipe, FIONREAD, &available) == -1 || available == 0) {
+      pollfd end = {output.pipe, POLLIN, 0};
+      if (poll(&end, 1, 0) == 1 && (end.revents & POLLHUP) && !(end.revents & POLLIN)) {
+        close(output.pipe);
+        output.pipe = -1;
+      }
       return;
     }
-  }
-
-  // Create a new subprocess for each command.
-  for (int i = 0; i < n_commands; i++) {
-
-    // Do this through fork(). So n_commands different child forks from the
-    // parent process are made.
-    pid_t pid = fork();
-    if (pid == -1) {
-      perror("fork");
+    if (output.forward) {
+      char buffer[1 << 16];
+      ssize_t n = read(output.pipe, buffer, min(sizeof(buffer), size_t(available)));
+      if (n <= 0 || !write_all(shell_io.out, string_view(buffer, n))) {
+        return;
+      }
+      continue;
+    }
+    size_t n = min(size_t(available), output.size);
+    if (output.total + n > output.size) {
+      spill_job_output(output, min(n, size_t(output.total + n - output.size)));
+    }
+    size_t start = output.total % output.size;
+    iovec pieces[2] = {{output.ring + start, min(n, output.size - start)}, {output.ring, 0}};
+    pieces[1].iov_len = n - pieces[0].iov_len;
+    ssize_t got = readv(output.pipe, pieces, 2);
+    if (got <= 0) {
       return;
     }
+    output.total += got;
+  }
+}
 
-    if (pid == 0) {
-      // --- Branch of the child process start ---
-
-      // First, setup the inputs and outputs for the first and last command.
-      if (i == 0) {
-        setup_input(file_in, background);
+// Writes the last `lines` lines (all with -1) that `output` holds to `fd`.
+bool write_job_output(const JobOutput& output, int fd, long lines) {
+  array<string_view, 2> pieces = job_output_pieces(output);
+  size_t skip = 0; // Bytes at the start to leave out.
+  if (lines >= 0) {
+    size_t length = pieces[0].size() + pieces[1].size();
+    auto at = [&](size_t k) { return k < pieces[0].size() ? pieces[0][k] : pieces[1][k - pieces[0].size()]; };
+    size_t k = length;
+    if (k > 0 && at(k - 1) == '\n') {
+      k--;
+    }
+    for (long found = 0; k > 0; --k) {
+      if (at(k - 1) == '\n' && ++found == lines) {
+        break;
       }
-      if (i == n_commands - 1) {
-        setup_output(file_out);
+    }
+    skip = lines == 0 ? length : k;
+  }
+  for (string_view piece : pieces) {
+    size_t left = min(skip, piece.size());
+    skip -= left;
+    off_t offset = piece.data() - output.ring + left;
+    size_t n = piece.size() - left;
+    while (n > 0) {
+      ssize_t sent = sendfile(fd, output.memfd, &offset, n);
+      if (sent <= 0) {
+        if (!write_all(fd, string_view(output.ring + offset, n))) return false;
+        break;
       }
+      n -= sent;
+    }
+  }
+  return true;
+}
 
-      // Setup pipes' input ends (not for the first command)
-      if (i > 0) {
-        // Use the dup2 syscall for this and redirect pipes (with indexes as
-        // described before).
-        if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1) {
-          perror("dup2 pipe in");
-          exit(errno);
-        }
-      }
-      // Setup pipes' output ends (not for the last command)
-      if (i < n_commands - 1) {
-        // Use the dup2 syscall again for this and redirect pipes (with indexes
-        // as described before).
-        if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
-          perror("dup2 pipe out");
-          exit(errno);
-        }
-      }
+JobTable::~JobTable() {
+  for (auto& [id, job] : jobs) {
+    for (int fd : job.pidfds) {
+      if (fd != -1) close(fd);
+    }
+  }
+  if (signal_fd != -1) close(signal_fd);
+  if (epoll_fd != -1) close(epoll_fd);
+}
 
-      // Child does not need original pipes anymore, as they are now all
-      // redirected to standard input/output with dup2 syscalls.
-      close_all_pipes(pipes);
+int pidfd_open(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0);
+}
 
-      // Don't execute chained commands with ones such as `cd` or `exit`.
-      bool invalid_command = is_internal_command(commands[i].parts[0]) && n_commands > 1;
-      if (invalid_command) {
-        exit(0);
-      }
+// Sets up the epoll set of the job table on first use.
+void init_job_table(JobTable& table) {
+  if (table.epoll_fd != -1) {
+    return;
+  }
+  table.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (table.epoll_fd == -1) {
+    print_error("epoll_create1");
+    return;
+  }
 
-      // Execute the command.
-      execute_command(commands[i]);
+  // Without pidfds, SIGCHLD arrives through a signalfd instead.
+  int probe = pidfd_open(getpid());
+  if (probe != -1) {
+    close(probe);
+  } else {
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &launch_sigmask);
+    restore_launch_sigmask = true;
+    table.signal_fd = signalfd(-1, &sigchld, SFD_CLOEXEC | SFD_NONBLOCK);
+    epoll_event event = {EPOLLIN, {.u64 = EVENT_SIGCHLD}};
+    epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, table.signal_fd, &event);
+  }
+}
 
-      // Something went wrong if we're still executing this.
-      std::string msg = "`" + commands[i].parts[0] + "`";
-      perror(msg.c_str());
+// Adds `fd`, where command lines are read from, to the epoll set, so waiting
+// for input and for jobs is one epoll_wait.
+void watch_input(JobTable& table, int fd) {
+  init_job_table(table);
+  if (table.input_fd != -1) {
+    epoll_ctl(table.epoll_fd, EPOLL_CTL_DEL, table.input_fd, nullptr);
+  }
+  // Fails for regular files and the like, which are never waited on anyway.
+  epoll_event event = {EPOLLIN, {.u64 = EVENT_INPUT}};
+  table.input_fd = epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0 ? fd : -1;
+}
 
-      exit(errno);
-    }
+// Registers the processes of a pipeline started with `&` as a new job, with the
+// lowest free job id, and prints its id and last pid. `output` is the capture
+// of its output, if any. Returns the id.
+int add_job(JobTable& table, const vector<pid_t>& pids, pid_t pgid, const string& description,
+             shared_ptr<JobOutput> output = nullptr) {
+  init_job_table(table);
 
-    // Parent pushes the pid to the pids list to keep track of which pids to
-    // wait for.
-    pids.push_back(pid);
-    if (background) {
-      // If it is a background process, future blocks also need to know what
-      // pids to wait for.
-      bg_pids.push_back(pid);
-    }
+  int id = 1;
+  for (const auto& entry : table.jobs) {
+    if (entry.first != id) break;
+    id++;
   }
 
-  // Parent closes all pipes since they're not needed here.
-  close_all_pipes(pipes);
+  Job& job = table.jobs[id];
+  job = {id, pgid, pids, vector<int>(pids.size(), -1), pids.size(), false, 0, description, output};
+  table.finished_output.erase(id);
+  if (output) {
+    output->description = description;
+    epoll_event event = {EPOLLIN, {.u64 = EVENT_OUTPUT | (uint64_t(id) << 32)}};
+    epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, output->pipe, &event);
+  }
+  for (size_t i = 0; i < pids.size() && table.signal_fd == -1; ++i) {
+    job.pidfds[i] = pidfd_open(pids[i]);
+    epoll_event event = {EPOLLIN, {.u64 = (uint64_t(id) << 32) | i}};
+    if (job.pidfds[i] != -1) {
+      epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, job.pidfds[i], &event);
+    }
+  }
 
-  if (background) {
-    // In most shells the job number is printed but we don't have jobs (just stuff in the background) for ths shell.
-    // So we just print [bg] instead.
-    std::cout << "[bg] " << pids.back() << std::endl;
-  } else {
-    // Run in foreground; wait for all processes and block.
-    for (pid_t pid : pids) {
-      int status;
-      if (waitpid(pid, &status, 0) == -1) {
-        perror("waitpid");
-      } else if (WIFSIGNALED(status)) {
-        // Only report errors for processes that were terminated through a
-        // signal. Other processes that were terminated regularly will already
-        // have printed any relevant/necessary error messages.
+  shell_out << "[" << id << "] " << pids.back() << std::endl;
+  return id;
+}
 
-        int sig_code = WTERMSIG(status) ;
-        std::cerr << strsignal(sig_code) << std::endl;
-      }
-    }
+// Records the wait status of process `i` of `job`, which is reaped already
+// unless it only stopped.
+void record_job_process(Job& job, size_t i, int status) {
+  if (WIFSTOPPED(status)) {
+    job.stopped = true;
+    return;
   }
+  if (i == job.pids.size() - 1) {
+    job.status = status;
+  }
+  if (job.pidfds[i] != -1) {
+    close(job.pidfds[i]); // Also removes it from the epoll set.
+    job.pidfds[i] = -1;
+  }
+  job.pids[i] = -1;
+  job.running--;
 }
 
-void poll_background_processes(vector<pid_t>& pids) {
+// Reaps process `i` of `job` if it has terminated (or, with `flags` containing
+// WUNTRACED, stopped). Returns whether its state changed.
+bool reap_job_process(Job& job, size_t i, int flags) {
+  if (job.pids[i] == -1) {
+    return false;
+  }
   int status;
-
-  // Use iterator to avoid concurrent modification exceptions.
-  for (auto it = pids.begin(); it != pids.end();) {
-    // Poll whether the process has terminated or not.
-    pid_t result = waitpid(*it, &status, WNOHANG);
-    if (result == -1) {
-      perror("waitpid");
-      it = pids.erase(it);
-    } else if (result > 0) {
-      //  Process has terminated. Print done!
-      std::cout << "[done] " << *it << std::endl;
-      it = pids.erase(it);
-    } else {
-      it++; // process is still busy.
-    }
+  pid_t result = waitpid(job.pids[i], &status, flags);
+  if (result == 0) {
+    return false;
+  }
+  if (result == -1 && errno == EINTR) {
+    return false;
+  }
+  if (result == -1) {
+    print_error("waitpid");
+    status = 0;
   }
+  record_job_process(job, i, status);
+  return true;
 }
 
-void execute_expression(Expression& expression, vector<pid_t>& bg_pids) {
-  // Check for empty expression
-  if (expression.commands.size() == 0) {
-    cerr << strerror(EINVAL) << endl;
-    return; 
+// Removes `job` from the table if all of its processes are reaped, printing
+// the completion message if `report` is set. Returns whether it was removed.
+bool finish_job(JobTable& table, Job& job, bool report) {
+  if (job.running > 0) {
+    return false;
   }
-  
-  // Handle intern commands (like 'cd' and 'exit')
-  int internal_commands_rc = handle_internal_commands(expression);
-  if (internal_commands_rc != -1) { // -1 = handle_internal_commands didn't execute a command.
-    // Something happened, but all errors/results are already printed.
-    return; 
+  if (report) {
+    shell_out << "[" << job.id << "] done  " << job.description << std::endl;
+  }
+  if (job.output) {
+    // What is left in the pipe stays readable with `jobs -o` and `tail`.
+    job.output->forward = false;
+    drain_job_output(*job.output);
+    table.finished_output[job.id] = job.output;
   }
+  table.jobs.erase(job.id);
+  return true;
+}
 
-  // Execute commands.
-  execute_commands(expression.commands, bg_pids, expression.inputFromFile, expression.outputToFile, expression.background);
+// Records the wait status of `pid` in the job it belongs to, for a process
+// that a foreground pipeline reaped along with its own stages (a stopped job
+// in the shell's process group). Returns whether it belongs to a job.
+bool record_job_status(JobTable& table, pid_t pid, int status) {
+  for (auto& [id, job] : table.jobs) {
+    for (size_t i = 0; i < job.pids.size(); ++i) {
+      if (job.pids[i] == pid) {
+        record_job_process(job, i, status);
+        finish_job(table, job, true);
+        return true;
+      }
+    }
+  }
+  return false;
 }
 
-int shell(bool showPrompt) {
-  vector<pid_t> bg_pids;
+// Whether `pid` is a process of a job that has not been reaped yet.
+bool is_job_process(const JobTable& table, pid_t pid) {
+  for (const auto& [id, job] : table.jobs) {
+    if (find(job.pids.begin(), job.pids.end(), pid) != job.pids.end()) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  while (cin.good()) {
-    // Poll whether any background processes have finished running in the meantime.
-    poll_background_processes(bg_pids);
+// Reaps the next process of `pids` (0: reaped already) that terminates or
+// stops, for a pipeline in the shell's process group. Other children are left
+// alone, so an application that embeds the shell still reaps its own; those of
+// jobs that change state meanwhile are recorded in the job table. As long as a
+// child the shell does not know is waiting to be reaped, the pidfds of `pids`
+// are polled instead, with a stop noticed within 10 ms. Returns the pid and
+// stores its wait status in `status`, or -1 on errors.
+pid_t wait_own_process(const vector<pid_t>& pids, JobTable& jobs, int* status) {
+  auto own = [&](pid_t pid) { return pid > 0 && find(pids.begin(), pids.end(), pid) != pids.end(); };
+  while (true) {
+    siginfo_t info = {};
+    if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOWAIT) == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    pid_t pid = info.si_pid;
+    if (!own(pid) && !is_job_process(jobs, pid)) {
+      break;
+    }
+    pid = waitpid(pid, status, WUNTRACED);
+    if (own(pid)) {
+      return pid;
+    }
+    if (pid > 0) {
+      record_job_status(jobs, pid, *status);
+    }
+  }
+
+  vector<pollfd> fds;
+  for (pid_t pid : pids) {
+    fds.push_back({pid > 0 ? pidfd_open(pid) : -1, POLLIN, 0});
+  }
+  pid_t result = 0;
+  while (result == 0) {
+    for (size_t p = 0; p < pids.size() && result == 0; ++p) {
+      if (pids[p] > 0) result = waitpid(pids[p], status, WNOHANG | WUNTRACED);
+      if (result == -1 && errno == EINTR) result = 0;
+    }
+    if (result == 0) {
+      poll(fds.data(), fds.size(), 10);
+    }
+  }
+  for (const pollfd& fd : fds) {
+    if (fd.fd != -1) close(fd.fd);
+  }
+  return result;
+}
+
+// Sends `sig` to the processes of `job`: to its process group, or one by one
+// if it has none of its own (pgid -1: it runs in the shell's group).
+void signal_job(const Job& job, int sig) {
+  if (job.pgid > 0) {
+    kill(-job.pgid, sig);
+    return;
+  }
+  for (pid_t pid : job.pids) {
+    if (pid != -1) kill(pid, sig);
+  }
+}
+
+// Whether epoll data `data` of the job table is an output pipe.
+bool is_output_event(uint64_t data) {
+  return (data & EVENT_OUTPUT) && data != EVENT_INPUT && data != EVENT_SIGCHLD;
+}
+
+// Drains the output pipe of the job that `data` is the epoll data of, running
+// or finished. Prints nothing.
+void drain_output_event(JobTable& table, uint64_t data) {
+  int id = int((data & ~EVENT_OUTPUT) >> 32);
+  auto job = table.jobs.find(id);
+  auto finished = table.finished_output.find(id);
+  if (job != table.jobs.end() && job->second.output) {
+    drain_job_output(*job->second.output);
+  } else if (finished != table.finished_output.end()) {
+    drain_job_output(*finished->second);
+  }
+}
+
+// Handles the events of the job table, waiting at most `timeout` milliseconds
+// (-1: until something happens). Finished jobs are reported right away. Sets
+// `input_ready` if the input of the command lines became readable. Returns the
+// number of jobs that were reported.
+int handle_job_events(JobTable& table, int timeout, bool& input_ready) {
+  if (table.epoll_fd == -1) {
+    return 0;
+  }
+
+  epoll_event events[64];
+  int n = epoll_wait(table.epoll_fd, events, 64, timeout);
+  int reported = 0;
+  for (int e = 0; e < n; ++e) {
+    uint64_t data = events[e].data.u64;
+    if (data == EVENT_INPUT) {
+      input_ready = true;
+    } else if (data == EVENT_SIGCHLD) {
+      // Some child changed state: check every process that is still running.
+      TraceSpan span(TRACE_REAP);
+      signalfd_siginfo info;
+      while (read(table.signal_fd, &info, sizeof(info)) > 0) {}
+      for (auto it = table.jobs.begin(); it != table.jobs.end();) {
+        Job& job = (it++)->second;
+        for (size_t i = 0; i < job.pids.size(); ++i) {
+          reap_job_process(job, i, WNOHANG);
+        }
+        reported += finish_job(table, job, true);
+      }
+    } else if (is_output_event(data)) {
+      drain_output_event(table, data);
+    } else {
+      auto it = table.jobs.find(int(data >> 32));
+      if (it != table.jobs.end()) {
+        TraceSpan span(TRACE_REAP);
+        reap_job_process(it->second, size_t(data & 0xffffffff), WNOHANG);
+        reported += finish_job(table, it->second, true);
+      }
+    }
+  }
+  return reported;
+}
+
+// Reports the jobs that finished in the meantime, without blocking.
+void reap_jobs(JobTable& table) {
+  bool input_ready = false;
+  handle_job_events(table, 0, input_ready);
+}
+
+// Waits until all processes of the job are reaped, or until one of them stops
+// if `flags` contains WUNTRACED. Returns the wait status of the last process.
+int wait_for_job(JobTable& table, int id, int flags) {
+  Job& job = table.jobs.at(id);
+  for (size_t i = 0; i < job.pids.size(); ++i) {
+    while (job.pids[i] != -1 && !job.stopped) {
+      if (job.output && job.output->pipe != -1) {
+        // Drain the output meanwhile, or the job blocks on its full pipe. A
+        // stop does not wake up a pidfd, so that is checked now and then.
+        pollfd events[2] = {{job.output->pipe, POLLIN, 0}, {job.pidfds[i], POLLIN, 0}};
+        poll(events, 2, job.pidfds[i] != -1 && !(flags & WUNTRACED) ? -1 : 50);
+        drain_job_output(*job.output);
+        reap_job_process(job, i, flags | WNOHANG);
+      } else {
+        reap_job_process(job, i, flags);
+      }
+    }
+  }
+  int status = job.status;
+  finish_job(table, job, false);
+  return status;
+}
+
+// Finds the job for a `%n` argument, or the most recent job without one.
+// Prints an error and returns -1 if there is no such job.
+int find_job(const JobTable& table, const vector<string>& args) {
+  if (args.size() < 2) {
+    if (table.jobs.empty()) {
+      shell_err << args[0] << ": no current job" << endl;
+      return -1;
+    }
+    return table.jobs.rbegin()->first;
+  }
+  const string& spec = args[1];
+  int id = atoi(spec.c_str() + (spec[0] == '%'));
+  if (!table.jobs.count(id)) {
+    shell_err << args[0] << ": " << spec << ": no such job" << endl;
+    return -1;
+  }
+  return id;
+}
+
+// Exit status for a wait status, like $? in other shells.
+int exit_status(int status) {
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// Input of the command lines, read in large blocks and handed out a line at a time.
+struct InputReader {
+  int fd = STDIN_FILENO;
+  string buffer;
+  size_t pos = 0;
+  bool eof = false;
+};
+
+// Reads the next line from the input into `line`. While it waits for
+// input, it handles the events of the job table, so finished background jobs
+// are reported as soon as they are done. After such a report the prompt is
+// shown again. Returns false at the end of the input.
+bool read_command_line(InputReader& input, JobTable& jobs, bool showPrompt, string& line) {
+  while (true) {
+    size_t newline = input.buffer.find('\n', input.pos);
+    if (newline != string::npos) {
+      line.assign(input.buffer, input.pos, newline - input.pos);
+      input.pos = newline + 1;
+      return true;
+    }
+    if (input.eof) {
+      if (input.pos == input.buffer.size()) {
+        return false;
+      }
+      line.assign(input.buffer, input.pos, string::npos);
+      input.pos = input.buffer.size();
+      return true;
+    }
+
+    bool input_ready = jobs.input_fd != input.fd;
+    while (!input_ready) {
+      if (handle_job_events(jobs, -1, input_ready) > 0 && showPrompt) {
+        display_prompt();
+      }
+    }
+
+    input.buffer.erase(0, input.pos);
+    input.pos = 0;
+    size_t used = input.buffer.size();
+    input.buffer.resize(used + (1 << 16));
+    ssize_t n = read(input.fd, &input.buffer[used], 1 << 16);
+    input.buffer.resize(used + (n > 0 ? n : 0));
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+      input.eof = true;
+    }
+  }
+}
+
+// Adds one to the counter of eventfd `fd`.
+void signal_eventfd(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) == -1) {
+    print_error("eventfd");
+  }
+}
+
+History::~History() {
+  if (indexer.joinable()) {
+    {
+      lock_guard<mutex> guard(lock);
+      stop = true;
+    }
+    signal_eventfd(wake_fd);
+    indexer.join();
+  }
+  if (wake_fd != -1) close(wake_fd);
+  if (done_fd != -1) close(done_fd);
+  if (map) munmap(const_cast<char*>(map), mapped);
+  if (fd != -1) close(fd);
+}
+
+// Maps `size` bytes of the history file at `map` (of `mapped` bytes so far).
+// Returns false on errors.
+bool map_history(int fd, const char*& map, size_t& mapped, size_t size) {
+  if (size <= mapped) {
+    return true;
+  }
+  void* grown = map ? mremap(const_cast<char*>(map), mapped, size, MREMAP_MAYMOVE)
+                    : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (grown == MAP_FAILED) {
+    return false;
+  }
+  map = static_cast<const char*>(grown);
+  mapped = size;
+  return true;
+}
+
+// Splits the records of `data` (`size` bytes) from offset `pos` on into
+// entries. Returns the offset to go on from next time.
+size_t split_history(const char* data, size_t size, size_t pos, vector<pair<uint64_t, uint32_t>>& entries) {
+  while (pos < size) {
+    const char* record = static_cast<const char*>(memchr(data + pos, '\x1e', size - pos));
+    if (!record) {
+      return size; // Nothing but damage.
+    }
+    size_t begin = record - data + 1;
+    const char* end = static_cast<const char*>(memchr(data + begin, '\n', size - begin));
+    if (!end) {
+      return begin - 1; // Still being written: look again next time.
+    }
+    const char* next = static_cast<const char*>(memchr(data + begin, '\x1e', end - (data + begin)));
+    if (next) {
+      pos = next - data; // A record that lost its end.
+      continue;
+    }
+    entries.push_back({begin, uint32_t(end - (data + begin))});
+    pos = end - data + 1;
+  }
+  return pos;
+}
+
+uint32_t trigram(const char* text) {
+  return uint32_t(uint8_t(text[0])) << 16 | uint32_t(uint8_t(text[1])) << 8 | uint8_t(text[2]);
+}
+
+// Appends the entries of `batch`, which come right after those of `into`, and
+// their postings.
+void merge_history(HistoryBatch& into, HistoryBatch&& batch) {
+  if (into.entries.empty()) {
+    into = move(batch);
+    return;
+  }
+  into.entries.insert(into.entries.end(), batch.entries.begin(), batch.entries.end());
+  auto append = [](unordered_map<uint32_t, vector<uint32_t>>& target, const unordered_map<uint32_t, vector<uint32_t>>& lists) {
+    for (const auto& [gram, ids] : lists) {
+      vector<uint32_t>& list = target[gram];
+      list.insert(list.end(), ids.begin(), ids.end());
+    }
+  };
+  append(into.trigrams, batch.trigrams);
+  append(into.prefixes, batch.prefixes);
+}
+
+// Body of the thread of `history`. Whenever a lookup waits for more of the
+// file than its last pass saw, it splits what was appended since (by any
+// shell) into entries and indexes them, then hands them over in `pending`.
+void index_history(History* history) {
+  const char* map = nullptr;
+  size_t mapped = 0, scanned = 0;
+  uint32_t count = 0; // Entries handed over so far.
+  vector<uint32_t> grams;
+  unique_lock<mutex> guard(history->lock);
+  while (true) {
+    if (history->stop) {
+      break;
+    }
+    if (history->requested <= history->checked) {
+      guard.unlock();
+      uint64_t requests;
+      if (read(history->wake_fd, &requests, sizeof(requests)) == -1 && errno != EINTR) {
+        return;
+      }
+      guard.lock();
+      continue;
+    }
+    size_t target = history->requested;
+    guard.unlock();
+
+    struct stat st;
+    size_t size = fstat(history->fd, &st) == 0 ? max<size_t>(st.st_size, mapped) : mapped;
+    if (!map_history(history->fd, map, mapped, size)) {
+      size = mapped; // Left for a later pass.
+    }
+    // A megabyte at a time, so that the session does not wait long for the
+    // thread to stop.
+    HistoryBatch batch;
+    bool stopped = false;
+    size_t chunk = 1 << 20;
+    while (scanned < mapped && !stopped) {
+      size_t end = min(mapped, scanned + chunk);
+      size_t first = batch.entries.size();
+      size_t next = split_history(map, end, scanned, batch.entries);
+      if (next == scanned) {
+        if (end == mapped) break;
+        chunk *= 2; // A record longer than the chunk.
+        continue;
+      }
+      scanned = next;
+      for (size_t i = first; i < batch.entries.size(); ++i) {
+        string_view text(map + batch.entries[i].first, batch.entries[i].second);
+        if (text.size() < 3) {
+          continue;
+        }
+        grams.clear();
+        for (size_t j = 0; j + 3 <= text.size(); ++j) {
+          grams.push_back(trigram(&text[j]));
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        for (uint32_t gram : grams) {
+          batch.trigrams[gram].push_back(count + i);
+        }
+        batch.prefixes[trigram(text.data())].push_back(count + i);
+      }
+      lock_guard<mutex> check(history->lock);
+      stopped = history->stop;
+    }
+    count += batch.entries.size();
+
+    guard.lock();
+    if (stopped) {
+      break;
+    }
+    merge_history(history->pending, move(batch));
+    history->checked = max(size, target);
+    signal_eventfd(history->done_fd);
+  }
+  if (map) munmap(const_cast<char*>(map), mapped);
+}
+
+// Takes the entries and the index of what was appended to the file (by any
+// shell) from the thread, waiting for it if it has not caught up yet.
+void sync_history(History& history) {
+  struct stat st;
+  if (history.fd == -1 || fstat(history.fd, &st) == -1) {
+    return;
+  }
+  HistoryBatch batch;
+  size_t size = st.st_size;
+  {
+    unique_lock<mutex> guard(history.lock);
+    if (size > history.requested) {
+      history.requested = size;
+      signal_eventfd(history.wake_fd);
+    }
+    while (history.checked < size) {
+      guard.unlock();
+      uint64_t passes;
+      if (read(history.done_fd, &passes, sizeof(passes)) == -1 && errno != EINTR) {
+        print_error("history");
+        return;
+      }
+      guard.lock();
+    }
+    batch = move(history.pending);
+    history.pending = {};
+    size = history.checked;
+  }
+  if (!map_history(history.fd, history.map, history.mapped, size)) {
+    print_error("history");
+    return; // The entries would lie outside of the mapping.
+  }
+  merge_history(history, move(batch));
+}
+
+string_view history_entry(const History& history, size_t id) {
+  return string_view(history.map + history.entries[id].first, history.entries[id].second);
+}
+
+bool open_history(History& history, const string& path) {
+  history.fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (history.fd == -1) {
+    print_error(path);
+    return false;
+  }
+  // The thread starts on the file right away; the session maps it as far as
+  // the thread got when it first needs an entry.
+  history.wake_fd = eventfd(0, EFD_CLOEXEC);
+  history.done_fd = eventfd(0, EFD_CLOEXEC);
+  if (history.wake_fd == -1 || history.done_fd == -1) {
+    print_error("eventfd");
+    close(history.fd);
+    history.fd = -1;
+    return false;
+  }
+  struct stat st;
+  history.requested = fstat(history.fd, &st) == 0 ? st.st_size : 0;
+  history.indexer = thread(index_history, &history);
+  return true;
+}
+
+void add_history(History& history, string_view line) {
+  if (history.fd == -1 || line.find_first_not_of(" \t") == string_view::npos) {
+    return;
+  }
+  string record = "\x1e";
+  record += line;
+  record += '\n';
+  if (write(history.fd, record.data(), record.size()) != ssize_t(record.size())) {
+    print_error("history");
+  }
+}
+
+// Candidates come from the shortest posting list of the trigrams of `text`
+// (and of the prefix list), must be in all other lists, and are checked
+// against the entry itself at the end. Texts shorter than a trigram are
+// searched for entry by entry.
+long search_history(History& history, string_view text, bool prefix, size_t before) {
+  sync_history(history);
+  before = min(before, history.entries.size());
+  auto matches = [&](size_t id) {
+    string_view entry = history_entry(history, id);
+    return prefix ? entry.substr(0, text.size()) == text : entry.find(text) != string_view::npos;
+  };
+
+  if (text.size() < 3) {
+    for (size_t id = before; id-- > 0;) {
+      if (matches(id)) return id;
+    }
+    return -1;
+  }
+
+  vector<const vector<uint32_t>*> lists;
+  for (size_t i = 0; i + 3 <= text.size(); ++i) {
+    auto it = history.trigrams.find(trigram(&text[i]));
+    if (it == history.trigrams.end()) return -1;
+    lists.push_back(&it->second);
+  }
+  if (prefix) {
+    auto it = history.prefixes.find(trigram(text.data()));
+    if (it == history.prefixes.end()) return -1;
+    lists.push_back(&it->second);
+  }
+  sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+  lists.erase(unique(lists.begin(), lists.end()), lists.end());
+
+  const vector<uint32_t>& shortest = *lists[0];
+  for (auto it = lower_bound(shortest.begin(), shortest.end(), uint32_t(before)); it != shortest.begin();) {
+    uint32_t id = *--it;
+    bool candidate = true;
+    for (size_t l = 1; l < lists.size() && candidate; ++l) {
+      candidate = binary_search(lists[l]->begin(), lists[l]->end(), id);
+    }
+    if (candidate && matches(id)) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+// Replaces a `!!`, `!n`, `!-n` or `!prefix` word at the start of `line` by
+// the history entry it refers to, and shows the result. Returns false (after
+// printing an error) if there is no such entry.
+bool expand_history(History& history, string& line) {
+  size_t start = line.find_first_not_of(" \t");
+  if (start == string::npos || line[start] != '!' || start + 1 == line.size() || isspace(line[start + 1])) {
+    return true;
+  }
+  size_t end = min(line.find_first_of(" \t", start), line.size());
+  string word = line.substr(start + 1, end - start - 1);
+
+  sync_history(history);
+  long n_entries = history.entries.size();
+  bool number = word.find_first_not_of("0123456789", word[0] == '-') == string::npos && word != "-";
+  long id = -1;
+  if (word == "!") {
+    id = n_entries - 1;
+  } else if (number) {
+    long n = atol(word.c_str());
+    id = n < 0 ? n_entries + n : n - 1;
+  } else {
+    id = search_history(history, word, true, n_entries);
+  }
+  if (id < 0 || id >= n_entries) {
+    shell_err << "!" << word << ": event not found" << endl;
+    return false;
+  }
+  line.replace(start, end - start, history_entry(history, id));
+  shell_out << line << endl;
+  return true;
+}
+
+// Standard input and output of a builtin. Errors go to standard error.
+struct BuiltinIO {
+  int in;
+  int out;
+};
+
+// A builtin runs inside the shell process instead of exec'ing a program, and
+// returns its exit status.
+using BuiltinFunction = int (*)(const vector<string>& args, BuiltinIO& io, JobTable& jobs);
+
+struct Builtin {
+  BuiltinFunction run;
+  // Works on the state of the shell itself (`cd`, `exit`, jobs, ...). As a
+  // single command it always runs in the shell; in a pipeline it runs in a
+  // forked child like other shells do, so it doesn't affect the shell.
+  bool changes_shell;
+  // Whether the builtin supports these arguments. If not, the real program is
+  // executed instead. nullptr: always.
+  bool (*handles)(const vector<string>& args);
+};
+
+// `cd [dir]`: changes the current directory, to $HOME without argument.
+int builtin_cd(const vector<string>& args, BuiltinIO&, JobTable&) {
+  if (args.size() > 2) {
+    shell_err << "cd: too many arguments" << endl;
+    return 1;
+  }
+  const char* home = getenv("HOME");
+  const char* dir = args.size() == 2 ? args[1].c_str() : home;
+  if (!dir) {
+    shell_err << "cd: HOME not set" << endl;
+    return 1;
+  }
+  if (chdir(dir) != 0) {
+    print_error("cd");
+    return 1;
+  }
+  return 0;
+}
+
+// Flag in the status that `exit` returns: the session ends, with the status
+// in the low 8 bits. In a forked child, exit() drops the flag.
+const int EXIT_REQUESTED = 0x100;
+
+// `exit [status]`: leaves the shell.
+int builtin_exit(const vector<string>& args, BuiltinIO&, JobTable&) {
+  return EXIT_REQUESTED | (args.size() > 1 ? atoi(args[1].c_str()) & 0xff : 0);
+}
+
+// `hash` lists the cached command paths, `hash -r` forgets them and
+// `hash name...` looks the names up and remembers them.
+int builtin_hash(const vector<string>& args, BuiltinIO& io, JobTable&) {
+  validate_path_cache();
+
+  if (args.size() == 2 && args[1] == "-r") {
+    active_path_cache->hits.clear();
+    active_path_cache->misses.clear();
+    active_path_cache->ahead.clear();
+    return 0;
+  }
+
+  if (args.size() > 1) {
+    int rc = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+      Resolution resolved = resolve_command(args[i]);
+      if (resolved.error) {
+        shell_err << "hash: " << args[i] << ": not found" << endl;
+        rc = 1;
+      } else if (active_path_cache->hits.count(args[i])) {
+        active_path_cache->hits[args[i]].second = 0; // Only remembered, not used yet.
+      }
+    }
+    return rc;
+  }
+
+  if (active_path_cache->hits.empty()) {
+    return write_all(io.out, "hash: hash table empty\n") ? 0 : 1;
+  }
+  string listing = "hits\tcommand\n";
+  for (const auto& [name, entry] : active_path_cache->hits) {
+    string hits = to_string(entry.second);
+    listing += string(4 - min<size_t>(4, hits.size()), ' ') + hits + "\t" + entry.first + "\n";
+  }
+  return write_all(io.out, listing) ? 0 : 1;
+}
+
+// The captured output of job `spec` (`%n` or n), running or finished, drained
+// up to now. Prints an error and returns nullptr if there is none.
+JobOutput* find_job_output(JobTable& table, const string& name, const string& spec) {
+  int id = atoi(spec.c_str() + (spec[0] == '%'));
+  auto job = table.jobs.find(id);
+  auto finished = table.finished_output.find(id);
+  JobOutput* output = job != table.jobs.end() ? job->second.output.get()
+                      : finished != table.finished_output.end() ? finished->second.get()
+                      : nullptr;
+  if (!output) {
+    shell_err << name << ": " << spec << ": no captured output" << endl;
+    return nullptr;
+  }
+  drain_job_output(*output);
+  return output;
+}
+
+// Where the output that `output` does not hold anymore went, or "".
+string job_output_note(const JobOutput& output) {
+  if (output.dropped > 0) {
+    return to_string(output.dropped) + " earlier bytes dropped";
+  }
+  return output.spill_path.empty() ? "" : "earlier output in " + output.spill_path;
+}
+
+// `jobs`: lists the background jobs. `jobs -o %n` shows the output captured
+// from job n, running or finished; `jobs -o` that of every job, with headers.
+int builtin_jobs(const vector<string>& args, BuiltinIO& io, JobTable& table) {
+  reap_jobs(table);
+  if (args.size() == 3 && args[1] == "-o") {
+    JobOutput* output = find_job_output(table, "jobs", args[2]);
+    if (!output) {
+      return 1;
+    }
+    string note = job_output_note(*output);
+    if (!note.empty()) {
+      shell_err << "jobs: " << args[2] << ": " << note << endl;
+    }
+    return write_job_output(*output, io.out, -1) ? 0 : 1;
+  }
+  if (args.size() == 2 && args[1] == "-o") {
+    map<int, JobOutput*> outputs;
+    for (auto& [id, job] : table.jobs) {
+      if (job.output) outputs[id] = job.output.get();
+    }
+    for (auto& [id, output] : table.finished_output) {
+      outputs[id] = output.get();
+    }
+    for (auto& [id, output] : outputs) {
+      drain_job_output(*output);
+      string note = job_output_note(*output);
+      string header = "[" + to_string(id) + "] " + output->description + (note.empty() ? "" : " (" + note + ")") + "\n";
+      array<string_view, 2> pieces = job_output_pieces(*output);
+      string_view last = pieces[1].empty() ? pieces[0] : pieces[1];
+      if (!write_all(io.out, header) || !write_job_output(*output, io.out, -1) ||
+          (!last.empty() && last.back() != '\n' && !write_all(io.out, "\n"))) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  if (args.size() > 1) {
+    shell_err << "usage: jobs [-o [%n]]" << endl;
+    return 2;
+  }
+  string listing;
+  for (const auto& [id, job] : table.jobs) {
+    listing += "[" + to_string(id) + "] " + (job.stopped ? "stopped  " : "running  ") + job.description + "\n";
+  }
+  return write_all(io.out, listing) ? 0 : 1;
+}
+
+// `tail [-n lines] %n`: the last lines (10 by default) of the output captured
+// from job n. Other uses of tail run the real program.
+bool tail_handles(const vector<string>& args) {
+  return args.size() > 1 && args.back()[0] == '%';
+}
+
+int builtin_tail(const vector<string>& args, BuiltinIO& io, JobTable& table) {
+  long lines = 10;
+  if (args.size() == 4 && args[1] == "-n" && !args[2].empty() &&
+      args[2].find_first_not_of("0123456789") == string::npos) {
+    lines = atol(args[2].c_str());
+  } else if (args.size() != 2) {
+    shell_err << "usage: tail [-n lines] %n" << endl;
+    return 2;
+  }
+  JobOutput* output = find_job_output(table, "tail", args.back());
+  return output && write_job_output(*output, io.out, lines) ? 0 : 1;
+}
+
+// `wait [%n]`: waits for one job, or for all of them. Stopped jobs would never
+// finish: `wait` skips them, like other shells do, and `wait %n` refuses them.
+int builtin_wait(const vector<string>& args, BuiltinIO&, JobTable& table) {
+  if (args.size() < 2) {
+    auto running = [](const pair<const int, Job>& entry) { return !entry.second.stopped; };
+    for (auto job = find_if(table.jobs.begin(), table.jobs.end(), running); job != table.jobs.end();
+         job = find_if(table.jobs.begin(), table.jobs.end(), running)) {
+      wait_for_job(table, job->first, 0);
+    }
+    return 0;
+  }
+  int id = find_job(table, args);
+  if (id != -1 && table.jobs.at(id).stopped) {
+    shell_err << "wait: " << args[1] << ": job is stopped" << endl;
+    return 1;
+  }
+  return id == -1 ? 127 : exit_status(wait_for_job(table, id, 0));
+}
+
+// `bg [%n]`: continues a stopped job in the background.
+int builtin_bg(const vector<string>& args, BuiltinIO&, JobTable& table) {
+  int id = find_job(table, args);
+  if (id == -1) {
+    return 1;
+  }
+  Job& job = table.jobs.at(id);
+  job.stopped = false;
+  shell_out << "[" << id << "] " << job.description << " &" << std::endl;
+  signal_job(job, SIGCONT);
+  return 0;
+}
+
+// The terminal of the session if the shell is its foreground process group,
+// so it can hand the terminal to a pipeline; else -1.
+int foreground_terminal() {
+  int tty = shell_io.in;
+  return isatty(tty) && tcgetpgrp(tty) == getpgrp() ? tty : -1;
+}
+
+// Takes the terminal back from a pipeline or job. SIGTTOU is blocked, since the
+// shell is not the foreground process group anymore at this point.
+void reclaim_terminal(int tty) {
+  sigset_t ttou, previous;
+  sigemptyset(&ttou);
+  sigaddset(&ttou, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &ttou, &previous);
+  tcsetpgrp(tty, getpgrp());
+  sigprocmask(SIG_SETMASK, &previous, nullptr);
+}
+
+// `fg [%n]`: continues a job in the foreground and waits for it.
+int builtin_fg(const vector<string>& args, BuiltinIO&, JobTable& table) {
+  int id = find_job(table, args);
+  if (id == -1) {
+    return 1;
+  }
+  Job& job = table.jobs.at(id);
+  job.stopped = false;
+  shell_out << job.description << std::endl;
+  if (job.output) {
+    // What the job wrote so far, then the rest as it comes.
+    drain_job_output(*job.output);
+    write_job_output(*job.output, shell_io.out, -1);
+    job.output->forward = true;
+  }
+
+  // Hand the terminal to the job while it runs in the foreground.
+  int tty = foreground_terminal();
+  if (tty != -1 && job.pgid > 0) tcsetpgrp(tty, job.pgid);
+  signal_job(job, SIGCONT);
+
+  int status = wait_for_job(table, id, WUNTRACED);
+
+  if (tty != -1) reclaim_terminal(tty);
+
+  if (table.jobs.count(id)) {
+    if (job.output) {
+      job.output->forward = false;
+    }
+    shell_out << "[" << id << "] stopped  " << table.jobs.at(id).description << std::endl;
+    return 0;
+  }
+  return exit_status(status);
+}
+
+// `history [n]`: lists the history, or its last n entries. `history -s text`
+// and `history -p prefix` list the entries that contain `text` or start with
+// `prefix`, newest first.
+int builtin_history(const vector<string>& args, BuiltinIO& io, JobTable&) {
+  if (!active_history || active_history->fd == -1) {
+    shell_err << "history: no history file" << endl;
+    return 1;
+  }
+  History& history = *active_history;
+  sync_history(history);
+
+  string listing;
+  auto list = [&](size_t id) {
+    char number[24];
+    snprintf(number, sizeof(number), "%5zu  ", id + 1);
+    listing += number;
+    listing += history_entry(history, id);
+    listing += '\n';
+  };
+  size_t n_entries = history.entries.size();
+  if (args.size() == 3 && (args[1] == "-s" || args[1] == "-p")) {
+    bool prefix = args[1] == "-p";
+    for (long id = search_history(history, args[2], prefix, n_entries); id != -1;
+         id = search_history(history, args[2], prefix, id)) {
+      list(id);
+    }
+  } else if (args.size() <= 2 && (args.size() == 1 || !is_option(args[1]))) {
+    size_t count = args.size() == 2 ? min<size_t>(n_entries, strtoul(args[1].c_str(), nullptr, 10)) : n_entries;
+    for (size_t id = n_entries - count; id < n_entries; ++id) {
+      list(id);
+    }
+  } else {
+    shell_err << "usage: history [n] | -s text | -p prefix" << endl;
+    return 2;
+  }
+  return write_all(io.out, listing) ? 0 : 1;
+}
+
+int builtin_true(const vector<string>&, BuiltinIO&, JobTable&) {
+  return 0;
+}
+
+int builtin_false(const vector<string>&, BuiltinIO&, JobTable&) {
+  return 1;
+}
+
+// `pwd`: prints the current directory.
+int builtin_pwd(const vector<string>&, BuiltinIO& io, JobTable&) {
+  char buffer[PATH_MAX];
+  if (!getcwd(buffer, sizeof(buffer))) {
+    print_error("pwd");
+    return 1;
+  }
+  return write_all(io.out, string(buffer) + "\n") ? 0 : 1;
+}
+
+// Appends `text` to `out` with the backslash escapes of `echo -e` and printf
+// formats interpreted. Returns false if a `\c` ends all output.
+bool append_escaped(string_view text, string& out) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '\\' || i + 1 == text.size()) {
+      out += text[i];
+      continue;
+    }
+    char c = text[++i];
+    switch (c) {
+      case 'a': out += '\a'; break;
+      case 'b': out += '\b'; break;
+      case 'c': return false;
+      case 'e': out += '\x1b'; break;
+      case 'f': out += '\f'; break;
+      case 'n': out += '\n'; break;
+      case 'r': out += '\r'; break;
+      case 't': out += '\t'; break;
+      case 'v': out += '\v'; break;
+      case '\\': out += '\\'; break;
+      case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+        // \0nnn (echo) and \nnn (printf): up to three octal digits.
+        size_t start = c == '0' ? i + 1 : i, end = start;
+        int value = 0;
+        while (end < text.size() && end < start + 3 && text[end] >= '0' && text[end] <= '7') {
+          value = value * 8 + (text[end++] - '0');
+        }
+        out += char(value);
+        i = end - 1;
+        break;
+      }
+      case 'x': {
+        size_t end = i + 1;
+        int value = 0;
+        while (end < text.size() && end < i + 3 && isxdigit((unsigned char)text[end])) {
+          value = value * 16 + (isdigit((unsigned char)text[end]) ? text[end] - '0' : (tolower(text[end]) - 'a' + 10));
+          end++;
+        }
+        if (end == i + 1) {
+          out += "\\x";
+        } else {
+          out += char(value);
+          i = end - 1;
+        }
+        break;
+      }
+      default:
+        out += '\\';
+        out += c;
+    }
+  }
+  return true;
+}
+
+// `echo [-neE] [arg...]`
+int builtin_echo(const vector<string>& args, BuiltinIO& io, JobTable&) {
+  bool newline = true, escapes = false;
+  size_t i = 1;
+  // Leading arguments made of only n, e and E letters are options.
+  for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-' &&
+         args[i].find_first_not_of("neE", 1) == string::npos; ++i) {
+    for (char c : args[i].substr(1)) {
+      if (c == 'n') newline = false;
+      if (c == 'e') escapes = true;
+      if (c == 'E') escapes = false;
+    }
+  }
+
+  string out;
+  for (size_t first = i; i < args.size(); ++i) {
+    if (i > first) out += ' ';
+    if (escapes && !append_escaped(args[i], out)) {
+      return write_all(io.out, out) ? 0 : 1;
+    }
+    if (!escapes) out += args[i];
+  }
+  if (newline) out += '\n';
+  return write_all(io.out, out) ? 0 : 1;
+}
+
+// Parses a numeric printf argument: decimal, octal, hex or 'c (the character code).
+bool printf_number(const string& arg, long long& value) {
+  if (arg.empty()) {
+    value = 0;
+    return true;
+  }
+  if (arg[0] == '\'' || arg[0] == '"') {
+    value = arg.size() > 1 ? (unsigned char)arg[1] : 0;
+    return true;
+  }
+  char* end;
+  errno = 0;
+  value = strtoll(arg.c_str(), &end, 0);
+  return errno == 0 && *end == '\0';
+}
+
+// Formats `text` for a %s conversion with `spec` (`%[flags][width][.precision]`):
+// at most `precision` bytes of it, padded with spaces to `width`, on the right
+// with the `-` flag. Unlike snprintf into a buffer, for any length of `text`.
+string format_text(string_view text, const string& spec) {
+  size_t i = 1;
+  bool left = false;
+  for (; i < spec.size() && strchr("-+ #0", spec[i]); ++i) {
+    left |= spec[i] == '-';
+  }
+  size_t width = strtoul(spec.c_str() + i, nullptr, 10);
+  size_t dot = spec.find('.');
+  if (dot != string::npos) {
+    text = text.substr(0, strtoul(spec.c_str() + dot + 1, nullptr, 10));
+  }
+  string padding(width > text.size() ? width - text.size() : 0, ' ');
+  return left ? string(text) + padding : padding + string(text);
+}
+
+// `printf format [arg...]`: the format is reused until all arguments are consumed.
+int builtin_printf(const vector<string>& args, BuiltinIO& io, JobTable&) {
+  if (args.size() < 2) {
+    shell_err << "printf: usage: printf format [arguments]" << endl;
+    return 2;
+  }
+  const string& format = args[1];
+  size_t next = 2;
+  int rc = 0;
+  string out;
+  auto argument = [&]() -> string { return next < args.size() ? args[next++] : ""; };
+
+  do {
+    bool consumed = false;
+    for (size_t i = 0; i < format.size(); ++i) {
+      if (format[i] == '\\') {
+        // A single escape at a time, so `\c` can stop here.
+        size_t end = i + 1;
+        if (end < format.size() && (format[end] == 'x' || (format[end] >= '0' && format[end] <= '7'))) {
+          while (end + 1 < format.size() && end < i + 4 && isxdigit((unsigned char)format[end + 1])) end++;
+        }
+        if (!append_escaped(string_view(format).substr(i, end - i + 1), out)) {
+          return write_all(io.out, out) ? rc : 1;
+        }
+        i = end;
+        continue;
+      }
+      if (format[i] != '%') {
+        out += format[i];
+        continue;
+      }
+      if (i + 1 < format.size() && format[i + 1] == '%') {
+        out += '%';
+        i++;
+        continue;
+      }
+
+      // %[flags][width][.precision]conversion
+      size_t start = i++;
+      while (i < format.size() && strchr("-+ #0", format[i])) i++;
+      while (i < format.size() && isdigit((unsigned char)format[i])) i++;
+      if (i < format.size() && format[i] == '.') {
+        i++;
+        while (i < format.size() && isdigit((unsigned char)format[i])) i++;
+      }
+      if (i == format.size()) {
+        shell_err << "printf: " << format.substr(start) << ": invalid conversion specification" << endl;
+        return 1;
+      }
+      char conversion = format[i];
+      string spec = format.substr(start, i - start);
+      consumed = true;
+      char buffer[512];
+      string arg = argument();
+
+      switch (conversion) {
+        case 's':
+          out += format_text(arg, spec);
+          break;
+        case 'b': {
+          string expanded;
+          bool more = append_escaped(arg, expanded);
+          out += format_text(expanded, spec);
+          if (!more) return write_all(io.out, out) ? rc : 1;
+          break;
+        }
+        case 'c':
+          out += format_text(string_view(arg).substr(0, 1), spec.substr(0, spec.find('.')));
+          break;
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': {
+          long long value;
+          if (!printf_number(arg, value)) {
+            shell_err << "printf: " << arg << ": invalid number" << endl;
+            rc = 1;
+          }
+          snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(), value);
+          out += buffer;
+          break;
+        }
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+          char* end;
+          double value = arg.empty() ? 0 : strtod(arg.c_str(), &end);
+          if (!arg.empty() && *end != '\0') {
+            shell_err << "printf: " << arg << ": invalid number" << endl;
+            rc = 1;
+          }
+          snprintf(buffer, sizeof(buffer), (spec + conversion).c_str(), value);
+          out += buffer;
+          break;
+        }
+        default:
+          shell_err << "printf: %" << conversion << ": invalid directive" << endl;
+          return 1;
+      }
+    }
+    if (!consumed) break;
+  } while (next < args.size());
+
+  return write_all(io.out, out) ? rc : 1;
+}
+
+// Evaluates the expression of `test` in args[begin, end) by the POSIX rules for
+// the number of arguments, with -a, -o and parentheses on top. Sets `error` on
+// a malformed expression.
+bool evaluate_test(const vector<string>& args, size_t begin, size_t end, bool& error);
+
+// A unary file or string test such as `-f path`.
+bool unary_test(const string& op, const string& arg, bool& error) {
+  struct stat st;
+  if (op == "-n") return !arg.empty();
+  if (op == "-z") return arg.empty();
+  if (op == "-L" || op == "-h") return lstat(arg.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+  if (op == "-t") return isatty(atoi(arg.c_str()));
+  if (op == "-r") return access(arg.c_str(), R_OK) == 0;
+  if (op == "-w") return access(arg.c_str(), W_OK) == 0;
+  if (op == "-x") return access(arg.c_str(), X_OK) == 0;
+  bool exists = stat(arg.c_str(), &st) == 0;
+  if (op == "-e") return exists;
+  if (op == "-f") return exists && S_ISREG(st.st_mode);
+  if (op == "-d") return exists && S_ISDIR(st.st_mode);
+  if (op == "-s") return exists && st.st_size > 0;
+  if (op == "-p") return exists && S_ISFIFO(st.st_mode);
+  if (op == "-b") return exists && S_ISBLK(st.st_mode);
+  if (op == "-c") return exists && S_ISCHR(st.st_mode);
+  if (op == "-S") return exists && S_ISSOCK(st.st_mode);
+  shell_err << "test: " << op << ": unary operator expected" << endl;
+  error = true;
+  return false;
+}
+
+bool is_unary_test(const string& op) {
+  return op.size() == 2 && op[0] == '-' && strchr("nzLhtrwxefdspbcS", op[1]);
+}
+
+bool is_binary_test(const string& op) {
+  return op == "=" || op == "==" || op == "!=" || op == "<" || op == ">" || op == "-eq" || op == "-ne" ||
+         op == "-lt" || op == "-le" || op == "-gt" || op == "-ge" || op == "-nt" || op == "-ot" || op == "-ef";
+}
+
+// A binary test such as `a = b` or `1 -lt 2`.
+bool binary_test(const string& left, const string& op, const string& right, bool& error) {
+  if (op == "=" || op == "==") return left == right;
+  if (op == "!=") return left != right;
+  if (op == "<") return left < right;
+  if (op == ">") return left > right;
+  if (op == "-nt" || op == "-ot" || op == "-ef") {
+    struct stat l, r;
+    bool has_l = stat(left.c_str(), &l) == 0, has_r = stat(right.c_str(), &r) == 0;
+    if (op == "-ef") return has_l && has_r && l.st_dev == r.st_dev && l.st_ino == r.st_ino;
+    auto newer = [](const struct stat& a, const struct stat& b) {
+      return a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec > b.st_mtim.tv_sec : a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+    };
+    return op == "-nt" ? has_l && (!has_r || newer(l, r)) : has_r && (!has_l || newer(r, l));
+  }
+  auto integer = [&](const string& number, long long& value) {
+    char* end;
+    errno = 0;
+    value = strtoll(number.c_str(), &end, 10);
+    if (number.empty() || *end != '\0' || errno) {
+      shell_err << "test: " << number << ": integer expression expected" << endl;
+      error = true;
+      return false;
+    }
+    return true;
+  };
+  long long a = 0, b = 0;
+  if (!integer(left, a) || !integer(right, b)) {
+    return false;
+  }
+  if (op == "-eq") return a == b;
+  if (op == "-ne") return a != b;
+  if (op == "-lt") return a < b;
+  if (op == "-le") return a <= b;
+  if (op == "-gt") return a > b;
+  return a >= b;
+}
+
+bool evaluate_test(const vector<string>& args, size_t begin, size_t end, bool& error) {
+  size_t n = end - begin;
+  auto arg = [&](size_t k) -> const string& { return args[begin + k]; };
+
+  // The fixed forms for up to four arguments.
+  if (n == 0) return false;
+  if (n == 1) return !arg(0).empty();
+  if (n == 2) {
+    if (arg(0) == "!") return arg(1).empty();
+    if (is_unary_test(arg(0))) return unary_test(arg(0), arg(1), error);
+  }
+  if (n == 3) {
+    if (is_binary_test(arg(1))) return binary_test(arg(0), arg(1), arg(2), error);
+    if (arg(0) == "!") return !evaluate_test(args, begin + 1, end, error);
+    if (arg(0) == "(" && arg(2) == ")") return !arg(1).empty();
+  }
+  if (n == 4 && arg(0) == "!") return !evaluate_test(args, begin + 1, end, error);
+  if (n == 4 && arg(0) == "(" && arg(3) == ")") return evaluate_test(args, begin + 1, end - 1, error);
+
+  // Otherwise: -o binds weaker than -a, outside of parentheses.
+  for (const char* op : {"-o", "-a"}) {
+    int depth = 0;
+    for (size_t k = n; k-- > 1;) {
+      if (arg(k) == ")") depth++;
+      if (arg(k) == "(") depth--;
+      if (depth == 0 && arg(k) == op && k + 1 < n) {
+        bool left = evaluate_test(args, begin, begin + k, error);
+        bool right = evaluate_test(args, begin + k + 1, end, error);
+        return op[1] == 'o' ? left || right : left && right;
+      }
+    }
+  }
+  if (arg(0) == "!") return !evaluate_test(args, begin + 1, end, error);
+  if (arg(0) == "(" && arg(n - 1) == ")") return evaluate_test(args, begin + 1, end - 1, error);
+
+  shell_err << "test: too many arguments" << endl;
+  error = true;
+  return false;
+}
+
+// `test expr` and `[ expr ]`: exit status 0 if true, 1 if false, 2 on errors.
+int builtin_test(const vector<string>& args, BuiltinIO&, JobTable&) {
+  size_t end = args.size();
+  if (args[0] == "[") {
+    if (args.back() != "]") {
+      shell_err << "[: missing `]'" << endl;
+      return 2;
+    }
+    end--;
+  }
+  bool error = false;
+  bool result = evaluate_test(args, 1, end, error);
+  return error ? 2 : !result;
+}
+
+// Whether `cat`/`cp` can be done by the zero-copy data movers: no options, and
+// for `cp` exactly a source and a destination.
+bool data_mover_handles(const vector<string>& args) {
+  if (!use_data_movers) {
+    return false;
+  }
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (is_option(args[i])) return false;
+  }
+  return args[0] == "cat" || args.size() == 3;
+}
+
+// `cat [file...]`: copies the files (or standard input if there are none, or for `-`) to the output.
+// A reader that goes away ends it with the status of SIGPIPE, like the program.
+int builtin_cat(const vector<string>& parts, BuiltinIO& io, JobTable&) {
+  if (parts.size() == 1) {
+    int error = copy_fd(io.in, io.out);
+    if (error == EPIPE) return 128 + SIGPIPE;
+    if (error) shell_err << "cat: " << strerror(error) << endl;
+    return error ? 1 : 0;
+  }
+
+  int rc = 0;
+  for (size_t i = 1; i < parts.size(); ++i) {
+    int fd = parts[i] == "-" ? io.in : open(parts[i].c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      shell_err << "cat: " << parts[i] << ": " << strerror(errno) << endl;
+      rc = 1;
+      continue;
+    }
+    int error = copy_fd(fd, io.out);
+    if (fd != io.in) close(fd);
+    if (error == EPIPE) return 128 + SIGPIPE;
+    if (error) {
+      shell_err << "cat: " << parts[i] << ": " << strerror(error) << endl;
+      rc = 1;
+    }
+  }
+  return rc;
+}
+
+// `cp src dst`: copies a single file, into `dst` if that is a directory.
+int builtin_cp(const vector<string>& parts, BuiltinIO&, JobTable&) {
+  const string& src = parts[1];
+  string dst = parts[2];
+
+  int fd_in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st_in, st_dst;
+  if (fd_in == -1 || fstat(fd_in, &st_in) == -1) {
+    shell_err << "cp: cannot stat '" << src << "': " << strerror(errno) << endl;
+    if (fd_in != -1) close(fd_in);
+    return 1;
+  }
+  // Before `dst` is opened, which truncates it.
+  if (S_ISDIR(st_in.st_mode)) {
+    shell_err << "cp: -r not specified; omitting directory '" << src << "'" << endl;
+    close(fd_in);
+    return 1;
+  }
+  if (stat(dst.c_str(), &st_dst) == 0 && S_ISDIR(st_dst.st_mode)) {
+    dst += "/" + src.substr(src.find_last_of('/') + 1);
+  }
+  if (stat(dst.c_str(), &st_dst) == 0 && st_dst.st_dev == st_in.st_dev && st_dst.st_ino == st_in.st_ino) {
+    shell_err << "cp: '" << src << "' and '" << dst << "' are the same file" << endl;
+    close(fd_in);
+    return 1;
+  }
+
+  int fd_out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st_in.st_mode & 0777);
+  if (fd_out == -1) {
+    shell_err << "cp: cannot create regular file '" << dst << "': " << strerror(errno) << endl;
+    close(fd_in);
+    return 1;
+  }
+  int error = copy_fd(fd_in, fd_out);
+  if (error) {
+    shell_err << "cp: error copying '" << src << "' to '" << dst << "': " << strerror(error) << endl;
+  }
+  close(fd_in);
+  close(fd_out);
+  return error ? 1 : 0;
+}
+
+// `set -o option` and `set +o option`: turn pipefail or failfast on and off.
+// `set -o` lists them.
+int builtin_set(const vector<string>& args, BuiltinIO& io, JobTable&) {
+  const pair<const char*, bool*> options[] = {{"pipefail", &pipefail}, {"failfast", &failfast}};
+  if (args.size() == 2 && args[1] == "-o") {
+    string listing;
+    for (const auto& [name, value] : options) {
+      listing += string(name) + (*value ? "\ton\n" : "\toff\n");
+    }
+    return write_all(io.out, listing) ? 0 : 1;
+  }
+  if (args.size() == 3 && (args[1] == "-o" || args[1] == "+o")) {
+    for (const auto& [name, value] : options) {
+      if (args[2] == name) {
+        *value = args[1] == "-o";
+        return 0;
+      }
+    }
+    shell_err << "set: " << args[2] << ": invalid option name" << endl;
+    return 1;
+  }
+  shell_err << "usage: set [-o | -o option | +o option]" << endl;
+  return 2;
+}
+
+// All builtins by name. Looked up once per command.
+// Defined after execute_commands, since it starts pipelines itself.
+int builtin_parallel(const vector<string>& args, BuiltinIO& io, JobTable& jobs);
+// Defined with the `time` table, which it shares the formatting with.
+int builtin_stats(const vector<string>& args, BuiltinIO& io, JobTable&);
+
+const unordered_map<string, Builtin> builtins = {
+  {"cd", {builtin_cd, true, nullptr}},
+  {"exit", {builtin_exit, true, nullptr}},
+  {"hash", {builtin_hash, true, nullptr}},
+  {"jobs", {builtin_jobs, true, nullptr}},
+  {"tail", {builtin_tail, false, tail_handles}},
+  {"wait", {builtin_wait, true, nullptr}},
+  {"fg", {builtin_fg, true, nullptr}},
+  {"bg", {builtin_bg, true, nullptr}},
+  {"history", {builtin_history, false, nullptr}},
+  {"true", {builtin_true, false, nullptr}},
+  {"false", {builtin_false, false, nullptr}},
+  {"pwd", {builtin_pwd, false, nullptr}},
+  {"echo", {builtin_echo, false, nullptr}},
+  {"printf", {builtin_printf, false, nullptr}},
+  {"test", {builtin_test, false, nullptr}},
+  {"[", {builtin_test, false, nullptr}},
+  {"cat", {builtin_cat, false, data_mover_handles}},
+  {"cp", {builtin_cp, false, data_mover_handles}},
+  {"parallel", {builtin_parallel, false, nullptr}},
+  {"stats", {builtin_stats, true, nullptr}},
+  {"set", {builtin_set, true, nullptr}},
+};
+
+// The builtin that runs `cmd`, or nullptr if it is an external program.
+const Builtin* find_builtin(const Command& cmd) {
+  if (cmd.parts.empty()) {
+    return nullptr;
+  }
+  auto it = builtins.find(cmd.parts[0]);
+  if (it == builtins.end() || (it->second.handles && !it->second.handles(cmd.parts))) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+bool empty_or_whitespace(string_view str) {
+  return str.find_first_not_of(' ') == std::string::npos;
+}
+
+// Splits `str` at every `delimiter`, leaving out empty parts.
+vector<string> split_string(const string& str, char delimiter) {
+  vector<string> parts;
+  size_t start = 0;
+  while (start < str.size()) {
+    size_t end = str.find(delimiter, start);
+    if (end == string::npos) end = str.size();
+    if (end > start) parts.push_back(str.substr(start, end - start));
+    start = end + 1;
+  }
+  return parts;
+}
+
+// The lexer only has to stop at quotes, `|` and whitespace (isspace in the C
+// locale: space, \t, \n, \v, \f and \r). Everything else is copied as is.
+inline bool is_lexer_special(unsigned char c) {
+  return c == '\'' || c == '"' || c == '|' || c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Returns the position of the first special byte at or after `pos`, or the
+// length of the line if there is none. Scans 16 bytes at a time with SSE2.
+size_t find_lexer_special(string_view line, size_t pos) {
+#ifdef __SSE2__
+  const __m128i single_quote = _mm_set1_epi8('\''), double_quote = _mm_set1_epi8('"');
+  const __m128i pipe = _mm_set1_epi8('|'), space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+  while (pos + 16 <= line.size()) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line.data() + pos));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, single_quote), _mm_cmpeq_epi8(chunk, double_quote)),
+                               _mm_or_si128(_mm_cmpeq_epi8(chunk, pipe), _mm_cmpeq_epi8(chunk, space)));
+    // \t..\r: c - '\t' <= 4 as unsigned bytes.
+    __m128i from_tab = _mm_sub_epi8(chunk, tab);
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(from_tab, four), from_tab));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) {
+      return pos + __builtin_ctz(mask);
+    }
+    pos += 16;
+  }
+#endif
+  while (pos < line.size() && !is_lexer_special(line[pos])) {
+    pos++;
+  }
+  return pos;
+}
+
+// Lexes `line` in a single pass into arena.tokens, one group per command.
+// Quotes work in two layers, exactly like the shell always did when it split
+// the line on `|` first and every command on whitespace afterwards:
+//  - Quote characters are removed and make `|` literal.
+//  - Quote characters that were literal in the first layer (a ' between "...",
+//    or a " between '...') are removed as well and make whitespace literal.
+// Each layer reports unbalanced quotes. Commands that consist of nothing but
+// spaces and tabs are dropped, which is an error if the line contains a `|`.
+// Tokens that contain only spaces are dropped too.
+// Returns a combination of the PARSE_ERROR_ flags.
+int lex_command_line(string_view line, ParseArena& arena) {
+  arena.tokens.clear();
+  arena.command_ends.clear();
+  arena.scratch.clear();
+
+  bool pipe_single = false, pipe_double = false;   // First layer: protects `|`.
+  bool space_single = false, space_double = false; // Second layer: protects whitespace.
+  bool balanced = true, empty_command = false;
+  size_t n_segments = 0, segment_start = 0;
+  bool segment_content = false; // Whether the command has more than spaces and tabs.
+
+  Token current = {false, 0, 0};
+  bool current_not_spaces = false;
+  bool current_quoted = false; // Whether a quote character was removed from the current token.
+
+  // Appends line[pos, pos + n) to the current token. The token stays a slice of
+  // the line as long as nothing was removed from the middle of it; otherwise
+  // it is continued in the scratch buffer (it is always the last thing there).
+  auto append = [&](size_t pos, size_t n) {
+    if (current.length == 0) {
+      current = {false, pos, n};
+    } else if (!current.in_scratch && current.offset + current.length == pos) {
+      current.length += n;
+    } else {
+      if (!current.in_scratch) {
+        size_t offset = arena.scratch.size();
+        arena.scratch.append(line.substr(current.offset, current.length));
+        current = {true, offset, current.length};
+      }
+      arena.scratch.append(line.substr(pos, n));
+      current.length += n;
+    }
+  };
+  auto end_token = [&]() {
+    if (current.length > 0 && current_not_spaces) {
+      arena.tokens.push_back(current);
+      arena.tokens.back().quoted = current_quoted;
+    }
+    current.length = 0;
+    current_not_spaces = current_quoted = false;
+  };
+  auto end_segment = [&]() {
+    end_token();
+    if (segment_content) {
+      if (space_single || space_double) {
+        balanced = false;
+      }
+      arena.command_ends.push_back(arena.tokens.size());
+    } else {
+      arena.tokens.resize(segment_start);
+      empty_command = true;
+    }
+    space_single = space_double = false;
+    segment_content = false;
+    segment_start = arena.tokens.size();
+    n_segments++;
+  };
+
+  size_t pos = 0;
+  while (true) {
+    size_t next = find_lexer_special(line, pos);
+    if (next > pos) {
+      append(pos, next - pos);
+      current_not_spaces = segment_content = true;
+    }
+    if (next == line.size()) {
+      break;
+    }
+    char c = line[next];
+    pos = next + 1;
+
+    // First layer.
+    if (c == '\'' && !pipe_double) {
+      pipe_single = !pipe_single;
+      current_quoted = true;
+      continue;
+    }
+    if (c == '"' && !pipe_single) {
+      pipe_double = !pipe_double;
+      current_quoted = true;
+      continue;
+    }
+    if (c == '|' && !pipe_single && !pipe_double) {
+      end_segment();
+      continue;
+    }
+
+    // Second layer.
+    if (c != ' ' && c != '\t') {
+      segment_content = true;
+    }
+    if (c == '\'' && !space_double) {
+      space_single = !space_single;
+      current_quoted = true;
+      continue;
+    }
+    if (c == '"' && !space_single) {
+      space_double = !space_double;
+      current_quoted = true;
+      continue;
+    }
+    bool whitespace = c != '|' && c != '\'' && c != '"';
+    if (whitespace && !space_single && !space_double) {
+      end_token();
+      continue;
+    }
+    append(next, 1);
+    if (c != ' ') {
+      current_not_spaces = true;
+    }
+  }
+  end_segment();
+
+  if (pipe_single || pipe_double) {
+    balanced = false;
+  }
+
+  int errors = 0;
+  if (!balanced) errors |= PARSE_ERROR_QUOTES;
+  if (empty_command && n_segments > 1) errors |= PARSE_ERROR_PIPE;
+  return errors;
+}
+
+// The text of a token.
+string_view token_text(string_view line, const ParseArena& arena, const Token& token) {
+  if (token.in_scratch) {
+    return string_view(arena.scratch).substr(token.offset, token.length);
+  }
+  return line.substr(token.offset, token.length);
+}
+
+// Takes the body of a heredoc from `text`: the lines up to the one that is just
+// `delimiter`. Returns the length of what was taken, the delimiter line
+// included, or npos if there is no such line (then the body is all of `text`).
+size_t take_heredoc(string_view text, string_view delimiter, string& body) {
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find('\n', pos);
+    string_view line = text.substr(pos, end == string_view::npos ? string_view::npos : end - pos);
+    if (line == delimiter) {
+      body.assign(text.substr(0, pos));
+      return end == string_view::npos ? text.size() : end + 1;
+    }
+    if (end == string_view::npos) break;
+    pos = end + 1;
+  }
+  body.assign(text);
+  if (!body.empty() && body.back() != '\n') {
+    body += '\n';
+  }
+  return string_view::npos;
+}
+
+// note: For such a simple shell, there is little need for a full-blown parser (as in an LL or LR capable parser).
+// Here, the user input can be parsed using the following approach.
+// First, the line is cut into tokens per command (as they can be chained, separated by `|`) in a single pass.
+// Next, the first command is checked for the `<`, `<<<` and `<<` operators, and the last command for the `>` and `&` operators.
+// The result is stored in arena.expression, which keeps the memory of its vectors and strings from line to line.
+// Returns a combination of the PARSE_ERROR_ flags, 0 on success.
+int parse_command_line(string_view line, ParseArena& arena) {
+  TraceSpan span(TRACE_PARSE);
+  // Only a heredoc continues after the first line; its body is not lexed.
+  string_view body;
+  size_t newline = line.find('\n');
+  if (newline != string_view::npos && line.substr(0, newline).find("<<") != string_view::npos) {
+    body = line.substr(newline + 1);
+    line = line.substr(0, newline);
+  }
+  int errors = lex_command_line(line, arena);
+
+  Expression& expression = arena.expression;
+  expression.inputFromFile.clear();
+  expression.inputDocument.clear();
+  expression.inputInline = false;
+  expression.outputToFile.clear();
+  expression.background = false;
+  expression.inputExpandable = expression.outputExpandable = false;
+  arena.heredoc.clear();
+  arena.heredoc_open = false;
+
+  size_t n_commands = arena.command_ends.size();
+  expression.commands.resize(n_commands);
+
+  size_t begin = 0;
+  for (size_t i = 0; i < n_commands; ++i) {
+    size_t end = arena.command_ends[i];
+    auto text = [&](size_t index) { return token_text(line, arena, arena.tokens[index]); };
+    // Whether the word is expanded before the command runs.
+    auto expandable = [&](size_t index) {
+      return !arena.tokens[index].quoted && text(index).find_first_of("$*?[") != string_view::npos;
+    };
+
+    if (i == n_commands - 1 && end - begin > 1 && text(end - 1) == "&") {
+      expression.background = true;
+      end -= 1;
+    }
+    // Output redirections at the end of the command.
+    vector<Redirection>& redirections = expression.commands[i].redirections;
+    redirections.clear();
+    while (end - begin > 1) {
+      string_view op = end - begin > 2 ? text(end - 2) : "";
+      if (text(end - 1) == "2>&1") {
+        redirections.push_back({2, "", false});
+        end -= 1;
+      } else if (op == ">" || op == ">>" || op == "2>" || op == "2>>") {
+        redirections.push_back({op[0] == '2' ? 2 : 1, string(text(end - 1)), op == ">>" || op == "2>>", expandable(end - 1)});
+        end -= 2;
+      } else {
+        break;
+      }
+    }
+    reverse(redirections.begin(), redirections.end());
+    if (i == n_commands - 1 && redirections.size() == 1 && redirections[0].fd == 1 && !redirections[0].append) {
+      expression.outputToFile.swap(redirections[0].path);
+      expression.outputExpandable = redirections[0].expandable;
+      redirections.clear();
+    }
+    if (i == 0 && end - begin > 2 && text(end - 2) == "<") {
+      expression.inputFromFile.assign(text(end - 1));
+      expression.inputExpandable = expandable(end - 1);
+      end -= 2;
+    } else if (i == 0) {
+      // `<<< word...`: the rest of the command, as one line.
+      size_t here = end;
+      while (here > begin + 1 && text(here - 1).substr(0, 3) != "<<<") here--;
+      bool here_string = here > begin + 1;
+      if (here_string && (here < end || text(here - 1).size() > 3)) {
+        string& document = expression.inputDocument;
+        document.assign(text(here - 1).substr(3));
+        for (size_t j = here; j < end; ++j) {
+          if (!document.empty()) document += ' ';
+          document.append(text(j));
+        }
+        document += '\n';
+        expression.inputInline = true;
+        end = here - 1;
+      } else if (here_string) {
+        // `<<<` without a word is left as an argument.
+      } else if (end - begin > 1 && text(end - 1).size() > 2 && text(end - 1).substr(0, 2) == "<<") {
+        arena.heredoc.assign(text(end - 1).substr(2));
+        end -= 1;
+      } else if (end - begin > 2 && text(end - 2) == "<<") {
+        arena.heredoc.assign(text(end - 1));
+        end -= 2;
+      }
+      if (!arena.heredoc.empty()) {
+        arena.heredoc_open = take_heredoc(body, arena.heredoc, expression.inputDocument) == string_view::npos;
+        expression.inputInline = true;
+      }
+    }
+
+    vector<string>& parts = expression.commands[i].parts;
+    vector<bool>& expandable_parts = expression.commands[i].expandable;
+    parts.resize(end - begin);
+    expandable_parts.assign(end - begin, false);
+    bool expand = false;
+    for (size_t j = begin; j < end; ++j) {
+      parts[j - begin].assign(text(j));
+      if (expandable(j)) {
+        expandable_parts[j - begin] = expand = true;
+      }
+    }
+    if (!expand) {
+      expandable_parts.clear();
+    }
+    expression.commands[i].splits.clear();
+    begin = arena.command_ends[i];
+  }
+
+  return errors;
+}
+
+// Prints the messages for the PARSE_ERROR_ flags in `errors`, each preceded by `prefix`.
+void print_parse_errors(int errors, const string& prefix = "") {
+  if (errors & PARSE_ERROR_QUOTES) {
+    shell_err << prefix << "Parse error: Unbalanced quotes in one or more commands." << endl;
+  }
+  if (errors & PARSE_ERROR_PIPE) {
+    shell_err << prefix << "Parse error: Incorrect usage of `|`." << endl;
+  }
+}
+
+// Parses a line into a new expression and prints the parse errors. success is
+// set to false if there are any.
+Expression parse_command_line(const string& commandLine, bool& success) {
+  ParseArena arena;
+  int errors = parse_command_line(commandLine, arena);
+  if (errors) {
+    print_parse_errors(errors);
+    success = false;
+  }
+  return move(arena.expression);
+}
+
+// A glob pattern for one component of a path, compiled into a list of steps:
+// literal text, `?`, `*` and `[...]` sets.
+struct GlobPattern {
+  enum Kind { Literal, Any, Star, Set };
+  struct Step {
+    Kind kind;
+    string text;     // Literal.
+    bitset<256> set; // Set.
+  };
+  vector<Step> steps;
+  bool dot = false;  // Whether it may match names that start with '.'.
+  string suffix;     // Literal text the names must end with, checked first.
+};
+
+// Parses the set `[...]` at `pattern[pos]` into `set`. Returns the position
+// after the `]`, or npos if it is not closed (then `[` is an ordinary byte).
+size_t parse_glob_set(const string& pattern, size_t pos, bitset<256>& set) {
+  static const pair<const char*, int (*)(int)> classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+  };
+  set.reset();
+  size_t i = pos + 1;
+  bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+  if (negate) i++;
+  size_t first = i;
+  for (; i < pattern.size() && (pattern[i] != ']' || i == first); ++i) {
+    unsigned char c = pattern[i];
+    if (c == '[' && pattern.compare(i, 2, "[:") == 0) {
+      size_t end = pattern.find(":]", i + 2);
+      if (end != string::npos) {
+        string name = pattern.substr(i + 2, end - i - 2);
+        for (const auto& [class_name, test] : classes) {
+          if (name != class_name) continue;
+          for (int b = 0; b < 256; ++b) {
+            if (test(b)) set.set(b);
+          }
+        }
+        i = end + 1;
+        continue;
+      }
+    }
+    if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+      for (int b = c; b <= (unsigned char)pattern[i + 2]; ++b) set.set(b);
+      i += 2;
+    } else {
+      set.set(c);
+    }
+  }
+  if (i == pattern.size()) {
+    return string::npos;
+  }
+  if (negate) set.flip();
+  return i + 1;
+}
+
+// Compiles one path component. Returns false if it has no pattern in it.
+bool compile_glob(const string& pattern, GlobPattern& glob) {
+  glob.steps.clear();
+  bool wildcard = false;
+  for (size_t i = 0; i < pattern.size();) {
+    char c = pattern[i];
+    GlobPattern::Step step = {GlobPattern::Literal, "", {}};
+    size_t next;
+    if (c == '*') {
+      step.kind = GlobPattern::Star;
+      while (i < pattern.size() && pattern[i] == '*') i++;
+    } else if (c == '?') {
+      step.kind = GlobPattern::Any;
+      i++;
+    } else if (c == '[' && (next = parse_glob_set(pattern, i, step.set)) != string::npos) {
+      step.kind = GlobPattern::Set;
+      i = next;
+    } else {
+      if (!glob.steps.empty() && glob.steps.back().kind == GlobPattern::Literal) {
+        glob.steps.back().text += c;
+      } else {
+        step.text = c;
+        glob.steps.push_back(step);
+      }
+      i++;
+      continue;
+    }
+    wildcard = true;
+    glob.steps.push_back(step);
+  }
+  glob.dot = !pattern.empty() && pattern[0] == '.';
+  glob.suffix = !glob.steps.empty() && glob.steps.back().kind == GlobPattern::Literal ? glob.steps.back().text : "";
+  return wildcard;
+}
+
+// Whether `name` matches the whole pattern. On a mismatch after a `*`, only
+// the last `*` has to take one more byte, so this is linear in practice.
+bool glob_match(const GlobPattern& glob, string_view name) {
+  if ((name[0] == '.' && !glob.dot) || name.size() < glob.suffix.size() ||
+      name.compare(name.size() - glob.suffix.size(), string_view::npos, glob.suffix) != 0) {
+    return false;
+  }
+  const auto& steps = glob.steps;
+  size_t step = 0, pos = 0, star = string::npos, star_pos = 0;
+  while (true) {
+    if (step < steps.size()) {
+      const GlobPattern::Step& s = steps[step];
+      if (s.kind == GlobPattern::Star) {
+        star = step++;
+        star_pos = pos;
+        continue;
+      }
+      if (pos < name.size()) {
+        bool match = s.kind == GlobPattern::Any || (s.kind == GlobPattern::Set && s.set[(unsigned char)name[pos]]) ||
+                     (s.kind == GlobPattern::Literal && name.compare(pos, s.text.size(), s.text) == 0);
+        if (match) {
+          pos += s.kind == GlobPattern::Literal ? s.text.size() : 1;
+          step++;
+          continue;
+        }
+      }
+    } else if (pos == name.size()) {
+      return true;
+    }
+    if (star == string::npos || star_pos == name.size()) {
+      return false;
+    }
+    step = star + 1;
+    pos = ++star_pos;
+  }
+}
+
+// The entries of a directory, without `.` and `..`.
+struct DirEntries {
+  enum Kind : unsigned char { Other, Directory, DirectoryLink };
+  string names;                         // All names, each followed by a NUL.
+  vector<pair<uint32_t, Kind>> entries; // Offset in names and kind.
+};
+
+// State of the expansion of one command line. Directories are read once per
+// line, however many patterns look into them.
+struct Expansion {
+  unordered_map<string, DirEntries> listings;
+  vector<char> buffer; // For getdents64.
+  vector<string> matches;
+};
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// The entries of directory `dir` ("" for the current one), read with
+// getdents64 in large blocks. An unreadable directory has no entries.
+const DirEntries& read_entries(Expansion& expansion, const string& dir) {
+  auto [it, inserted] = expansion.listings.try_emplace(dir);
+  DirEntries& listing = it->second;
+  if (!inserted) {
+    return listing;
+  }
+  int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return listing;
+  }
+  expansion.buffer.resize(1 << 20);
+  while (true) {
+    long n = syscall(SYS_getdents64, fd, expansion.buffer.data(), expansion.buffer.size());
+    if (n <= 0) break;
+    for (long pos = 0; pos < n;) {
+      auto* entry = reinterpret_cast<linux_dirent64*>(expansion.buffer.data() + pos);
+      pos += entry->d_reclen;
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      // Only file systems without d_type and symbolic links need a stat.
+      DirEntries::Kind kind = entry->d_type == DT_DIR ? DirEntries::Directory : DirEntries::Other;
+      struct stat st;
+      if (entry->d_type == DT_UNKNOWN && fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        kind = S_ISDIR(st.st_mode) ? DirEntries::Directory : S_ISLNK(st.st_mode) ? DirEntries::DirectoryLink : kind;
+      }
+      if ((entry->d_type == DT_LNK || kind == DirEntries::DirectoryLink) &&
+          (fstatat(fd, entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode))) {
+        kind = DirEntries::Other;
+      } else if (entry->d_type == DT_LNK) {
+        kind = DirEntries::DirectoryLink;
+      }
+      listing.entries.push_back({uint32_t(listing.names.size()), kind});
+      listing.names.append(entry->d_name);
+      listing.names += '\0';
+    }
+  }
+  close(fd);
+  return listing;
+}
+
+// Appends the paths that match components [k, end) of a pattern to the
+// matches, `path` being the directory the components are looked up in.
+void glob_walk(Expansion& expansion, const vector<string>& components, size_t k, const string& path) {
+  const string& component = components[k];
+  bool last = k + 1 == components.size();
+  if (component.empty() && last) {
+    expansion.matches.push_back(path); // A trailing '/': only directories get here.
+    return;
+  }
+  GlobPattern glob;
+  bool recursive = component == "**";
+  if (!compile_glob(component, glob)) {
+    string next = path + component;
+    struct stat st;
+    if (!last) {
+      glob_walk(expansion, components, k + 1, next + "/");
+    } else if (lstat(next.c_str(), &st) == 0) {
+      expansion.matches.push_back(next);
+    }
+    return;
+  }
+  // `**/` also stands for no directory at all.
+  if (recursive && !last) {
+    glob_walk(expansion, components, k + 1, path);
+  }
+  // Stays valid while the recursion adds listings: map nodes do not move.
+  const DirEntries& listing = read_entries(expansion, path);
+  for (const auto& [offset, kind] : listing.entries) {
+    string_view name(listing.names.data() + offset);
+    if (!glob_match(glob, name)) {
+      continue;
+    }
+    string next = path;
+    next.append(name);
+    if (last) {
+      expansion.matches.push_back(next);
+    }
+    // `**` does not follow links, so it cannot loop.
+    if (recursive && kind == DirEntries::Directory) {
+      glob_walk(expansion, components, k, next + "/");
+    } else if (!last && kind != DirEntries::Other) {
+      glob_walk(expansion, components, k + 1, next + "/");
+    }
+  }
+}
+
+// Replaces `$NAME` and `${NAME}` in `word` by the value of the environment
+// variable (nothing if it is not set). Returns false for a `${` without `}`.
+bool expand_variables(string& word) {
+  size_t dollar = word.find('$');
+  if (dollar == string::npos) {
+    return true;
+  }
+  string result = word.substr(0, dollar);
+  for (size_t i = dollar; i < word.size();) {
+    if (word[i] != '$') {
+      result += word[i++];
+      continue;
+    }
+    size_t begin = i + 1, end;
+    bool braces = begin < word.size() && word[begin] == '{';
+    if (braces) {
+      end = word.find('}', ++begin);
+      if (end == string::npos) {
+        shell_err << word << ": bad substitution" << endl;
+        return false;
+      }
+    } else {
+      end = begin;
+      while (end < word.size() && (isalnum((unsigned char)word[end]) || word[end] == '_') &&
+             !(end == begin && isdigit((unsigned char)word[end]))) {
+        end++;
+      }
+      if (end == begin) {
+        result += word[i++]; // A lone `$`.
+        continue;
+      }
+    }
+    const char* value = getenv(word.substr(begin, end - begin).c_str());
+    if (value) result += value;
+    i = end + braces;
+  }
+  word.swap(result);
+  return true;
+}
+
+// Puts the paths that match the pattern `word` into expansion.matches, sorted:
+// none if the word has no `*`, `?` or `[`, or nothing matches.
+void expand_pattern(const string& word, Expansion& expansion) {
+  expansion.matches.clear();
+  if (word.find_first_of("*?[") == string::npos) {
+    return;
+  }
+  bool absolute = word[0] == '/';
+  vector<string> components = split_string(word, '/');
+  if (word.back() == '/') components.push_back("");
+  if (!components.empty()) {
+    glob_walk(expansion, components, 0, absolute ? "/" : "");
+  }
+  sort(expansion.matches.begin(), expansion.matches.end());
+}
+
+// Expands the file name of a redirection or of the input or output of an
+// expression like a part of a command. It has to stay one word: a name that
+// became empty or matches several paths is an error. Returns false on
+// errors, which are printed.
+bool expand_path(string& path, Expansion& expansion) {
+  string word = path;
+  if (!expand_variables(word)) {
+    return false;
+  }
+  expand_pattern(word, expansion);
+  if (word.empty() || expansion.matches.size() > 1) {
+    shell_err << path << ": ambiguous redirect" << endl;
+    return false;
+  }
+  path = expansion.matches.empty() ? move(word) : move(expansion.matches[0]);
+  return true;
+}
+
+// Expands the variables and patterns of the expandable parts of `command`:
+// variables first, then `*`, `?`, `[...]` and `**` (any number of
+// directories) in the result. A pattern without matches stays as it is, a
+// word that became empty is dropped. The paths of its redirections are
+// expanded as well (see expand_path). Returns false on errors, which are printed.
+bool expand_command(Command& command, Expansion& expansion) {
+  for (Redirection& redirection : command.redirections) {
+    if (redirection.expandable && !expand_path(redirection.path, expansion)) {
+      return false;
+    }
+    redirection.expandable = false;
+  }
+  if (command.expandable.empty()) {
+    return true;
+  }
+  vector<string> parts;
+  parts.reserve(command.parts.size());
+  for (size_t i = 0; i < command.parts.size(); ++i) {
+    string& word = command.parts[i];
+    if (!command.expandable[i]) {
+      parts.push_back(move(word));
+      continue;
+    }
+    if (!expand_variables(word)) {
+      return false;
+    }
+    if (word.empty()) {
+      continue;
+    }
+    expand_pattern(word, expansion);
+    if (expansion.matches.empty()) {
+      parts.push_back(move(word));
+      continue;
+    }
+    size_t begin = parts.size();
+    for (string& match : expansion.matches) {
+      parts.push_back(move(match));
+    }
+    command.splits.push_back({begin, parts.size()});
+  }
+  command.parts.swap(parts);
+  command.expandable.clear();
+  return true;
+}
+
+// Expands all commands of an expression, and its input and output files, with
+// one directory cache for all of them. Returns false on errors.
+bool expand_expression(Expression& expression) {
+  Expansion expansion;
+  if (expression.inputExpandable && !expand_path(expression.inputFromFile, expansion)) {
+    return false;
+  }
+  if (expression.outputExpandable && !expand_path(expression.outputToFile, expansion)) {
+    return false;
+  }
+  expression.inputExpandable = expression.outputExpandable = false;
+  for (Command& command : expression.commands) {
+    if (!expand_command(command, expansion)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Space that execve needs for `args` from `begin` to `end`: the strings and a
+// pointer to each.
+size_t argument_space(const vector<string>& args, size_t begin, size_t end) {
+  size_t space = 0;
+  for (size_t i = begin; i < end; ++i) {
+    space += args[i].size() + 1 + sizeof(char*);
+  }
+  return space;
+}
+
+// Space left for arguments by the kernel: a quarter of the stack limit (see
+// execve(2)), capped like ARG_MAX, minus the environment and some slack.
+size_t argument_limit() {
+  size_t limit = sysconf(_SC_ARG_MAX);
+  rlimit stack;
+  if (getrlimit(RLIMIT_STACK, &stack) == 0 && stack.rlim_cur != RLIM_INFINITY) {
+    limit = min<size_t>(limit, stack.rlim_cur / 4);
+  }
+  limit = min<size_t>(limit, 6 << 20);
+  size_t environment = 4096;
+  for (char** var = environ; *var; ++var) {
+    environment += strlen(*var) + 1 + sizeof(char*);
+  }
+  return limit > environment ? limit - environment : 0;
+}
+
+// Whether `command` has to be run in several invocations to fit into ARG_MAX.
+bool exceeds_arg_max(const Command& command) {
+  return !command.splits.empty() && argument_space(command.parts, 0, command.parts.size()) > argument_limit();
+}
+
+// Runs `command` (in a forked stage) as several invocations, one after the
+// other, like xargs: each gets all the parts outside command.splits, in their
+// places, and as many of the ones inside as fit. Returns the exit status of
+// the last invocation that failed, or 0.
+int run_in_batches(const Command& command, const Resolution& resolved) {
+  const vector<string>& parts = command.parts;
+  vector<size_t> spread; // Parts produced by patterns, in order.
+  for (auto [begin, end] : command.splits) {
+    for (size_t j = begin; j < end; ++j) spread.push_back(j);
+  }
+  size_t fixed = argument_space(parts, 0, parts.size());
+  for (size_t j : spread) {
+    fixed -= argument_space(parts, j, j + 1);
+  }
+  size_t limit = argument_limit();
+  size_t space = limit > fixed ? limit - fixed : 0;
+
+  int result = 0;
+  for (size_t begin = 0; begin < spread.size();) {
+    size_t end = begin + 1, used = argument_space(parts, spread[begin], spread[begin] + 1);
+    while (end < spread.size() && used + argument_space(parts, spread[end], spread[end] + 1) <= space) {
+      used += argument_space(parts, spread[end], spread[end] + 1);
+      end++;
+    }
+    Command batch;
+    for (size_t j = 0, k = 0; j < parts.size(); ++j) {
+      bool produced = k < spread.size() && spread[k] == j;
+      if (!produced || (k >= begin && k < end)) {
+        batch.parts.push_back(parts[j]);
+      }
+      k += produced;
+    }
+    begin = end;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+      print_error("fork");
+      return errno;
+    }
+    if (pid == 0) {
+      execute_command(batch, resolved);
+      print_error("`" + batch.parts[0] + "`");
+      exit(errno);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    if (exit_status(status) != 0) {
+      result = exit_status(status);
+    }
+  }
+  return result;
+}
+
+// Returns a file descriptor to read `document` from, without touching the
+// file system or starting a helper: a pipe that is filled right away if the
+// document fits into it, a memfd otherwise. -1 on errors, which are printed.
+int open_document(const string& document) {
+  int fds[2];
+  if (document.size() <= 65536 && pipe2(fds, O_CLOEXEC) == 0) {
+    if (fcntl(fds[1], F_GETPIPE_SZ) >= int(document.size()) && write_all(fds[1], document)) {
+      close(fds[1]);
+      return fds[0];
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+  int fd = memfd_create("document", MFD_CLOEXEC);
+  if (fd == -1 || !write_all(fd, document) || lseek(fd, 0, SEEK_SET) == -1) {
+    print_error("document");
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Redirects standard input of the current process to the input file (if not
+// empty or whitespace). Closes standard input if background is set to true.
+void setup_input(const string &file_in, bool background) {
+  if (!empty_or_whitespace(file_in)) {
+    // There is an input file. Redirect standard in to this file.
+    int fd = open(file_in.c_str(), O_RDONLY);
+    if (fd == -1) {
+      print_error("open input");
+      exit(errno);
+    }
+
+    // Use the dup2 syscall to redirect standard input to the input file.
+    if (dup2(fd, STDIN_FILENO) == -1) {
+      print_error("dup2 input");
+      exit(errno);
+    }
+
+    // Afterwards, close the fd for the file itself since it is not needed
+    // anymore.
+    close(fd);
+  } else if (background) {
+    // For background jobs with no input redirection, close stdin (this was a
+    // project requirement)
+    if (close(STDIN_FILENO) == -1) {
+      print_error("close stdin");
+      exit(errno);
+    }
+  }
+}
+
+// Redirects standard output of the current process to the output file (if not
+// empty or whitespace).
+void setup_output(const string &file_out) {
+  if (!empty_or_whitespace(file_out)) {
+    // There is an output file: redirect standard output to this file.
+    // O_WRONLY: You need to write, not read.
+    // O_CREAT: Create the file if not present.
+    // O_TRUNC: Overwrite existing files of the same name.
+    // 0644: Seems to be standard permission flag if you want to create and
+    // write to files.
+    int fd = open(file_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      print_error("open output");
+      exit(errno);
+    }
+
+    // Use the dup2 syscall to redirect standard output to the output file.
+    if (dup2(fd, STDOUT_FILENO) == -1) {
+      print_error("dup2 output");
+      exit(errno);
+    }
+
+    // Close file's fd since it is not needed anymore.
+    close(fd);
+  }
+}
+
+// Closes `fds`, skipping -1. The descriptors of a pipeline mostly have
+// consecutive numbers (pipe2 hands out the lowest free ones), so each run of
+// them takes a single close_range(2) call where the kernel has it.
+void close_fds(vector<int> fds) {
+  static bool have_close_range = true;
+  sort(fds.begin(), fds.end());
+  fds.erase(unique(fds.begin(), fds.end()), fds.end());
+  for (size_t k = 0; k < fds.size();) {
+    size_t end = k + 1;
+    while (end < fds.size() && fds[end] == fds[end - 1] + 1) end++;
+#ifdef SYS_close_range
+    if (have_close_range && end - k > 1 && fds[k] >= 0) {
+      if (syscall(SYS_close_range, fds[k], fds[end - 1], 0) == 0) {
+        k = end;
+        continue;
+      }
+      have_close_range = errno != ENOSYS;
+    }
+#endif
+    for (; k < end; ++k) {
+      if (fds[k] >= 0) close(fds[k]);
+    }
+  }
+}
+
+// Where a stage of a `pin` pipeline runs, and the limits it runs under.
+struct Placement {
+  bool has_cpus = false;
+  cpu_set_t cpus;
+  int mempolicy = -1;          // MPOL_BIND or MPOL_INTERLEAVE over `nodes`, -1: none.
+  vector<unsigned long> nodes; // Node mask.
+  vector<pair<int, rlimit>> limits;
+};
+
+// Applies `placement` to the calling process, a forked stage that is about to
+// exec. Exits on errors, like the other setup in the child.
+void apply_placement(const Placement &placement) {
+  if (placement.has_cpus && sched_setaffinity(0, sizeof(placement.cpus), &placement.cpus) == -1) {
+    print_error("pin: sched_setaffinity");
+    exit(errno);
+  }
+  if (placement.mempolicy != -1 &&
+      syscall(SYS_set_mempolicy, placement.mempolicy, placement.nodes.data(), placement.nodes.size() * 64 + 1) == -1) {
+    print_error("pin: set_mempolicy");
+    exit(errno);
+  }
+  for (const auto &[resource, limit] : placement.limits) {
+    if (setrlimit(resource, &limit) == -1) {
+      print_error("pin: setrlimit");
+      exit(errno);
+    }
+  }
+}
+
+// How the stages of a pipeline are started.
+struct LaunchOptions {
+  bool background = false; // Own process group, no standard input.
+  bool group = false;      // Own process group in the foreground, too.
+  // If not -1, the terminal that the pipeline's process group takes over as it
+  // starts (see foreground_terminal). No builtin stage of a pipeline runs
+  // inside the shell then, since the shell would stop as soon as it reads from
+  // the terminal.
+  int terminal = -1;
+  bool in_shell = true;    // Whether a builtin stage may run inside the shell.
+  int out_fd = -1;         // Standard output of the last stage if not redirected
+                           // to a file (-1: the session's).
+  int in_fd = -1;          // Standard input of the first stage instead of the
+                           // input file, for an inline document (see open_document).
+  int err_fd = -1;         // Standard error of all stages (-1: the session's).
+  // If set, every pipe is split in two and the shell relays the data in
+  // between: receives per pipe the read end of the writer's half and the write
+  // end of the reader's half. No builtin runs inside the shell then.
+  vector<array<int, 2>> *relays = nullptr;
+  // If set, receives the stage index of each pid that is returned.
+  vector<int> *stages = nullptr;
+  // If set, receive the index of the builtin stage that ran inside the shell
+  // (-1: none) and its exit status.
+  int *in_shell_stage = nullptr;
+  int *in_shell_status = nullptr;
+  // Filled in by launch_pipeline: per stage, the standard output and error
+  // its redirections give it (-1: none), and the descriptors the shell holds
+  // while it starts a stage (pipe ends, files, relay ends), which forked
+  // children must not keep open.
+  vector<array<int, 2>> redirected;
+  vector<int> held;
+  // If set, the placement per stage. posix_spawn cannot set it up, so these
+  // stages are always forked.
+  const vector<Placement> *placement = nullptr;
+  // If set, the hints for the input file and for the files of the
+  // redirections (see open_input and open_redirections).
+  const IoPolicy *input_policy = nullptr;
+  const IoPolicy *output_policy = nullptr;
+};
+
+// Sets up the redirections and pipes of stage `i` in a freshly forked child
+// and replaces the child with the command, or runs the builtin if there is
+// one. `in` and `out` are the pipe ends of the stage (-1: none). Never returns.
+void run_forked_stage(vector<Command> &commands, int i, const Builtin *builtin,
+                      const Resolution &resolved, int in, int out,
+                      const string &file_in, const string &file_out,
+                      const LaunchOptions &options, pid_t pgid, JobTable &jobs) {
+  int n_commands = commands.size();
+  uint64_t started = tracing ? trace_clock() : 0;
+
+  // Background jobs get a process group of their own (pgid 0: a new one).
+  if (pgid != -1) {
+    setpgid(0, pgid);
+  }
+  // Every stage takes the terminal for its group itself, so none of them
+  // reads from it before the parent has handed it over. SIGTTOU is blocked,
+  // since the group is not in the foreground yet.
+  if (options.terminal != -1) {
+    sigset_t ttou, previous;
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &previous);
+    tcsetpgrp(options.terminal, getpgrp());
+    sigprocmask(SIG_SETMASK, &previous, nullptr);
+  }
+  if (restore_launch_sigmask) {
+    sigprocmask(SIG_SETMASK, &launch_sigmask, nullptr);
+  }
+  if (options.placement) {
+    apply_placement((*options.placement)[i]);
+  }
+
+  // The session's standard error, and its standard input for the first command.
+  int err = options.err_fd != -1 ? options.err_fd : shell_io.err;
+  if (err != STDERR_FILENO && dup2(err, STDERR_FILENO) == -1) {
+    print_error("dup2 error");
+    exit(errno);
+  }
+  if (i == 0 && !options.background && shell_io.in != STDIN_FILENO && dup2(shell_io.in, STDIN_FILENO) == -1) {
+    print_error("dup2 input");
+    exit(errno);
+  }
+
+  // First, setup the inputs and outputs for the first and last command.
+  if (i == 0 && options.in_fd != -1) {
+    if (dup2(options.in_fd, STDIN_FILENO) == -1) {
+      print_error("dup2 input");
+      exit(errno);
+    }
+  } else if (i == 0) {
+    setup_input(file_in, options.background);
+  }
+  if (i == n_commands - 1) {
+    if (options.out_fd != STDOUT_FILENO && dup2(options.out_fd, STDOUT_FILENO) == -1) {
+      print_error("dup2 output");
+      exit(errno);
+    }
+    setup_output(file_out);
+  }
+
+  // Setup pipes' input ends (not for the first command)
+  if (in != -1) {
+    // Use the dup2 syscall for this and redirect pipes.
+    if (dup2(in, STDIN_FILENO) == -1) {
+      print_error("dup2 pipe in");
+      exit(errno);
+    }
+  }
+  // Setup pipes' output ends (not for the last command)
+  if (out != -1) {
+    // Use the dup2 syscall again for this and redirect pipes.
+    if (dup2(out, STDOUT_FILENO) == -1) {
+      print_error("dup2 pipe out");
+      exit(errno);
+    }
+  }
+
+  // The command's own redirections come last, standard error first: it may
+  // go to the shell's standard output, which is descriptor 1 itself.
+  for (int fd : {STDERR_FILENO, STDOUT_FILENO}) {
+    int target = options.redirected[i][fd - 1];
+    if (target != -1 && dup2(target, fd) == -1) {
+      print_error("dup2 redirection");
+      exit(errno);
+    }
+  }
+
+  // Child does not need the descriptors of the shell anymore, as its own are
+  // now all redirected to standard input/output with dup2 syscalls.
+  close_fds(options.held);
+
+  // Builtins don't need a new program, the forked shell runs them itself.
+  if (builtin) {
+    BuiltinIO io = {STDIN_FILENO, STDOUT_FILENO};
+    exit(builtin->run(commands[i].parts, io, jobs));
+  }
+  if (commands[i].parts.empty()) {
+    shell_err << strerror(EINVAL) << endl;
+    exit(EINVAL);
+  }
+
+  // Execute the command.
+  if (started) {
+    trace_record(TRACE_EXEC, started, commands[i].parts[0]);
+  }
+  if (exceeds_arg_max(commands[i])) {
+    exit(run_in_batches(commands[i], resolved));
+  }
+  execute_command(commands[i], resolved);
+
+  // Something went wrong if we're still executing this.
+  std::string msg = "`" + commands[i].parts[0] + "`";
+  print_error(msg.c_str());
+
+  exit(errno);
+}
+
+// Whether posix_spawn can hand the terminal to the new process group (glibc
+// 2.35 and later). Without it, stages that take over the terminal are forked.
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define SPAWN_SETS_TERMINAL 1
+#else
+#define SPAWN_SETS_TERMINAL 0
+#endif
+
+// Launches stage `i` with posix_spawn instead of fork. The work run_forked_stage
+// does in the child is turned into spawn file actions and attributes. Files are opened here in
+// the parent, so open errors are reported with the same messages as in the fork
+// path. Returns the pid of the new process, or 0 if nothing was launched (any
+// error has been printed already).
+pid_t spawn_stage(vector<Command> &commands, int i, const Resolution &resolved,
+                  int in, int out, const string &file_in,
+                  const string &file_out, const LaunchOptions &options, pid_t pgid) {
+  int n_commands = commands.size();
+  const vector<string> &parts = commands[i].parts;
+
+  if (parts.empty()) {
+    shell_err << strerror(EINVAL) << endl;
+    return 0;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  short flags = 0;
+  if (pgid != -1) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attributes, pgid);
+  }
+  if (restore_launch_sigmask) {
+    flags |= POSIX_SPAWN_SETSIGMASK;
+    posix_spawnattr_setsigmask(&attributes, &launch_sigmask);
+  }
+  posix_spawnattr_setflags(&attributes, flags);
+#if SPAWN_SETS_TERMINAL
+  if (options.terminal != -1) {
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, options.terminal);
+  }
+#endif
+
+  // Opened with O_CLOEXEC: only the dup2'ed copy ends up in the child.
+  int fd_in = -1, fd_out = -1;
+  bool opened = true;
+  if (i == 0) {
+    if (options.in_fd != -1) {
+      posix_spawn_file_actions_adddup2(&actions, options.in_fd, STDIN_FILENO);
+    } else if (!empty_or_whitespace(file_in)) {
+      fd_in = open(file_in.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd_in == -1) {
+        print_error("open input");
+        opened = false;
+      } else {
+        posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+      }
+    } else if (options.background) {
+      posix_spawn_file_actions_addclose(&actions, STDIN_FILENO);
+    } else if (shell_io.in != STDIN_FILENO) {
+      posix_spawn_file_actions_adddup2(&actions, shell_io.in, STDIN_FILENO);
+    }
+  }
+  int err = options.err_fd != -1 ? options.err_fd : shell_io.err;
+  if (err != STDERR_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, err, STDERR_FILENO);
+  }
+  if (opened && i == n_commands - 1 && !empty_or_whitespace(file_out)) {
+    fd_out = open(file_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_out == -1) {
+      print_error("open output");
+      opened = false;
+    } else {
+      posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+    }
+  }
+  if (i == n_commands - 1 && fd_out == -1 && options.out_fd != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, options.out_fd, STDOUT_FILENO);
+  }
+
+  // Pipe wiring. The pipes are created with O_CLOEXEC, so the child only keeps
+  // the two ends that are duplicated onto its standard input/output.
+  if (in != -1) {
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  }
+  if (out != -1) {
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+  }
+  for (int fd : {STDERR_FILENO, STDOUT_FILENO}) { // In the order of run_forked_stage.
+    if (options.redirected[i][fd - 1] != -1) {
+      posix_spawn_file_actions_adddup2(&actions, options.redirected[i][fd - 1], fd);
+    }
+  }
+
+  pid_t pid = 0;
+  if (opened) {
+    vector<char*> argv;
+    for (const string &part : parts) {
+      argv.push_back(const_cast<char*>(part.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int rc = resolved.error;
+    if (rc == 0) {
+      rc = posix_spawn(&pid, resolved.path.c_str(), &actions, &attributes, argv.data(), environ);
+      if (rc == ENOENT) {
+        // The cached file disappeared in the meantime: fall back to a full search.
+        rc = posix_spawnp(&pid, argv[0], &actions, &attributes, argv.data(), environ);
+      }
+      if (rc == ENOEXEC) {
+        // Unlike execvp, posix_spawn does not run such files with /bin/sh.
+        vector<string> script = script_arguments(resolved.path, parts);
+        vector<char*> script_argv;
+        for (string& arg : script) {
+          script_argv.push_back(&arg[0]);
+        }
+        script_argv.push_back(nullptr);
+        rc = posix_spawn(&pid, "/bin/sh", &actions, &attributes, script_argv.data(), environ);
+      }
+    }
+    if (rc != 0) {
+      // Same message as the fork path prints when execvp fails in the child.
+      errno = rc;
+      std::string msg = "`" + parts[0] + "`";
+      print_error(msg.c_str());
+      pid = 0;
+    }
+  }
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+  if (fd_in != -1) close(fd_in);
+  if (fd_out != -1) close(fd_out);
+  return pid;
+}
+
+// Runs builtin stage `i` inside the shell, on the pipe ends (`pipe_in` and
+// `pipe_out`, -1: none) and files that a child would get as standard
+// input/output. All other stages must have been started already, and the
+// shell must not hold any other pipe ends (its copy of a write end would keep
+// readers from seeing EOF).
+int run_in_process_stage(vector<Command> &commands, int i, const Builtin &builtin,
+                         int pipe_in, int pipe_out, const string &file_in,
+                         const string &file_out, const LaunchOptions &options, JobTable &jobs) {
+  int n_commands = commands.size();
+  int in = pipe_in != -1 ? pipe_in : options.in_fd != -1 ? options.in_fd : shell_io.in;
+  int out = options.redirected[i][0] != -1 ? options.redirected[i][0] : pipe_out != -1 ? pipe_out : options.out_fd;
+
+  // Same redirections, in the same order, as setup_input/setup_output.
+  int rc = 1;
+  int fd_in = -1, fd_out = -1;
+  if (i == 0 && options.in_fd == -1 && !empty_or_whitespace(file_in)) {
+    fd_in = in = open(file_in.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_in == -1) {
+      print_error("open input");
+    }
+  }
+  if (in != -1 && i == n_commands - 1 && !empty_or_whitespace(file_out)) {
+    fd_out = out = open(file_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_out == -1) {
+      print_error("open output");
+    }
+  }
+
+  if (in != -1 && out != -1) {
+    // A reader that goes away must only end the builtin, not the shell itself.
+    struct sigaction ignore = {}, previous;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &previous);
+    int err = shell_io.err;
+    if (options.redirected[i][1] != -1) shell_io.err = options.redirected[i][1];
+    BuiltinIO io = {in, out};
+    errno = 0;
+    rc = builtin.run(commands[i].parts, io, jobs);
+    // A write to a reader that went away: the status of a process killed by SIGPIPE.
+    if (rc != 0 && errno == EPIPE) {
+      rc = 128 + SIGPIPE;
+    }
+    shell_io.err = err;
+    sigaction(SIGPIPE, &previous, nullptr);
+  }
+
+  if (fd_in != -1) close(fd_in);
+  if (fd_out != -1) close(fd_out);
+  return rc;
+}
+
+// Command line of a pipeline, for the messages about background jobs.
+string describe_pipeline(const vector<Command> &commands, const string &file_in, const string &file_out) {
+  string description;
+  for (size_t i = 0; i < commands.size(); ++i) {
+    if (i > 0) description += " |";
+    for (const string &part : commands[i].parts) {
+      description += (description.empty() ? "" : " ") + part;
+    }
+    if (i == 0 && !empty_or_whitespace(file_in)) description += " < " + file_in;
+    for (const Redirection &redirection : commands[i].redirections) {
+      description += redirection.fd == 2 ? " 2>" : " >";
+      description += redirection.path.empty() ? "&1" : (redirection.append ? "> " : " ") + redirection.path;
+    }
+  }
+  if (!empty_or_whitespace(file_out)) description += " > " + file_out;
+  return description;
+}
+
+// Moves `n` bytes from pipe `from` to `to`: with splice(2) if `to` supports
+// it, through a buffer otherwise. Returns false on errors.
+bool splice_all(int from, int to, size_t n) {
+  while (n > 0) {
+    ssize_t moved = splice(from, nullptr, to, nullptr, n, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINVAL) {
+      char buffer[1 << 16];
+      moved = read(from, buffer, min(n, sizeof(buffer)));
+      if (moved > 0 && !write_all(to, string_view(buffer, moved))) {
+        return false;
+      }
+    }
+    if (moved == -1 && errno == EINTR) {
+      continue;
+    }
+    if (moved <= 0) {
+      return false;
+    }
+    n -= moved;
+  }
+  return true;
+}
+
+// Size of the windows in which files are written back and dropped from the
+// page cache, unless IoPolicy::throttle sets it.
+const uint64_t io_window = 8 << 20;
+
+// Whether `policy` has any hint at all.
+bool io_policy_set(const IoPolicy &policy) {
+  return policy.sequential || policy.willneed || policy.readahead || policy.noatime || policy.dontneed ||
+         policy.throttle || policy.allocate || policy.allocate_input;
+}
+
+// Whether the output files of a pipeline with `policy` need a process of the
+// shell that writes to them (see WriteBehind).
+bool writes_behind(const IoPolicy *policy) {
+  return policy && (policy->throttle || policy->dontneed);
+}
+
+// An output file with write-behind: as data is appended, each full window is
+// queued for writeback with sync_file_range, and the window before it is
+// waited for, so the file never has more than two windows of dirty pages and
+// a huge output cannot fill the page cache with them. With dontneed, the
+// pages are dropped once they are written back. Every drop starts at the
+// beginning, since a large folio that straddles the boundary of two windows
+// is only dropped with a range that covers all of it.
+struct WriteBehind {
+  int fd;
+  off_t begin;   // Where the pipeline started to write.
+  off_t waited;  // Written back (and dropped) up to here.
+  off_t started; // Writeback is queued up to here.
+  off_t end;     // Written up to here.
+};
+
+// Catches up with what was appended to `file`, or with all of it if `last`.
+void write_behind(WriteBehind &file, const IoPolicy &policy, bool last) {
+  off_t window = policy.throttle ? policy.throttle : io_window;
+  while (file.end - file.started >= window || (last && file.end > file.started)) {
+    off_t length = min(window, file.end - file.started);
+    sync_file_range(file.fd, file.started, length, SYNC_FILE_RANGE_WRITE);
+    if (file.started > file.waited) {
+      sync_file_range(file.fd, file.waited, file.started - file.waited,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      if (policy.dontneed) {
+        posix_fadvise(file.fd, file.begin, file.started - file.begin, POSIX_FADV_DONTNEED);
+      }
+      file.waited = file.started;
+    }
+    file.started += length;
+  }
+  if (last && file.started > file.waited) {
+    sync_file_range(file.fd, file.waited, file.started - file.waited,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    if (policy.dontneed) {
+      posix_fadvise(file.fd, file.begin, file.started - file.begin, POSIX_FADV_DONTNEED);
+    }
+    file.waited = file.started;
+  }
+}
+
+// Moves what is in pipe `from` (at most `n` bytes, waiting for data if it is
+// empty) to `to`. Returns the number of bytes, 0 once all writers are gone,
+// or -1 on errors.
+ssize_t splice_some(int from, int to, size_t n) {
+  while (true) {
+    ssize_t moved = splice(from, nullptr, to, nullptr, n, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINVAL) {
+      char buffer[1 << 16];
+      moved = read(from, buffer, min(n, sizeof(buffer)));
+      if (moved > 0 && !write_all(to, string_view(buffer, moved))) {
+        return -1;
+      }
+    }
+    if (moved != -1 || errno != EINTR) {
+      return moved;
+    }
+  }
+}
+
+// Body of the process that fans out what arrives in pipe `in` to all of
+// `targets`. Whatever is in the pipe is duplicated with tee(2) into a pipe per
+// target but the last one, which takes the data itself; those pipes are then
+// drained into their targets with splice(2). The data never passes through
+// user space. Every duplicate pipe is as large as `in` and empty before each
+// round, so tee always duplicates everything. With a `policy` that writes
+// behind, the targets that are regular files get a WriteBehind (and a single
+// target gets a fan-out process just for that). Never returns.
+void run_fan_out(int in, const vector<int> &targets, const IoPolicy *policy) {
+  size_t n_copies = targets.size() - 1;
+  vector<array<int, 2>> copies(n_copies);
+  int size = fcntl(in, F_GETPIPE_SZ);
+  for (auto &copy : copies) {
+    if (pipe2(copy.data(), O_CLOEXEC) == -1) {
+      print_error("pipe");
+      exit(errno);
+    }
+    fcntl(copy[1], F_SETPIPE_SZ, size);
+  }
+  vector<WriteBehind> files;
+  for (int target : targets) {
+    struct stat st;
+    off_t offset;
+    if (writes_behind(policy) && fstat(target, &st) == 0 && S_ISREG(st.st_mode) &&
+        (offset = lseek(target, 0, SEEK_CUR)) != -1) {
+      files.push_back({target, offset, offset, offset, offset});
+    }
+  }
+
+  while (true) {
+    // The first duplicate tells how much there is.
+    ssize_t n = 0;
+    for (size_t k = 0; k < n_copies; ++k) {
+      ssize_t copied;
+      do {
+        copied = tee(in, copies[k][1], k == 0 ? size_t(size) : size_t(n), 0);
+      } while (copied == -1 && errno == EINTR);
+      if (copied == -1) {
+        print_error("tee");
+        exit(errno);
+      }
+      if (k == 0 && copied == 0) {
+        break; // All writers are gone.
+      }
+      if (k == 0) {
+        n = copied;
+      }
+      if (copied != n) {
+        exit(EIO);
+      }
+      if (!splice_all(copies[k][0], targets[k], n)) {
+        exit(errno);
+      }
+    }
+    if (n_copies == 0) {
+      n = splice_some(in, targets.back(), size);
+      if (n == -1) {
+        exit(errno);
+      }
+    } else if (n > 0 && !splice_all(in, targets.back(), n)) {
+      exit(errno);
+    }
+    for (WriteBehind &file : files) {
+      file.end += n;
+      write_behind(file, *policy, n == 0);
+    }
+    if (n == 0) {
+      exit(0);
+    }
+  }
+}
+
+// Body of the process that feeds the input file `file` into pipe `out` for an
+// input policy with dontneed: the pages it has passed on are dropped from the
+// page cache a window behind, once the reader has them (from the beginning
+// each time, as in write_behind). Never returns.
+void run_feeder(int file, int out, const IoPolicy &policy) {
+  off_t window = policy.throttle ? policy.throttle : io_window;
+  off_t begin = max(lseek(file, 0, SEEK_CUR), off_t(0)), offset = begin, dropped = begin;
+  // A reader that is gone ends the input, not the feeder.
+  struct sigaction ignore = {};
+  ignore.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ignore, nullptr);
+  while (true) {
+    ssize_t n = splice(file, nullptr, out, nullptr, 1 << 20, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINVAL) {
+      char buffer[1 << 16];
+      n = read(file, buffer, sizeof(buffer));
+      if (n > 0 && !write_all(out, string_view(buffer, n))) {
+        break;
+      }
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    offset += n;
+    if (offset - dropped >= 2 * window) {
+      dropped = offset - window;
+      posix_fadvise(file, begin, dropped - begin, POSIX_FADV_DONTNEED);
+    }
+  }
+  // Pages that are still in the pipe cannot be dropped, so the rest waits
+  // until the reader has taken everything or is gone (the write end then
+  // reports POLLERR), and the pipe is closed.
+  for (useconds_t delay = 1000;; delay = min(2 * delay, useconds_t(100000))) {
+    int queued = 0;
+    pollfd reader = {out, 0, 0};
+    if (ioctl(out, FIONREAD, &queued) == -1 || queued == 0 || poll(&reader, 1, 0) == 1) {
+      break;
+    }
+    usleep(delay);
+  }
+  close(out);
+  posix_fadvise(file, begin, offset - begin, POSIX_FADV_DONTNEED);
+  exit(0);
+}
+
+// Opens the input file of a pipeline with an input policy and applies its
+// hints before any stage starts: the kernel can read ahead while the stages
+// are launched. Stage 0 gets the file as options.in_fd, or with dontneed a
+// pipe from a feeder process, which is added to `pids` (as stage -1 in
+// options.stages). Returns false, after printing the error, if the file
+// cannot be opened.
+bool open_input(const string &file_in, LaunchOptions &options, vector<pid_t> &pids, pid_t &pgid) {
+  const IoPolicy &policy = *options.input_policy;
+  int file = open(file_in.c_str(), O_RDONLY | O_CLOEXEC | (policy.noatime ? O_NOATIME : 0));
+  if (file == -1 && errno == EPERM && policy.noatime) {
+    file = open(file_in.c_str(), O_RDONLY | O_CLOEXEC); // Not the owner of the file.
+  }
+  if (file == -1) {
+    print_error("open input");
+    return false;
+  }
+  options.held.push_back(file);
+  if (policy.sequential) {
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  if (policy.willneed) {
+    posix_fadvise(file, 0, 0, POSIX_FADV_WILLNEED);
+  }
+  if (policy.readahead) {
+    readahead(file, 0, policy.readahead);
+  }
+  if (!policy.dontneed) {
+    options.in_fd = file;
+    return true;
+  }
+
+  int feed[2];
+  if (pipe2(feed, O_CLOEXEC) == -1) {
+    print_error("pipe");
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    print_error("fork");
+    close(feed[0]);
+    close(feed[1]);
+    return false;
+  }
+  if (pid == 0) {
+    if (pgid != -1) {
+      setpgid(0, pgid);
+    }
+    if (restore_launch_sigmask) {
+      sigprocmask(SIG_SETMASK, &launch_sigmask, nullptr);
+    }
+    vector<int> others = {feed[0]};
+    for (int f : options.held) {
+      if (f != file) others.push_back(f);
+    }
+    close_fds(others);
+    run_feeder(file, feed[1], policy);
+  }
+  if (pgid != -1) {
+    setpgid(pid, pgid);
+  }
+  if (pgid == 0) {
+    pgid = pid;
+  }
+  close(feed[1]);
+  options.held.push_back(feed[0]);
+  options.in_fd = feed[0];
+  pids.push_back(pid);
+  if (options.stages) {
+    options.stages->push_back(-1);
+  }
+  return true;
+}
+
+// Opens the redirections of stage `i` and records them in options.redirected.
+// They apply in the order written: `2>&1` sends standard error wherever
+// standard output goes at that point, so `2>&1 > file` leaves it on the
+// original output. An output with several targets (the next stage's pipe
+// counts as one, once a stage that is not the last redirects its output) gets
+// a fan-out process, which is added to `pids` (as stage -1 in options.stages).
+// Returns false, after printing the error, if a file cannot be opened; the
+// files written after it are not created.
+bool open_redirections(const vector<Command> &commands, int i, int pipe_out,
+                       LaunchOptions &options, vector<pid_t> &pids, pid_t &pgid) {
+  const vector<Redirection> &redirections = commands[i].redirections;
+  // Targets per output, in order: a file by its index in `redirections`, or
+  // one of these. The pipe comes last.
+  const int PIPE = -1, ORIGINAL = -2, FINAL_OUTPUT = -3;
+  vector<int> outputs[2];
+  size_t last_output = 0; // One past the last redirection of standard output.
+  for (size_t r = 0; r < redirections.size(); ++r) {
+    if (redirections[r].fd == STDOUT_FILENO) {
+      last_output = r + 1;
+    }
+  }
+  for (size_t r = 0; r < redirections.size(); ++r) {
+    const Redirection &redirection = redirections[r];
+    vector<int> &targets = outputs[redirection.fd - 1];
+    if (!redirection.path.empty()) {
+      targets.push_back(r);
+    } else if (r >= last_output) {
+      targets.push_back(FINAL_OUTPUT); // Standard output as it ends up, fan-out included.
+    } else if (outputs[0].empty()) {
+      targets.push_back(ORIGINAL);
+    } else {
+      targets.insert(targets.end(), outputs[0].begin(), outputs[0].end());
+      if (pipe_out != -1) targets.push_back(PIPE);
+    }
+  }
+  if (!outputs[0].empty() && pipe_out != -1) {
+    outputs[0].push_back(PIPE);
+  }
+
+  // Files that are written behind get the fan-out process even alone.
+  bool fan_out[2];
+  vector<bool> spliced(redirections.size());
+  for (int o : {0, 1}) {
+    bool has_file = any_of(outputs[o].begin(), outputs[o].end(), [](int target) { return target >= 0; });
+    fan_out[o] = outputs[o].size() > 1 || (writes_behind(options.output_policy) && has_file);
+    for (int target : outputs[o]) {
+      if (target >= 0 && fan_out[o]) spliced[target] = true;
+    }
+  }
+
+  vector<int> files(redirections.size(), -1);
+  for (size_t r = 0; r < redirections.size(); ++r) {
+    const Redirection &redirection = redirections[r];
+    if (redirection.path.empty()) {
+      continue;
+    }
+    // splice(2) refuses files opened with O_APPEND, so an append that is
+    // fanned out starts at the end of the file instead.
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (!redirection.append ? O_TRUNC : spliced[r] ? 0 : O_APPEND);
+    int file = open(redirection.path.c_str(), flags, 0644);
+    if (file == -1) {
+      print_error("open output");
+      return false;
+    }
+    options.held.push_back(file);
+    if (redirection.append && spliced[r]) {
+      lseek(file, 0, SEEK_END);
+    }
+    // Best effort: not every file system can allocate ahead.
+    if (options.output_policy && options.output_policy->allocate) {
+      off_t offset = redirection.append ? lseek(file, 0, SEEK_END) : 0;
+      fallocate(file, FALLOC_FL_KEEP_SIZE, max(offset, off_t(0)), options.output_policy->allocate);
+    }
+    files[r] = file;
+  }
+
+  for (int fd : {STDOUT_FILENO, STDERR_FILENO}) {
+    if (outputs[fd - 1].empty()) {
+      continue;
+    }
+    // Standard output before any redirection of its own, or as it ends up.
+    int original = pipe_out != -1 ? pipe_out : options.out_fd;
+    int final_output = options.redirected[i][0] != -1 ? options.redirected[i][0] : original;
+    vector<int> targets;
+    for (int target : outputs[fd - 1]) {
+      targets.push_back(target >= 0 ? files[target] : target == PIPE ? pipe_out : target == ORIGINAL ? original : final_output);
+    }
+    if (!fan_out[fd - 1]) {
+      options.redirected[i][fd - 1] = targets[0];
+      continue;
+    }
+
+    int fan[2];
+    if (pipe2(fan, O_CLOEXEC) == -1) {
+      print_error("pipe");
+      return false;
+    }
+    fcntl(fan[1], F_SETPIPE_SZ, 1 << 20); // Fewer, larger rounds. Best effort.
+    pid_t pid = fork();
+    if (pid == -1) {
+      print_error("fork");
+      close(fan[0]);
+      close(fan[1]);
+      return false;
+    }
+    if (pid == 0) {
+      if (pgid != -1) {
+        setpgid(0, pgid);
+      }
+      if (restore_launch_sigmask) {
+        sigprocmask(SIG_SETMASK, &launch_sigmask, nullptr);
+      }
+      // Keep only the fan-out pipe and the targets.
+      vector<int> others = {fan[1]};
+      for (int f : options.held) {
+        if (find(targets.begin(), targets.end(), f) == targets.end()) others.push_back(f);
+      }
+      close_fds(others);
+      run_fan_out(fan[0], targets, options.output_policy);
+    }
+    if (pgid != -1) {
+      setpgid(pid, pgid);
+    }
+    if (pgid == 0) {
+      pgid = pid;
+    }
+    close(fan[0]);
+    options.held.push_back(fan[1]);
+    options.redirected[i][fd - 1] = fan[1];
+    pids.push_back(pid);
+    if (options.stages) {
+      options.stages->push_back(-1);
+    }
+  }
+  return true;
+}
+
+// Starts the stages of a pipeline and runs the in-shell builtin stage, if any.
+// Returns the pids of the started processes, which the caller has to wait for,
+// and sets `pgid` to their process group (-1: the shell's).
+vector<pid_t> launch_pipeline(vector<Command> &commands, JobTable &jobs,
+                              const string &file_in, const string &file_out,
+                              LaunchOptions options, pid_t &pgid) {
+  int n_commands =
+      commands.size(); // To remove overhead of calling .size() every time.
+  vector<pid_t>
+      pids; // To keep track of which subprocesses to wait for later on.
+  pgid = -1;
+  if (options.out_fd == -1) {
+    options.out_fd = shell_io.out;
+  }
+
+  if (n_commands == 0) {
+    return pids;
+  }
+  
+  // Commands are looked up here in the parent, so the results stay cached.
+  validate_path_cache();
+
+  // Look up the builtins once.
+  vector<const Builtin *> stage_builtins(n_commands);
+  for (int i = 0; i < n_commands; i++) {
+    stage_builtins[i] = find_builtin(commands[i]);
+  }
+
+  // A builtin that changes the shell runs inside it when it is the only
+  // command. Otherwise, the first builtin of a foreground pipeline runs inside
+  // the shell once all other stages are started. Only one can: the shell runs
+  // one stage at a time, so a second one would never get to drain its pipe.
+  // Other builtins run in a forked child without exec.
+  bool relay = options.relays != nullptr;
+  int in_process = -1;
+  bool background = options.background;
+  bool in_shell = options.in_shell && !relay && (options.terminal == -1 || n_commands == 1);
+  if (in_shell && n_commands == 1 && stage_builtins[0] &&
+      (stage_builtins[0]->changes_shell || !background)) {
+    in_process = 0;
+  }
+  for (int i = 0; i < n_commands && in_shell && !background && in_process == -1; i++) {
+    if (stage_builtins[i] && !stage_builtins[i]->changes_shell) {
+      in_process = i;
+    }
+  }
+
+  // A background pipeline gets a process group of its own, led by its first
+  // process, so `fg` can hand it the terminal and `bg` can continue it. So does
+  // a foreground pipeline with options.group, which is reaped and signalled as
+  // a whole.
+  pgid = background || options.group ? 0 : -1;
+  bool terminal_given = false;
+
+  // The pipe between stage i and i + 1 is only created when stage i starts,
+  // and the shell closes its ends as soon as the stages that use them are
+  // started. So the shell holds a few descriptors at any time, however long
+  // the pipeline is, and a forked child only has those few to close. All of
+  // them are O_CLOEXEC, so spawned children do not get them at all.
+  // With relays, every pipe is split in two: stage i writes to the first one,
+  // stage i + 1 reads from the second one, and the shell keeps the ends in
+  // between for the whole pipeline.
+  vector<int> &held = options.held;
+  held.clear();
+  options.redirected.assign(n_commands, {-1, -1});
+  if (relay) {
+    options.relays->clear();
+  }
+  int in = -1;                   // Read end of the pipe into stage i.
+  array<int, 2> in_process_pipes = {-1, -1};
+  bool in_process_ready = false; // Whether the in-shell stage has its files.
+  for (int i = 0; i < n_commands; i++) {
+    size_t base = held.size();
+    if (in != -1) {
+      held.push_back(in);
+    }
+    int out = -1, next_in = -1;
+    array<int, 2> relay_ends = {-1, -1};
+    bool failed = false;
+    if (i < n_commands - 1) {
+      int p[2], q[2];
+      if (pipe2(p, O_CLOEXEC) == -1) {
+        print_error("pipe");
+        failed = true;
+      } else if (relay && pipe2(q, O_CLOEXEC) == -1) {
+        print_error("pipe");
+        close(p[0]);
+        close(p[1]);
+        failed = true;
+      } else {
+        out = p[1];
+        next_in = relay ? q[0] : p[0];
+        held.insert(held.end(), {p[0], p[1]});
+        if (relay) {
+          relay_ends = {p[0], q[1]};
+          options.relays->push_back(relay_ends);
+          held.insert(held.end(), {q[0], q[1]});
+        }
+      }
+    }
+
+    // The files of a stage's redirections are opened (and its outputs fanned
+    // out) right before it starts, and so is the input file of the first one
+    // if it has an input policy. A stage with a file that cannot be opened
+    // is skipped.
+    bool launchable = !failed &&
+                      (i != 0 || !options.input_policy || options.in_fd != -1 || empty_or_whitespace(file_in) ||
+                       open_input(file_in, options, pids, pgid)) &&
+                      (commands[i].redirections.empty() || open_redirections(commands, i, out, options, pids, pgid));
+    if (launchable && i == in_process) {
+      in_process_pipes = {in, out};
+      in_process_ready = true;
+    } else if (launchable) {
+      Resolution resolved;
+      const Builtin *builtin = stage_builtins[i];
+      if (!builtin && !commands[i].parts.empty()) {
+        resolved = resolve_command(commands[i].parts[0]);
+      }
+
+      // Builtins need the forked shell, so they always take the fork path.
+      TraceSpan span(TRACE_LAUNCH, commands[i].parts.empty() ? string_view() : string_view(commands[i].parts[0]));
+      pid_t pid;
+      if (launch_backend == LaunchBackend::Spawn && !builtin && !options.placement && !exceeds_arg_max(commands[i]) &&
+          (SPAWN_SETS_TERMINAL || options.terminal == -1)) {
+        pid = spawn_stage(commands, i, resolved, in, out, file_in, file_out, options, pgid);
+      } else {
+        // Do this through fork(). So n_commands different child forks from the
+        // parent process are made.
+        pid = fork();
+        if (pid == -1) {
+          print_error("fork");
+          failed = true;
+          pid = 0;
+        } else if (pid == 0) {
+          run_forked_stage(commands, i, builtin, resolved, in, out, file_in, file_out, options, pgid, jobs);
+        } else if (pgid != -1) {
+          setpgid(pid, pgid); // Also in the parent, so it holds before anything waits on the group.
+        }
+      }
+
+      // Parent pushes the pid to the pids list to keep track of which pids to
+      // wait for. 0: nothing was launched, errors are printed already.
+      if (pid != 0) {
+        pids.push_back(pid);
+        if (options.stages) {
+          options.stages->push_back(i);
+        }
+        if (pgid == 0) {
+          pgid = pid;
+        }
+      }
+    }
+    // The stages take the terminal themselves as well; this covers a group
+    // that is led by a fan-out process.
+    if (options.terminal != -1 && pgid > 0 && !terminal_given) {
+      tcsetpgrp(options.terminal, pgid);
+      terminal_given = true;
+    }
+
+    // Close what this stage was started with, but keep the read end for the
+    // next stage, the relay ends and everything of the in-shell stage.
+    vector<int> done;
+    size_t kept = base;
+    for (size_t k = base; k < held.size(); ++k) {
+      int fd = held[k];
+      if (fd == next_in) {
+        continue;
+      }
+      if ((i == in_process && launchable) || fd == relay_ends[0] || fd == relay_ends[1]) {
+        held[kept++] = fd;
+      } else {
+        done.push_back(fd);
+      }
+    }
+    held.resize(kept);
+    close_fds(done);
+    in = next_in;
+    if (failed) {
+      break;
+    }
+  }
+  if (in != -1) {
+    close(in);
+  }
+
+  // At this point the shell only holds the relay ends or the in-shell stage's
+  // pipe ends and files.
+  if (in_process_ready) {
+    int status = run_in_process_stage(commands, in_process, *stage_builtins[in_process], in_process_pipes[0],
+                                      in_process_pipes[1], file_in, file_out, options, jobs);
+    if (options.in_shell_stage) {
+      *options.in_shell_stage = in_process;
+    }
+    if (options.in_shell_status) {
+      *options.in_shell_status = status;
+    }
+  }
+  if (!relay) {
+    close_fds(held);
+  }
+  return pids;
+}
+
+// Launches a pipeline with `options` and waits for it, or adds it to the job
+// table if options.background is set. Returns the exit status of its last
+// command (127 if that did not start, 0 for a background pipeline), or the one
+// that pipefail or failfast give it.
+int run_pipeline(vector<Command> &commands, JobTable &jobs, const string &file_in,
+                 const string &file_out, LaunchOptions options) {
+  TraceSpan span(TRACE_PIPELINE, commands.empty() || commands[0].parts.empty() ? string_view() : string_view(commands[0].parts[0]));
+  int in_shell_stage = -1, in_shell_status = 0;
+  vector<int> stages;
+  options.stages = &stages;
+  options.in_shell_stage = &in_shell_stage;
+  options.in_shell_status = &in_shell_status;
+  pid_t pgid;
+
+  // A background job writes into its capture, unless its output goes elsewhere.
+  shared_ptr<JobOutput> output;
+  int output_pipe = -1;
+  if (options.background && job_output_size > 0 && options.out_fd == -1 && options.err_fd == -1 &&
+      (output = open_job_output(output_pipe))) {
+    options.out_fd = options.err_fd = output_pipe;
+  }
+  // If the shell has the terminal, a foreground pipeline runs in a process
+  // group of its own as well, which gets the terminal while it runs. Otherwise
+  // it stays in the shell's group, so that a signal to that group (an
+  // interrupt from the terminal of whoever started the shell) reaches both.
+  if (!options.background) {
+    options.terminal = foreground_terminal();
+    options.group = options.terminal != -1;
+  }
+  // The hints for the redirected files. With output hints, the `> file` of
+  // the last command is opened like its other redirections, which apply them.
+  string output_file = file_out;
+  IoPolicy output_policy = io_output_policy;
+  if (io_policy_set(io_input_policy)) {
+    options.input_policy = &io_input_policy;
+  }
+  if (io_policy_set(output_policy)) {
+    struct stat st;
+    if (output_policy.allocate_input && stat(file_in.c_str(), &st) == 0) {
+      output_policy.allocate = st.st_size;
+    }
+    options.output_policy = &output_policy;
+    if (!empty_or_whitespace(output_file) && !commands.empty()) {
+      commands.back().redirections.push_back({STDOUT_FILENO, output_file});
+      output_file.clear();
+    }
+  }
+  vector<pid_t> pids = launch_pipeline(commands, jobs, file_in, output_file, options, pgid);
+  if (output_pipe != -1) {
+    close(output_pipe);
+  }
+
+  if (options.background) {
+    // The job table reaps the processes from now on. It prints the job number.
+    if (!pids.empty()) {
+      add_job(jobs, pids, pgid, describe_pipeline(commands, file_in, output_file), output);
+    }
+    return 0;
+  }
+  if (commands.empty()) {
+    return 127;
+  }
+
+  // Run in foreground; wait for all processes and block. They are reaped in
+  // the order they finish, so a stage that fails early is noticed while the
+  // others still run. Per stage, its exit status (127: it did not start).
+  vector<int> statuses(commands.size(), 127);
+  if (in_shell_stage != -1) {
+    statuses[in_shell_stage] = in_shell_status;
+  }
+  // With failfast, the status of the stage that failed first, once the rest of
+  // the group is signalled. A stage whose reader went away (SIGPIPE, or EPIPE
+  // for one in the shell) has not failed.
+  int failure = -1;
+  auto check_failure = [&](int status) {
+    if (failfast && failure == -1 && status != 0 && status != 128 + SIGPIPE) {
+      failure = status;
+      if (!pids.empty() && pgid > 0) {
+        kill(-pgid, SIGTERM);
+      }
+      for (size_t p = 0; p < pids.size() && pgid <= 0; ++p) {
+        if (pids[p] != 0) kill(pids[p], SIGTERM);
+      }
+    }
+  };
+  if (in_shell_stage != -1) {
+    check_failure(in_shell_status);
+  }
+  // A pipeline with a group of its own is reaped from that group; one in the
+  // shell's group only by its pids, since the shell does not own the group.
+  bool stopped = false;
+  if (!pids.empty()) {
+    TraceSpan wait_span(TRACE_WAIT, span.detail);
+    size_t running = pids.size();
+    while (running > 0) {
+      int status;
+      pid_t pid = pgid > 0 ? waitpid(-pgid, &status, WUNTRACED) : wait_own_process(pids, jobs, &status);
+      if (pid == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        print_error("waitpid");
+        break;
+      }
+      size_t p = find(pids.begin(), pids.end(), pid) - pids.begin();
+      if (p == pids.size()) {
+        continue;
+      }
+      if (WIFSTOPPED(status)) {
+        // Ctrl-Z: what is left of the pipeline becomes a stopped job.
+        stopped = true;
+        statuses.back() = 128 + WSTOPSIG(status);
+        break;
+      }
+      pids[p] = 0;
+      running--;
+      if (stages[p] == -1) {
+        continue; // A fan-out process.
+      }
+      statuses[stages[p]] = exit_status(status);
+      bool signalled = WIFSIGNALED(status);
+      check_failure(statuses[stages[p]]);
+      if (signalled && !(failure != -1 && WTERMSIG(status) == SIGTERM)) {
+        // Only report errors for processes that were terminated through a
+        // signal (other than the one failfast sends). Other processes that
+        // were terminated regularly will already have printed any
+        // relevant/necessary error messages.
+
+        int sig_code = WTERMSIG(status) ;
+        shell_err << strsignal(sig_code) << std::endl;
+      }
+    }
+  }
+  if (options.terminal != -1 && !pids.empty()) {
+    reclaim_terminal(options.terminal);
+  }
+  if (stopped) {
+    pids.erase(remove(pids.begin(), pids.end(), 0), pids.end());
+    string description = describe_pipeline(commands, file_in, output_file);
+    int id = add_job(jobs, pids, pgid, description);
+    jobs.jobs.at(id).stopped = true;
+    shell_out << "[" << id << "] stopped  " << description << std::endl;
+    return statuses.back();
+  }
+
+  if (failure != -1) {
+    return failure;
+  }
+  if (pipefail) {
+    for (auto it = statuses.rbegin(); it != statuses.rend(); ++it) {
+      if (*it != 0) {
+        return *it;
+      }
+    }
+    return 0;
+  }
+  return statuses.back();
+}
+
+// Runs a pipeline. Returns the exit status of its last command (127 if that
+// did not start, 0 for a background pipeline).
+int execute_commands(
+    vector<Command> &commands, // Commands as split with pipes
+    JobTable &jobs,            // Background jobs. A pipeline that runs in the
+                               // background is added to it.
+    string &file_in,  // Input file name in case the first command uses an input
+                      // file.
+    string &file_out, // Output file name in case the last command uses an
+                      // output file.
+    bool background,  // Whether `&` is used in the command (in this case run
+                      // processes in the background).
+    int in_fd         // Input of the first command instead of file_in, or -1.
+) {
+  LaunchOptions options;
+  options.background = background;
+  options.in_fd = in_fd;
+  return run_pipeline(commands, jobs, file_in, file_out, options);
+}
+
+// An instance of the command that `parallel` runs: one pipeline.
+struct ParallelInstance {
+  vector<pid_t> pids;      // -1 once reaped.
+  vector<int> pidfds;      // -1 once reaped or without pidfd support.
+  size_t running = 0;      // Processes that are not reaped yet.
+  int status = 0;          // Wait status of the last process of the pipeline.
+  int output = -1;         // memfd that collects the output with -k.
+};
+
+// Replaces every `{}` in `text` by `argument`. Returns whether there was one.
+bool substitute_argument(string& text, const string& argument) {
+  bool found = false;
+  for (size_t pos = text.find("{}"); pos != string::npos; pos = text.find("{}", pos + argument.size())) {
+    text.replace(pos, 2, argument);
+    found = true;
+  }
+  return found;
+}
+
+// Reaps process `p` of `instance` if it has terminated, and adds its CPU time
+// to `usage`. Returns whether it was reaped.
+bool reap_instance_process(ParallelInstance& instance, size_t p, int flags, rusage& usage, int epoll_fd) {
+  if (instance.pids[p] == -1) {
+    return false;
+  }
+  int status;
+  rusage process_usage;
+  pid_t result = wait4(instance.pids[p], &status, flags, &process_usage);
+  if (result == 0 || (result == -1 && errno == EINTR)) {
+    return false;
+  }
+  if (result == -1) {
+    print_error("wait4");
+    status = 0;
+  } else {
+    timeradd(&usage.ru_utime, &process_usage.ru_utime, &usage.ru_utime);
+    timeradd(&usage.ru_stime, &process_usage.ru_stime, &usage.ru_stime);
+  }
+  if (p == instance.pids.size() - 1) {
+    instance.status = status;
+  }
+  if (instance.pidfds[p] != -1) {
+    // Forked builtin stages inherit the pidfd without exec'ing, so closing it
+    // does not necessarily remove it from the epoll set.
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, instance.pidfds[p], nullptr);
+    close(instance.pidfds[p]);
+    instance.pidfds[p] = -1;
+  }
+  instance.pids[p] = -1;
+  instance.running--;
+  return true;
+}
+
+// `parallel [-j n] [-k] command... ::: argument...`: runs the command once per
+// argument, with at most n instances at a time (default: one per online CPU).
+// The next instance starts as soon as one finishes. `{}` in the command is
+// replaced by the argument, without `{}` the argument is appended. If the
+// command contains `|`, `<` or `>` words (quoted, so the shell itself leaves
+// them alone), it is parsed as a command line: `parallel 'gzip -c < {} > {}.gz' ::: a b`.
+// With -k, the output of each instance is collected and written in the order
+// of the arguments. Returns the number of failed instances (101: more than
+// 100) and prints the wall clock and CPU time used to standard error.
+int builtin_parallel(const vector<string>& args, BuiltinIO& io, JobTable& jobs) {
+  long slots = sysconf(_SC_NPROCESSORS_ONLN);
+  bool keep_order = false;
+  size_t i = 1;
+  for (; i < args.size() && is_option(args[i]); ++i) {
+    if (args[i] == "-k") {
+      keep_order = true;
+    } else if (args[i] == "-j" && i + 1 < args.size()) {
+      slots = atol(args[++i].c_str());
+    } else if (args[i].compare(0, 2, "-j") == 0) {
+      slots = atol(args[i].c_str() + 2);
+    } else {
+      slots = 0;
+      break;
+    }
+  }
+  size_t separator = find(args.begin() + i, args.end(), ":::") - args.begin();
+  if (slots < 1 || separator == i || separator == args.size()) {
+    shell_err << "usage: parallel [-j n] [-k] command... ::: argument..." << endl;
+    return 255;
+  }
+
+  Expression command;
+  auto is_operator = [](const string& word) { return word == "|" || word == "<" || word == ">" || word.compare(0, 3, "<<<") == 0; };
+  if (any_of(args.begin() + i, args.begin() + separator, is_operator)) {
+    string line;
+    for (size_t j = i; j < separator; ++j) {
+      line += args[j] + " ";
+    }
+    ParseArena arena;
+    int errors = parse_command_line(line, arena);
+    if (errors) {
+      print_parse_errors(errors, "parallel: ");
+      return 255;
+    }
+    command = move(arena.expression);
+  } else {
+    command.commands.push_back({vector<string>(args.begin() + i, args.begin() + separator)});
+  }
+  if (command.commands.empty() || command.background) {
+    shell_err << "parallel: the command must run in the foreground" << endl;
+    return 255;
+  }
+
+  size_t n_instances = args.size() - separator - 1;
+  vector<ParallelInstance> instances(n_instances);
+  vector<size_t> active; // Instances with processes that are not reaped yet.
+  size_t next = 0;       // Next instance to start.
+  size_t emitted = 0;    // Instances that are done, with their output written.
+  size_t failed = 0;
+  rusage usage = {};
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Finished instances are noticed through their pidfds. Without pidfd
+  // support, the shell waits for the processes one by one instead.
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  while (emitted < n_instances) {
+    if (next < n_instances && active.size() < size_t(slots)) {
+      // Start the next instance.
+      ParallelInstance& instance = instances[next];
+      const string& argument = args[separator + 1 + next];
+      Expression expression = command;
+      bool substituted = substitute_argument(expression.inputFromFile, argument);
+      substituted |= substitute_argument(expression.inputDocument, argument);
+      substituted |= substitute_argument(expression.outputToFile, argument);
+      for (Command& cmd : expression.commands) {
+        for (string& part : cmd.parts) {
+          substituted |= substitute_argument(part, argument);
+        }
+        for (Redirection& redirection : cmd.redirections) {
+          substituted |= substitute_argument(redirection.path, argument);
+        }
+      }
+      if (!substituted) {
+        expression.commands.back().parts.push_back(argument);
+      }
+      // A parsed command line is expanded like one the shell runs itself.
+      bool expanded = expand_expression(expression);
+
+      LaunchOptions options;
+      options.in_shell = false;
+      options.out_fd = io.out;
+      if (keep_order) {
+        instance.output = memfd_create("parallel", MFD_CLOEXEC);
+        if (instance.output == -1) {
+          print_error("memfd_create");
+        } else {
+          options.out_fd = instance.output;
+        }
+      }
+
+      if (expression.inputInline) {
+        options.in_fd = open_document(expression.inputDocument);
+      }
+
+      pid_t pgid;
+      if (expanded) {
+        instance.pids = launch_pipeline(expression.commands, jobs, expression.inputFromFile,
+                                        expression.outputToFile, options, pgid);
+      }
+      if (options.in_fd != -1) close(options.in_fd);
+      instance.pidfds.assign(instance.pids.size(), -1);
+      instance.running = instance.pids.size();
+      if (instance.pids.empty()) {
+        // Nothing started, the error is printed already.
+        instance.status = (expanded ? 127 : 1) << 8;
+      }
+      for (size_t p = 0; p < instance.pids.size() && epoll_fd != -1; ++p) {
+        instance.pidfds[p] = pidfd_open(instance.pids[p]);
+        epoll_event event = {EPOLLIN, {.u64 = (uint64_t(next) << 32) | p}};
+        if (instance.pidfds[p] != -1) {
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, instance.pidfds[p], &event);
+        }
+      }
+      active.push_back(next++);
+    } else {
+      // All slots are busy (or nothing is left to start): wait for a process.
+      // Processes without a pidfd are waited for directly.
+      bool waited = false;
+      for (size_t a = 0; a < active.size() && !waited; ++a) {
+        ParallelInstance& instance = instances[active[a]];
+        for (size_t p = 0; p < instance.pids.size() && !waited; ++p) {
+          if (instance.pids[p] != -1 && instance.pidfds[p] == -1) {
+            waited = reap_instance_process(instance, p, 0, usage, epoll_fd);
+          }
+        }
+      }
+      if (!waited && epoll_fd != -1) {
+        epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        for (int e = 0; e < n; ++e) {
+          ParallelInstance& instance = instances[events[e].data.u64 >> 32];
+          reap_instance_process(instance, size_t(events[e].data.u64 & 0xffffffff), WNOHANG, usage, epoll_fd);
+        }
+      }
+    }
+
+    // Free the slots of finished instances.
+    for (size_t a = 0; a < active.size();) {
+      ParallelInstance& instance = instances[active[a]];
+      if (instance.running > 0) {
+        a++;
+        continue;
+      }
+      if (WIFSIGNALED(instance.status)) {
+        shell_err << strsignal(WTERMSIG(instance.status)) << endl;
+      }
+      failed += instance.status != 0;
+      active[a] = active.back();
+      active.pop_back();
+    }
+
+    // Write the output of the finished instances, in order.
+    while (emitted < next && instances[emitted].running == 0) {
+      int output = instances[emitted].output;
+      if (output != -1) {
+        lseek(output, 0, SEEK_SET);
+        int error = copy_fd(output, io.out);
+        if (error && error != EPIPE) {
+          shell_err << "parallel: " << strerror(error) << endl;
+        }
+        close(output);
+      }
+      emitted++;
+    }
+  }
+
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+  }
+
+  // Utilization: CPU time of all instances against the wall clock time.
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  double system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  double busy = wall > 0 ? (user + system) / wall : 0;
+  char summary[256];
+  snprintf(summary, sizeof(summary),
+           "parallel: %zu jobs, %zu failed, %.3fs wall, %.3fs user, %.3fs sys, %.2f of %ld slots busy (%.0f%%)",
+           n_instances, failed, wall, user, system, busy, slots, 100 * busy / slots);
+  shell_err << summary << endl;
+
+  return int(min<size_t>(failed, 101));
+}
+
+// A process of a pipeline that is timed by `time`.
+struct StageTiming {
+  pid_t pid = -1;    // -1 if the stage did not start, or once it is reaped.
+  int pidfd = -1;
+  int status = 0;
+  bool started = false;
+  double wall = 0;   // Seconds from the start of the pipeline until the stage exited.
+  rusage usage = {};
+};
+
+// The shell's part of a pipe between two timed stages: it moves the data from
+// the writer's half to the reader's half and counts it.
+struct PipeRelay {
+  int from, to;             // -1 once closed.
+  uint64_t bytes = 0;
+  bool waiting_out = false; // The reader's half is full: wait until it is writable.
+};
+
+// epoll data for the relays of a timed pipeline, the stages use their index.
+const uint64_t EVENT_RELAY = uint64_t(1) << 32;
+
+double seconds_since(const timespec& start) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+double seconds(const timeval& time) {
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+// Reaps the process of `stage` if it has terminated.
+void reap_timed_stage(StageTiming& stage, int flags, const timespec& start, int epoll_fd) {
+  if (stage.pid == -1) {
+    return;
+  }
+  pid_t result = wait4(stage.pid, &stage.status, flags, &stage.usage);
+  if (result == 0 || (result == -1 && errno == EINTR)) {
+    return;
+  }
+  if (result == -1) {
+    print_error("wait4");
+  }
+  stage.wall = seconds_since(start);
+  if (stage.pidfd != -1) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stage.pidfd, nullptr);
+    close(stage.pidfd);
+    stage.pidfd = -1;
+  }
+  stage.pid = -1;
+}
+
+// Moves what is in the writer's half of `relay` to the reader's half, without
+// blocking. Switches between waiting for data and waiting for room when
+// needed, and closes both halves at the end of the data (or when the reader is
+// gone, so the writer gets EPIPE like with a plain pipe).
+void pump_relay(PipeRelay& relay, uint64_t data, int epoll_fd) {
+  while (true) {
+    ssize_t n = splice(relay.from, nullptr, relay.to, nullptr, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      relay.bytes += n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      // Either the writer's half is empty or the reader's half is full.
+      int available = 0;
+      ioctl(relay.from, FIONREAD, &available);
+      bool full = available > 0;
+      if (full != relay.waiting_out) {
+        epoll_event event = {full ? uint32_t(EPOLLOUT) : uint32_t(EPOLLIN), {.u64 = data}};
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, full ? relay.from : relay.to, nullptr);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, full ? relay.to : relay.from, &event);
+        relay.waiting_out = full;
+      }
+      return;
+    }
+    if (n == -1 && errno != EPIPE) {
+      print_error("splice");
+    }
+    close(relay.from); // Also removes it from the epoll set.
+    close(relay.to);
+    relay.from = relay.to = -1;
+    return;
+  }
+}
+
+// Human readable size for the `time` table.
+string format_size(double bytes) {
+  const char* units = "BKMGT";
+  int unit = 0;
+  while (bytes >= 1024 && unit < 4) {
+    bytes /= 1024;
+    unit++;
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), unit == 0 ? "%.0f%c" : "%.1f%c", bytes, units[unit]);
+  return buffer;
+}
+
+// A size in bytes, with an optional K, M or G suffix. Returns false if `text`
+// is not one.
+bool parse_size(const char* text, uint64_t& size) {
+  char* end;
+  double value = strtod(text, &end);
+  int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+  if (end == text || value < 0 || end[shift != 0] != '\0') {
+    return false;
+  }
+  size = uint64_t(value * double(uint64_t(1) << shift));
+  return true;
+}
+
+// `command` as a JSON string.
+string json_string(const string& command) {
+  string json = "\"";
+  for (unsigned char c : command) {
+    if (c == '"' || c == '\\') {
+      json += '\\';
+      json += c;
+    } else if (c < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      json += buffer;
+    } else {
+      json += c;
+    }
+  }
+  return json + "\"";
+}
+
+// Writes the events in the ring buffer to `path` in the Chrome trace event
+// format (JSON), which Perfetto and chrome://tracing open. Times are in
+// microseconds of CLOCK_MONOTONIC.
+bool write_trace(const string& path) {
+  string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  uint64_t head = trace_buffer ? trace_buffer->head.load(memory_order_acquire) : 0;
+  bool first = true;
+  for (uint64_t ticket = head > trace_capacity ? head - trace_capacity : 0; ticket < head; ++ticket) {
+    const TraceEvent& event = trace_buffer->events[ticket % trace_capacity];
+    if (event.sequence.load(memory_order_acquire) != ticket + 1) {
+      continue; // Being written, or overwritten already.
+    }
+    uint64_t start = event.start, duration = event.duration;
+    int pid = event.pid, phase = event.phase;
+    char detail[sizeof(event.detail)];
+    memcpy(detail, event.detail, sizeof(detail));
+    atomic_thread_fence(memory_order_acquire);
+    if (event.sequence.load(memory_order_relaxed) != ticket + 1 || phase >= TRACE_PHASES) {
+      continue;
+    }
+    detail[sizeof(detail) - 1] = '\0';
+    char buffer[192];
+    snprintf(buffer, sizeof(buffer), "%s\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+             first ? "" : ",", trace_phase_names[phase], start / 1e3, duration / 1e3, pid, pid);
+    json += buffer;
+    if (detail[0]) {
+      json += ",\"args\":{\"command\":" + json_string(detail) + "}";
+    }
+    json += "}";
+    first = false;
+  }
+  json += "\n]}\n";
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool written = fd != -1 && write_all(fd, json);
+  if (!written) {
+    print_error(path);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  return written;
+}
+
+// Human readable duration for the `stats` table.
+string format_duration(uint64_t ns) {
+  char buffer[32];
+  if (ns < 1000) {
+    snprintf(buffer, sizeof(buffer), "%luns", (unsigned long)ns);
+  } else if (ns < 1000000) {
+    snprintf(buffer, sizeof(buffer), "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(buffer, sizeof(buffer), "%.1fms", ns / 1e6);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%.2fs", ns / 1e9);
+  }
+  return buffer;
+}
+
+// Duration below which `fraction` of the spans in `histogram` are.
+uint64_t trace_percentile(const TraceHistogram& histogram, uint64_t count, double fraction) {
+  uint64_t rank = max<uint64_t>(1, uint64_t(fraction * count + 0.999999)), seen = 0;
+  for (int bucket = 0; bucket < trace_buckets; ++bucket) {
+    seen += histogram.buckets[bucket].load(memory_order_relaxed);
+    if (seen >= rank) {
+      return min(trace_bucket_limit(bucket), histogram.max.load(memory_order_relaxed));
+    }
+  }
+  return histogram.max.load(memory_order_relaxed);
+}
+
+// `stats` prints per phase how many spans tracing recorded and their p50, p99
+// and maximum duration. `stats on` and `stats off` start and stop tracing,
+// `stats -r` drops what was recorded and `stats -w file` writes the events of
+// the ring buffer to `file` as a Chrome trace.
+int builtin_stats(const vector<string>& args, BuiltinIO& io, JobTable&) {
+  if (args.size() == 2 && args[1] == "on") {
+    tracing = trace_buffer || start_tracing();
+    return tracing ? 0 : 1;
+  }
+  if (args.size() == 2 && args[1] == "off") {
+    tracing = false;
+    return 0;
+  }
+  if (args.size() == 2 && args[1] == "-r") {
+    bool on = tracing;
+    if (trace_buffer && !start_tracing()) {
+      return 1;
+    }
+    tracing = on;
+    return 0;
+  }
+  if (args.size() == 3 && args[1] == "-w") {
+    return write_trace(args[2]) ? 0 : 1;
+  }
+  if (args.size() != 1) {
+    shell_err << "usage: stats [on | off | -r | -w file]" << endl;
+    return 2;
+  }
+
+  string table = "phase        count       p50       p99       max\n";
+  for (int phase = 0; phase < TRACE_PHASES; ++phase) {
+    char buffer[128];
+    uint64_t count = trace_buffer ? trace_buffer->histograms[phase].count.load(memory_order_relaxed) : 0;
+    if (count == 0) {
+      snprintf(buffer, sizeof(buffer), "%-8s %9d %9s %9s %9s\n", trace_phase_names[phase], 0, "-", "-", "-");
+    } else {
+      const TraceHistogram& histogram = trace_buffer->histograms[phase];
+      snprintf(buffer, sizeof(buffer), "%-8s %9lu %9s %9s %9s\n", trace_phase_names[phase], (unsigned long)count,
+               format_duration(trace_percentile(histogram, count, 0.5)).c_str(),
+               format_duration(trace_percentile(histogram, count, 0.99)).c_str(),
+               format_duration(histogram.max.load(memory_order_relaxed)).c_str());
+    }
+    table += buffer;
+  }
+  return write_all(io.out, table) ? 0 : 1;
+}
+
+// `time [-v] [-j] pipeline`: runs the pipeline in the foreground and prints to
+// standard error per stage how long it ran, its CPU time and maximum resident
+// set size (from wait4), and how many bytes it wrote into the pipe to the next
+// stage. -v adds context switches and page faults, -j prints JSON instead.
+// The pipes are relayed by the shell to count the bytes, and builtin stages
+// run in a forked child, so every stage has rusage of its own. Returns the
+// exit status of the last stage.
+int time_pipeline(Expression& expression, JobTable& jobs) {
+  vector<string>& first = expression.commands[0].parts;
+  bool verbose = false, json = false;
+  size_t skip = 1;
+  for (; skip < first.size() && is_option(first[skip]); ++skip) {
+    for (char option : first[skip].substr(1)) {
+      verbose |= option == 'v';
+      json |= option == 'j';
+    }
+  }
+  first.erase(first.begin(), first.begin() + skip);
+  if (expression.background) {
+    shell_err << "time: cannot time a background pipeline" << endl;
+    return 1;
+  }
+  if (first.empty() && expression.commands.size() == 1) {
+    return 0;
+  }
+
+  vector<Command>& commands = expression.commands;
+  size_t n_commands = commands.size();
+  vector<StageTiming> stages(n_commands);
+  vector<array<int, 2>> relay_fds;
+  vector<int> launched;
+  LaunchOptions options;
+  options.in_shell = false;
+  options.relays = &relay_fds;
+  options.stages = &launched;
+
+  if (expression.inputInline && (options.in_fd = open_document(expression.inputDocument)) == -1) {
+    return 1;
+  }
+
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pgid;
+  vector<pid_t> pids = launch_pipeline(commands, jobs, expression.inputFromFile, expression.outputToFile, options, pgid);
+  if (options.in_fd != -1) close(options.in_fd);
+
+  // Stage processes are watched through pidfds, the relays through their ends.
+  // Without pidfd support, the processes are polled every few milliseconds.
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  bool polling = false;
+  vector<pid_t> fan_outs; // Not timed, only reaped at the end.
+  for (size_t p = 0; p < pids.size(); ++p) {
+    if (launched[p] == -1) {
+      fan_outs.push_back(pids[p]);
+      continue;
+    }
+    StageTiming& stage = stages[launched[p]];
+    stage.pid = pids[p];
+    stage.started = true;
+    stage.pidfd = pidfd_open(stage.pid);
+    epoll_event event = {EPOLLIN, {.u64 = uint64_t(launched[p])}};
+    if (stage.pidfd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stage.pidfd, &event) == -1) {
+      polling = true;
+    }
+  }
+  vector<PipeRelay> relays;
+  for (const auto& fds : relay_fds) {
+    relays.push_back({fds[0], fds[1]});
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    epoll_event event = {EPOLLIN, {.u64 = EVENT_RELAY | (relays.size() - 1)}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &event);
+  }
+
+  // A reader that goes away must only close the relay, not end the shell.
+  struct sigaction ignore = {}, previous;
+  ignore.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ignore, &previous);
+  while (true) {
+    bool running = false;
+    for (const StageTiming& stage : stages) running |= stage.pid != -1;
+    for (const PipeRelay& relay : relays) running |= relay.from != -1;
+    if (!running) break;
+
+    epoll_event events[64];
+    int n = epoll_wait(epoll_fd, events, 64, polling ? 10 : -1);
+    for (int e = 0; e < n; ++e) {
+      uint64_t data = events[e].data.u64;
+      if (data & EVENT_RELAY) {
+        PipeRelay& relay = relays[data & 0xffffffff];
+        if (relay.from != -1) pump_relay(relay, data, epoll_fd);
+      } else {
+        reap_timed_stage(stages[data], WNOHANG, start, epoll_fd);
+      }
+    }
+    for (StageTiming& stage : stages) {
+      if (polling && stage.pidfd == -1) reap_timed_stage(stage, WNOHANG, start, epoll_fd);
+    }
+  }
+  sigaction(SIGPIPE, &previous, nullptr);
+  close(epoll_fd);
+  for (pid_t pid : fan_outs) {
+    waitpid(pid, nullptr, 0);
+  }
+  double wall = seconds_since(start);
+
+  rusage total = {};
+  for (const StageTiming& stage : stages) {
+    if (WIFSIGNALED(stage.status)) {
+      shell_err << strsignal(WTERMSIG(stage.status)) << endl;
+    }
+    timeradd(&total.ru_utime, &stage.usage.ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &stage.usage.ru_stime, &total.ru_stime);
+  }
+
+  string report;
+  char line[512];
+  if (json) {
+    snprintf(line, sizeof(line), "{\"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, \"stages\": [",
+             wall, seconds(total.ru_utime), seconds(total.ru_stime));
+    report = line;
+    for (size_t i = 0; i < n_commands; ++i) {
+      const StageTiming& stage = stages[i];
+      const rusage& u = stage.usage;
+      string command = describe_pipeline({commands[i]}, "", "");
+      snprintf(line, sizeof(line),
+               "%s\n  {\"command\": %s, \"started\": %s, \"status\": %d, \"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+               "\"maxrss_kb\": %ld, \"voluntary_switches\": %ld, \"involuntary_switches\": %ld, "
+               "\"minor_faults\": %ld, \"major_faults\": %ld, \"pipe_bytes\": %s}",
+               i > 0 ? "," : "", json_string(command).c_str(), stage.started ? "true" : "false",
+               exit_status(stage.status), stage.wall, seconds(u.ru_utime), seconds(u.ru_stime), u.ru_maxrss,
+               u.ru_nvcsw, u.ru_nivcsw, u.ru_minflt, u.ru_majflt,
+               i < relays.size() ? to_string(relays[i].bytes).c_str() : "null");
+      report += line;
+    }
+    report += "\n]}\n";
+  } else {
+    snprintf(line, sizeof(line), "%-6s %9s %9s %9s %8s %8s", "stage", "wall", "user", "sys", "maxrss", "pipe");
+    report = line;
+    if (verbose) {
+      snprintf(line, sizeof(line), " %8s %8s %8s %8s", "vcsw", "ivcsw", "minflt", "majflt");
+      report += line;
+    }
+    report += "  command\n";
+    for (size_t i = 0; i < n_commands; ++i) {
+      const StageTiming& stage = stages[i];
+      const rusage& u = stage.usage;
+      string pipe = i < relays.size() ? format_size(relays[i].bytes) : "-";
+      snprintf(line, sizeof(line), "%-6zu %8.3fs %8.3fs %8.3fs %8s %8s", i + 1, stage.wall, seconds(u.ru_utime),
+               seconds(u.ru_stime), format_size(u.ru_maxrss * 1024.0).c_str(), pipe.c_str());
+      report += line;
+      if (verbose) {
+        snprintf(line, sizeof(line), " %8ld %8ld %8ld %8ld", u.ru_nvcsw, u.ru_nivcsw, u.ru_minflt, u.ru_majflt);
+        report += line;
+      }
+      report += "  " + (stage.started ? describe_pipeline({commands[i]}, "", "") : "(not started)") + "\n";
+    }
+    snprintf(line, sizeof(line), "real %.3fs  user %.3fs  sys %.3fs\n", wall, seconds(total.ru_utime),
+             seconds(total.ru_stime));
+    report += line;
+  }
+  write_all(shell_io.err, report);
+  return stages.back().started ? exit_status(stages.back().status) : 127;
+}
+
+// Parses a list like "0-3,8" (CPUs or NUMA nodes) and calls `add` for each
+// number in it. Returns false if it is malformed.
+template <typename Add>
+bool parse_number_list(const string& text, Add add) {
+  for (const string& range : split_string(text, ',')) {
+    char* end;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+    if (*end != '\0' || end == range.c_str() || first < 0 || last < first) {
+      return false;
+    }
+    for (long n = first; n <= last; ++n) {
+      if (!add(n)) return false;
+    }
+  }
+  return true;
+}
+
+bool parse_cpu_list(const string& text, cpu_set_t& cpus) {
+  CPU_ZERO(&cpus);
+  bool ok = parse_number_list(text, [&](long cpu) {
+    if (cpu >= CPU_SETSIZE) return false;
+    CPU_SET(cpu, &cpus);
+    return true;
+  });
+  return ok && CPU_COUNT(&cpus) > 0;
+}
+
+string cpu_list(const cpu_set_t& cpus) {
+  string list;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) list += (list.empty() ? "" : ",") + to_string(cpu);
+  }
+  return list;
+}
+
+// First line of a sysfs file, or "" if it cannot be read.
+string read_sysfs(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return "";
+  char buffer[4096];
+  ssize_t n = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  string text(buffer, n > 0 ? n : 0);
+  return text.substr(0, text.find('\n'));
+}
+
+// The CPUs this shell may run on, grouped into L3 cache domains and within a
+// domain into cores (the SMT siblings of a core share a set), both in the
+// order of their lowest CPU. Read from /sys/devices/system/cpu; CPUs without
+// that information form a domain of their own.
+vector<vector<cpu_set_t>> cpu_domains() {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    CPU_ZERO(&allowed);
+  }
+  vector<string> domain_keys;
+  vector<vector<cpu_set_t>> domains;
+  vector<vector<string>> core_keys;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    string base = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+    string l3;
+    for (int index = 0; index < 8 && l3.empty(); ++index) {
+      string cache = base + "/cache/index" + to_string(index);
+      if (read_sysfs(cache + "/level") == "3") l3 = read_sysfs(cache + "/shared_cpu_list");
+    }
+    string core = read_sysfs(base + "/topology/thread_siblings_list");
+    if (core.empty()) core = to_string(cpu);
+
+    size_t d = find(domain_keys.begin(), domain_keys.end(), l3) - domain_keys.begin();
+    if (d == domain_keys.size()) {
+      domain_keys.push_back(l3);
+      domains.emplace_back();
+      core_keys.emplace_back();
+    }
+    size_t c = find(core_keys[d].begin(), core_keys[d].end(), core) - core_keys[d].begin();
+    if (c == core_keys[d].size()) {
+      core_keys[d].push_back(core);
+      domains[d].emplace_back();
+      CPU_ZERO(&domains[d].back());
+    }
+    CPU_SET(cpu, &domains[d][c]);
+  }
+  return domains;
+}
+
+// Resource names for `pin -l`.
+const unordered_map<string, int> rlimit_names = {
+  {"as", RLIMIT_AS}, {"core", RLIMIT_CORE}, {"cpu", RLIMIT_CPU}, {"data", RLIMIT_DATA},
+  {"fsize", RLIMIT_FSIZE}, {"memlock", RLIMIT_MEMLOCK}, {"nofile", RLIMIT_NOFILE},
+  {"nproc", RLIMIT_NPROC}, {"stack", RLIMIT_STACK},
+};
+
+// Parses `resource=value` for `pin -l`; the value may end in K, M or G, or be
+// "unlimited". Sets both the soft and the hard limit.
+bool parse_limit(const string& spec, pair<int, rlimit>& limit) {
+  size_t equals = spec.find('=');
+  auto name = rlimit_names.find(spec.substr(0, equals));
+  if (equals == string::npos || name == rlimit_names.end()) {
+    return false;
+  }
+  string value = spec.substr(equals + 1);
+  rlim_t n = RLIM_INFINITY;
+  if (value != "unlimited") {
+    char* end;
+    n = strtoull(value.c_str(), &end, 10);
+    if (end == value.c_str()) return false;
+    for (char unit : string("KMG")) {
+      if (*end == unit) {
+        n <<= 10 * (string("KMG").find(unit) + 1);
+        end++;
+        break;
+      }
+    }
+    if (*end != '\0') return false;
+  }
+  limit = {name->second, {n, n}};
+  return true;
+}
+
+// `pin [-v] [-a] [-c cpus[:cpus...]] [-m nodes[:nodes...]] [-i nodes[:nodes...]]
+// [-l resource=value]... pipeline` runs a pipeline with its stages placed:
+//  -c  CPU affinity (sched_setaffinity); with a `:` separated list, stage k
+//      gets the k-th entry (the last one repeats).
+//  -a  automatic: the stages go to adjacent cores (with their SMT siblings) of
+//      the L3 cache domain with the most cores, so pipe data stays in one L3.
+//  -m  memory only from these NUMA nodes (MPOL_BIND), per stage like -c.
+//  -i  memory interleaved over these nodes (MPOL_INTERLEAVE).
+//  -l  a resource limit for every stage (nofile, as, cpu, core, data, fsize,
+//      memlock, nproc, stack).
+//  -v  print the placement of each stage to standard error.
+// The settings are applied in each child before exec; builtins run in a
+// forked child as well, so they are placed too.
+int pin_pipeline(Expression& expression, JobTable& jobs, int in_fd) {
+  vector<string>& first = expression.commands[0].parts;
+  size_t n_commands = expression.commands.size();
+  vector<Placement> placement(n_commands);
+  bool verbose = false, automatic = false;
+  vector<pair<int, rlimit>> limits;
+
+  auto usage = [&] {
+    shell_err << "usage: pin [-v] [-a] [-c cpus[:cpus...]] [-m|-i nodes[:nodes...]] [-l resource=value]... pipeline" << endl;
+    return 2;
+  };
+  size_t skip = 1;
+  for (; skip < first.size() && is_option(first[skip]); ++skip) {
+    const string& option = first[skip];
+    if (option == "-v") {
+      verbose = true;
+      continue;
+    } else if (option == "-a") {
+      automatic = true;
+      continue;
+    }
+    if (skip + 1 == first.size() || option.size() != 2 || !strchr("cmil", option[1])) {
+      return usage();
+    }
+    const string& value = first[++skip];
+    if (option == "-l") {
+      pair<int, rlimit> limit;
+      if (!parse_limit(value, limit)) {
+        shell_err << "pin: " << value << ": bad limit" << endl;
+        return 2;
+      }
+      limits.push_back(limit);
+      continue;
+    }
+    vector<string> lists = split_string(value, ':');
+    for (size_t i = 0; i < n_commands && !lists.empty(); ++i) {
+      const string& list = lists[min(i, lists.size() - 1)];
+      Placement& stage = placement[i];
+      bool ok;
+      if (option == "-c") {
+        ok = stage.has_cpus = parse_cpu_list(list, stage.cpus);
+      } else {
+        stage.mempolicy = option == "-m" ? MPOL_BIND : MPOL_INTERLEAVE;
+        stage.nodes.clear();
+        ok = parse_number_list(list, [&](long node) {
+          if (node >= 1024) return false;
+          stage.nodes.resize(max(stage.nodes.size(), size_t(node / 64 + 1)));
+          stage.nodes[node / 64] |= 1UL << (node % 64);
+          return true;
+        });
+      }
+      if (!ok) {
+        shell_err << "pin: " << list << ": bad list" << endl;
+        return 2;
+      }
+    }
+  }
+  first.erase(first.begin(), first.begin() + skip);
+  if (first.empty()) {
+    return usage();
+  }
+
+  if (automatic) {
+    vector<vector<cpu_set_t>> domains = cpu_domains();
+    auto largest = max_element(domains.begin(), domains.end(),
+                               [](const auto& a, const auto& b) { return a.size() < b.size(); });
+    for (size_t i = 0; i < n_commands && largest != domains.end(); ++i) {
+      placement[i].has_cpus = true;
+      placement[i].cpus = (*largest)[i % largest->size()];
+    }
+  }
+  for (Placement& stage : placement) {
+    stage.limits = limits;
+  }
+
+  if (verbose) {
+    for (size_t i = 0; i < n_commands; ++i) {
+      const Placement& stage = placement[i];
+      shell_err << "pin: " << i + 1 << " " << describe_pipeline({expression.commands[i]}, "", "")
+                << ": cpus " << (stage.has_cpus ? cpu_list(stage.cpus) : "any");
+      if (stage.mempolicy != -1) {
+        shell_err << (stage.mempolicy == MPOL_BIND ? ", memory bound" : ", memory interleaved");
+      }
+      shell_err << endl;
+    }
+  }
+
+  LaunchOptions options;
+  options.background = expression.background;
+  options.in_fd = in_fd;
+  options.in_shell = false;
+  options.placement = &placement;
+  return run_pipeline(expression.commands, jobs, expression.inputFromFile, expression.outputToFile, options);
+}
+
+// Parses comma-separated I/O hints: sequential, willneed, readahead=size,
+// noatime, dontneed, throttle=size, allocate[=size], or none. Returns false
+// if one is unknown.
+bool parse_io_hints(const string& text, IoPolicy& policy) {
+  policy = {};
+  for (const string& hint : split_string(text, ',')) {
+    size_t equals = hint.find('=');
+    string name = hint.substr(0, equals);
+    uint64_t size = 0;
+    bool sized = equals != string::npos;
+    if (sized && !parse_size(hint.c_str() + equals + 1, size)) {
+      return false;
+    }
+    if (name == "sequential" && !sized) {
+      policy.sequential = true;
+    } else if (name == "willneed" && !sized) {
+      policy.willneed = true;
+    } else if (name == "readahead" && sized) {
+      policy.readahead = size;
+    } else if (name == "noatime" && !sized) {
+      policy.noatime = true;
+    } else if (name == "dontneed" && !sized) {
+      policy.dontneed = true;
+    } else if (name == "throttle" && sized) {
+      policy.throttle = size;
+    } else if (name == "allocate") {
+      policy.allocate = size;
+      policy.allocate_input = !sized;
+    } else if (name != "none" || sized) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Puts back the hints of BSHELL_IO after a command line that `io` changed
+// them for.
+struct IoPolicyScope {
+  IoPolicy input = io_input_policy, output = io_output_policy;
+  ~IoPolicyScope() {
+    io_input_policy = input;
+    io_output_policy = output;
+  }
+};
+
+// `io [-i hints] [-o hints] pipeline`: sets the hints for the input file and
+// the output files of the pipeline (see parse_io_hints) and removes the
+// prefix. Returns 0, or 2 after printing the usage.
+int io_prefix(Expression& expression) {
+  vector<string>& first = expression.commands[0].parts;
+  size_t skip = 1;
+  for (; skip + 1 < first.size() && (first[skip] == "-i" || first[skip] == "-o"); skip += 2) {
+    if (!parse_io_hints(first[skip + 1], first[skip] == "-i" ? io_input_policy : io_output_policy)) {
+      shell_err << "io: " << first[skip + 1] << ": bad hints" << endl;
+      return 2;
+    }
+  }
+  if (skip == 1 || skip == first.size()) {
+    shell_err << "usage: io [-i hints] [-o hints] pipeline" << endl;
+    return 2;
+  }
+  first.erase(first.begin(), first.begin() + skip);
+  return 0;
+}
+
+int read_script(int fd, string& script);
+
+// Results of `cache` pipelines, in a directory: per key, the output of a run
+// that succeeded in `<hash>.out` and the key itself in `<hash>.key`. The
+// modification time of an output is the time it was last used; the least
+// recently used ones are removed when the outputs grow beyond the limit. The
+// counters in `stats` are shared by all shells that use the directory.
+struct CacheCounters {
+  atomic<uint64_t> hits, misses, uncached, evictions;
+};
+
+struct ResultCache {
+  string dir;
+  int dir_fd = -1;
+  CacheCounters* counters = nullptr;
+  uint64_t limit = 0; // Bytes of outputs.
+};
+
+ResultCache result_cache;
+
+// mkdir -p.
+bool make_directories(const string& path) {
+  for (size_t slash = path.find('/', 1);; slash = path.find('/', slash + 1)) {
+    if (mkdir(path.substr(0, slash).c_str(), 0700) == -1 && errno != EEXIST) {
+      return false;
+    }
+    if (slash == string::npos) {
+      return true;
+    }
+  }
+}
+
+// Opens the cache directory: $BSHELL_CACHE_DIR, else bshell in $XDG_CACHE_HOME
+// or ~/.cache. The limit is $BSHELL_CACHE_SIZE (bytes, or with a K, M or G
+// suffix), 1G by default.
+bool open_result_cache() {
+  string dir;
+  const char* value;
+  if ((value = getenv("BSHELL_CACHE_DIR")) && *value) {
+    dir = value;
+  } else if ((value = getenv("XDG_CACHE_HOME")) && *value) {
+    dir = string(value) + "/bshell";
+  } else if ((value = getenv("HOME")) && *value) {
+    dir = string(value) + "/.cache/bshell";
+  } else {
+    shell_err << "cache: no cache directory, set BSHELL_CACHE_DIR" << endl;
+    return false;
+  }
+
+  result_cache.limit = uint64_t(1) << 30;
+  if ((value = getenv("BSHELL_CACHE_SIZE")) && *value && !parse_size(value, result_cache.limit)) {
+    result_cache.limit = uint64_t(1) << 30;
+  }
+  // The directory stays open, unless it was removed in the meantime.
+  struct stat st;
+  if (dir == result_cache.dir && result_cache.dir_fd != -1 && fstat(result_cache.dir_fd, &st) == 0 &&
+      st.st_nlink > 0) {
+    return true;
+  }
+
+  if (result_cache.dir_fd != -1) {
+    close(result_cache.dir_fd);
+    munmap(result_cache.counters, sizeof(CacheCounters));
+    result_cache.dir_fd = -1;
+    result_cache.counters = nullptr;
+  }
+  int fd = -1, stats = -1;
+  void* counters = MAP_FAILED;
+  if (make_directories(dir) && (fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1 &&
+      (stats = openat(fd, "stats", O_RDWR | O_CREAT | O_CLOEXEC, 0600)) != -1 &&
+      ftruncate(stats, sizeof(CacheCounters)) == 0) {
+    counters = mmap(nullptr, sizeof(CacheCounters), PROT_READ | PROT_WRITE, MAP_SHARED, stats, 0);
+  }
+  if (counters == MAP_FAILED) {
+    print_error("cache: " + dir);
+    if (fd != -1) close(fd);
+    if (stats != -1) close(stats);
+    return false;
+  }
+  close(stats);
+  result_cache.dir = dir;
+  result_cache.dir_fd = fd;
+  result_cache.counters = static_cast<CacheCounters*>(counters);
+  return true;
+}
+
+// 128 bits of a hash of `data`, in hex. Not a cryptographic one: it tells
+// versions of an input apart, not inputs made to collide.
+string hash_hex(string_view data) {
+  uint64_t a = 0x9e3779b97f4a7c15 ^ data.size(), b = 0xc2b2ae3d27d4eb4f ^ data.size();
+  auto mix = [&](uint64_t word) {
+    a = (a ^ word) * 0xff51afd7ed558ccd;
+    a ^= a >> 29;
+    b = (b + word) * 0xc4ceb9fe1a85ec53;
+    b ^= b >> 32;
+  };
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, data.data() + i, 8);
+    mix(word);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data.data() + i, data.size() - i);
+  mix(tail);
+  mix(a ^ (b >> 17));
+  char buffer[33];
+  snprintf(buffer, sizeof(buffer), "%016llx%016llx", (unsigned long long)a, (unsigned long long)b);
+  return buffer;
+}
+
+// Appends what identifies the regular file at `path` to `key`: its device,
+// inode, size and modification time, or with `contents` a hash of its bytes.
+// Returns false if it is not a regular file.
+bool append_file_identity(const string& path, bool contents, string& key) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  if (!contents) {
+    key += to_string(st.st_dev) + ":" + to_string(st.st_ino) + ":" + to_string(st.st_size) + ":" +
+           to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec);
+    return true;
+  }
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  void* data = st.st_size ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  key += hash_hex(string_view(static_cast<const char*>(data), st.st_size));
+  if (data) {
+    munmap(data, st.st_size);
+  }
+  return true;
+}
+
+// The key of a cached pipeline: its commands as parsed and expanded, the files
+// they execute, its input file or document, the regular files among the
+// arguments, the working directory, and the locale and time zone. Returns
+// false for a pipeline that is not cached: with other redirections than a
+// single `> file`, with builtins that change the shell, with an argument that
+// names something else than a regular file (a directory, a device), or
+// without an input of its own (`<`, a heredoc or a here-string), since its
+// first command could read the standard input it inherits (or `in_fd`).
+bool cache_key(const Expression& expression, bool contents, int in_fd, string& key) {
+  if (!expression.inputInline && (in_fd != -1 || empty_or_whitespace(expression.inputFromFile))) {
+    return false;
+  }
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    return false;
+  }
+  key = string("cwd ") + cwd + "\n";
+  for (char** var = environ; *var; ++var) {
+    if (strncmp(*var, "LANG=", 5) == 0 || strncmp(*var, "LC_", 3) == 0 || strncmp(*var, "TZ=", 3) == 0) {
+      key += string("env ") + *var + "\n";
+    }
+  }
+
+  validate_path_cache();
+  for (const Command& command : expression.commands) {
+    const Builtin* builtin = find_builtin(command);
+    if (!command.redirections.empty() || command.parts.empty() || (builtin && builtin->changes_shell)) {
+      return false;
+    }
+    key += "cmd";
+    for (const string& part : command.parts) {
+      key += " " + to_string(part.size()) + ":" + part;
+    }
+    key += "\nbin ";
+    Resolution resolved;
+    if (builtin) {
+      key += "builtin";
+    } else if ((resolved = resolve_command(command.parts[0])).error == 0) {
+      key += resolved.path + " ";
+      append_file_identity(resolved.path, false, key);
+    } else {
+      key += "missing";
+    }
+    key += "\n";
+    for (size_t k = 1; k < command.parts.size(); ++k) {
+      struct stat st;
+      if (stat(command.parts[k].c_str(), &st) == -1) {
+        continue; // Not a path.
+      }
+      key += "arg " + to_string(k) + " ";
+      if (!append_file_identity(command.parts[k], contents, key)) {
+        return false;
+      }
+      key += "\n";
+    }
+  }
+
+  if (expression.inputInline) {
+    key += "document " + to_string(expression.inputDocument.size()) + ":" + expression.inputDocument + "\n";
+  } else {
+    key += "in ";
+    if (!append_file_identity(expression.inputFromFile, contents, key)) {
+      return false;
+    }
+    key += "\n";
+  }
+  return true;
+}
+
+// Lists the cache directory from the start (a dup of the directory fd shares
+// its position with the earlier listings). Close it with closedir.
+DIR* open_cache_listing() {
+  DIR* d = fdopendir(dup(result_cache.dir_fd));
+  if (d) {
+    rewinddir(d);
+  }
+  return d;
+}
+
+// Copies the output of a cache entry to `out`: a clone of the file (a reflink)
+// where the file system supports it, else a copy in the kernel.
+int replay_output(int entry, int out) {
+  if (ioctl(out, FICLONE, entry) == 0) {
+    return 0;
+  }
+  return copy_fd(entry, out);
+}
+
+// Removes the least recently used outputs until the cache fits its limit, and
+// temporary files of shells that did not finish storing an entry.
+void evict_cache_entries() {
+  DIR* d = open_cache_listing();
+  if (!d) {
+    return;
+  }
+  vector<pair<timespec, string>> outputs;
+  unordered_map<string, uint64_t> sizes;
+  uint64_t total = 0;
+  time_t stale = time(nullptr) - 3600;
+  while (dirent* entry = readdir(d)) {
+    string name = entry->d_name;
+    struct stat st;
+    if (fstatat(dirfd(d), entry->d_name, &st, 0) == -1) {
+      continue;
+    }
+    if (name.compare(0, 4, "tmp.") == 0 && st.st_mtime < stale) {
+      unlinkat(dirfd(d), entry->d_name, 0);
+    } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".out") == 0) {
+      outputs.push_back({st.st_mtim, name.substr(0, name.size() - 4)});
+      sizes[outputs.back().second] = st.st_size;
+      total += st.st_size;
+    }
+  }
+  if (total > result_cache.limit) {
+    sort(outputs.begin(), outputs.end(), [](const auto& a, const auto& b) {
+      return a.first.tv_sec != b.first.tv_sec ? a.first.tv_sec < b.first.tv_sec : a.first.tv_nsec < b.first.tv_nsec;
+    });
+    for (size_t i = 0; i < outputs.size() && total > result_cache.limit; ++i) {
+      unlinkat(dirfd(d), (outputs[i].second + ".out").c_str(), 0);
+      unlinkat(dirfd(d), (outputs[i].second + ".key").c_str(), 0);
+      total -= sizes[outputs[i].second];
+      result_cache.counters->evictions.fetch_add(1, memory_order_relaxed);
+    }
+  }
+  closedir(d);
+}
+
+// `cache -s`: the counters and the size of the cache.
+int print_cache_stats() {
+  uint64_t entries = 0, bytes = 0;
+  if (DIR* d = open_cache_listing()) {
+    while (dirent* entry = readdir(d)) {
+      size_t length = strlen(entry->d_name);
+      struct stat st;
+      if (length > 4 && strcmp(entry->d_name + length - 4, ".out") == 0 &&
+          fstatat(dirfd(d), entry->d_name, &st, 0) == 0) {
+        entries++;
+        bytes += st.st_size;
+      }
+    }
+    closedir(d);
+  }
+  const CacheCounters& counters = *result_cache.counters;
+  shell_out << "hits      " << counters.hits << "\n"
+            << "misses    " << counters.misses << "\n"
+            << "uncached  " << counters.uncached << "\n"
+            << "evictions " << counters.evictions << "\n"
+            << "entries   " << entries << "\n"
+            << "size      " << format_size(bytes) << " of " << format_size(result_cache.limit) << "\n"
+            << "directory " << result_cache.dir << endl;
+  return 0;
+}
+
+// `cache -c`: removes all entries and resets the counters.
+int clear_cache() {
+  DIR* d = open_cache_listing();
+  if (!d) {
+    print_error("cache");
+    return 1;
+  }
+  while (dirent* entry = readdir(d)) {
+    size_t length = strlen(entry->d_name);
+    if (length > 4 && (strcmp(entry->d_name + length - 4, ".out") == 0 ||
+                       strcmp(entry->d_name + length - 4, ".key") == 0)) {
+      unlinkat(dirfd(d), entry->d_name, 0);
+    }
+  }
+  closedir(d);
+  for (auto* counter : {&result_cache.counters->hits, &result_cache.counters->misses,
+                        &result_cache.counters->uncached, &result_cache.counters->evictions}) {
+    counter->store(0);
+  }
+  return 0;
+}
+
+// `cache [-v] [-h] pipeline`: replays the output of an earlier successful run
+// of the pipeline with the same key (see cache_key) instead of running it. -h
+// identifies input files by a hash of their contents instead of their inode
+// and modification time, -v reports hits and misses on standard error. Only
+// the standard output of the last command (or its `> file`) is kept, and the
+// exit status of a replayed run is 0. On a miss the output shows once the
+// pipeline has finished. A pipeline that could read the standard input of
+// the shell is not cached: give it its input with `<`, `<<` or `<<<`.
+// `cache -s` prints the statistics, `cache -c` empties the cache.
+int cache_pipeline(Expression& expression, JobTable& jobs, int in_fd) {
+  vector<string>& first = expression.commands[0].parts;
+  auto usage = [] {
+    shell_err << "usage: cache [-v] [-h] pipeline | cache -s | cache -c" << endl;
+    return 2;
+  };
+  if (first.size() == 2 && (first[1] == "-s" || first[1] == "-c") && expression.commands.size() == 1) {
+    if (!open_result_cache()) {
+      return 1;
+    }
+    return first[1] == "-s" ? print_cache_stats() : clear_cache();
+  }
+  bool verbose = false, contents = false;
+  size_t skip = 1;
+  for (; skip < first.size() && is_option(first[skip]); ++skip) {
+    if (first[skip] == "-v") {
+      verbose = true;
+    } else if (first[skip] == "-h") {
+      contents = true;
+    } else {
+      return usage();
+    }
+  }
+  first.erase(first.begin(), first.begin() + skip);
+  if (first.empty()) {
+    return usage();
+  }
+
+  LaunchOptions options;
+  options.background = expression.background;
+  options.in_fd = in_fd;
+  string key;
+  if (expression.background || !open_result_cache() || !cache_key(expression, contents, in_fd, key)) {
+    if (result_cache.counters) {
+      result_cache.counters->uncached.fetch_add(1, memory_order_relaxed);
+    }
+    if (verbose) {
+      shell_err << "cache: not cached" << endl;
+    }
+    return run_pipeline(expression.commands, jobs, expression.inputFromFile, expression.outputToFile, options);
+  }
+  string name = hash_hex(key);
+  CacheCounters& counters = *result_cache.counters;
+  bool to_file = !empty_or_whitespace(expression.outputToFile);
+
+  // A hit: the key is stored next to the output, so a hash collision is a miss.
+  int entry = openat(result_cache.dir_fd, (name + ".out").c_str(), O_RDONLY | O_CLOEXEC);
+  int stored_key = openat(result_cache.dir_fd, (name + ".key").c_str(), O_RDONLY | O_CLOEXEC);
+  string stored;
+  if (entry != -1 && stored_key != -1) {
+    read_script(stored_key, stored);
+  }
+  if (stored_key != -1) {
+    close(stored_key);
+  }
+  if (entry != -1 && stored == key) {
+    futimens(entry, nullptr); // Used now, for the LRU order.
+    int out = to_file ? open(expression.outputToFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                      : shell_io.out;
+    int error = out == -1 ? errno : replay_output(entry, out);
+    close(entry);
+    if (to_file && out != -1) {
+      close(out);
+    }
+    if (error) {
+      errno = error;
+      print_error("cache: " + (to_file ? expression.outputToFile : string("output")));
+      return 1;
+    }
+    counters.hits.fetch_add(1, memory_order_relaxed);
+    if (verbose) {
+      shell_err << "cache: hit " << name << endl;
+    }
+    return 0;
+  }
+  if (entry != -1) {
+    close(entry);
+  }
+
+  // A miss: the output is collected in a temporary file that becomes the
+  // entry if the pipeline succeeds.
+  counters.misses.fetch_add(1, memory_order_relaxed);
+  if (verbose) {
+    shell_err << "cache: miss " << name << endl;
+  }
+  string temp = "tmp." + to_string(getpid()) + "." + name;
+  int output = openat(result_cache.dir_fd, temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (output == -1) {
+    print_error("cache: " + temp);
+    return run_pipeline(expression.commands, jobs, expression.inputFromFile, expression.outputToFile, options);
+  }
+  if (!to_file) {
+    options.out_fd = output;
+  }
+  int status = run_pipeline(expression.commands, jobs, expression.inputFromFile, expression.outputToFile, options);
+
+  int error = 0;
+  if (!to_file) {
+    lseek(output, 0, SEEK_SET);
+    error = copy_fd(output, shell_io.out);
+  } else if (status == 0) {
+    int file = open(expression.outputToFile.c_str(), O_RDONLY | O_CLOEXEC);
+    error = file == -1 ? errno : replay_output(file, output);
+    if (file != -1) {
+      close(file);
+    }
+  }
+  close(output);
+  string key_temp = temp + ".key";
+  int key_file = -1;
+  bool stored_entry = status == 0 && error == 0 &&
+                      (key_file = openat(result_cache.dir_fd, key_temp.c_str(),
+                                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1 &&
+                      write_all(key_file, key) &&
+                      renameat(result_cache.dir_fd, temp.c_str(), result_cache.dir_fd, (name + ".out").c_str()) == 0 &&
+                      renameat(result_cache.dir_fd, key_temp.c_str(), result_cache.dir_fd, (name + ".key").c_str()) == 0;
+  if (key_file != -1) {
+    close(key_file);
+  }
+  if (stored_entry) {
+    evict_cache_entries();
+  } else {
+    unlinkat(result_cache.dir_fd, temp.c_str(), 0);
+    unlinkat(result_cache.dir_fd, key_temp.c_str(), 0);
+  }
+  if (error && !to_file) {
+    errno = error;
+    print_error("cache: output");
+  }
+  return status;
+}
+
+// Whether stage `command` copies its standard input to its standard output
+// unchanged: `cat`, `cat -`, `cat -u` or `tee` without arguments.
+bool is_identity_stage(const Command& command) {
+  const vector<string>& parts = command.parts;
+  if (!command.redirections.empty() || parts.empty()) {
+    return false;
+  }
+  if (parts[0] == "cat") {
+    return parts.size() == 1 || (parts.size() == 2 && (parts[1] == "-" || parts[1] == "-u"));
+  }
+  return parts[0] == "tee" && parts.size() == 1;
+}
+
+// Whether the stages from `first` on read all of their input before they
+// exit, so that a writer in front of them never sees a closed pipe. Filters
+// that write as they read (identity stages among them) drain their input if
+// they are last or the stages after them do; those that only write at the end
+// always do. A reader that may stop early (`head`, `grep -q`, ...) makes
+// dropping a stage in front of it visible: the stage that ends up writing to
+// it dies of SIGPIPE, or does not. So does a stage with operands (other than
+// the pattern of `grep`, the sets of `tr` and the outputs of `tee`), which
+// may be files that it reads instead of its input.
+bool drains_input(const vector<Command>& commands, size_t first) {
+  static const vector<string> streaming = {"cat", "tee", "tr", "uniq", "rev", "cut", "base64", "od"};
+  static const vector<string> buffering = {"wc", "sort", "tail", "tac", "md5sum", "sha1sum", "sha256sum"};
+  for (size_t i = first; i < commands.size(); ++i) {
+    const vector<string>& parts = commands[i].parts;
+    if (parts.empty()) {
+      return false;
+    }
+    bool options = any_of(parts.begin() + 1, parts.end(), [](const string& arg) { return is_option(arg); });
+    size_t operands = count_if(parts.begin() + 1, parts.end(), [](const string& arg) { return !is_option(arg); });
+    if (operands > (parts[0] == "grep" ? 1 : 0) && parts[0] != "tr" && parts[0] != "tee") {
+      return false;
+    }
+    if (find(buffering.begin(), buffering.end(), parts[0]) != buffering.end()) {
+      return true;
+    }
+    if (find(streaming.begin(), streaming.end(), parts[0]) == streaming.end() && (parts[0] != "grep" || options)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Rewrites a pipeline into one with the same output and exit status that
+// needs fewer processes and copies of the data. Only rewrites that keep the
+// semantics exactly are made:
+// - `/bin/cat` and friends (from /bin or /usr/bin) become the builtins, for
+//   arguments that the builtin handles the same way;
+// - identity stages are dropped at the start and between two stages (at the
+//   end they are kept: the stage before would write to a terminal instead of
+//   a pipe);
+// - a first stage `cat file` with a readable regular file becomes the input
+//   file of the next stage.
+// Stages are only dropped in front of readers that drain their input, so the
+// same stages die of SIGPIPE (and are reported) either way.
+// Adds a line per rewrite to `notes`, if given.
+void optimize_expression(Expression& expression, vector<string>* notes) {
+  vector<Command>& commands = expression.commands;
+  auto note = [&](const string& text) {
+    if (notes) notes->push_back(text);
+  };
+
+  for (Command& command : commands) {
+    if (command.parts.empty() || command.parts[0].rfind('/') == string::npos) {
+      continue;
+    }
+    string& name = command.parts[0];
+    size_t slash = name.rfind('/');
+    string dir = name.substr(0, slash), base = name.substr(slash + 1);
+    if (dir != "/bin" && dir != "/usr/bin") {
+      continue;
+    }
+    vector<string> args = command.parts;
+    args[0] = base;
+    bool options = any_of(args.begin() + 1, args.end(), [](const string& arg) { return arg.compare(0, 2, "--") == 0; });
+    bool same = ((base == "true" || base == "false" || base == "pwd") && args.size() == 1) ||
+                (base == "echo" && !options) || (base == "cat" && data_mover_handles(args));
+    if (same) {
+      note(name + ": the builtin " + base);
+      name = base;
+    }
+  }
+
+  bool has_input = expression.inputInline || !empty_or_whitespace(expression.inputFromFile);
+  while (commands.size() > 1) {
+    const Command& first = commands[0];
+    struct stat st;
+    if (!drains_input(commands, 1)) {
+      break;
+    }
+    if (is_identity_stage(first)) {
+      note(describe_pipeline({first}, "", "") + ": dropped, the next stage reads its input");
+    } else if (!has_input && first.redirections.empty() && first.parts.size() == 2 && first.parts[0] == "cat" &&
+               !is_option(first.parts[1]) && stat(first.parts[1].c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+               access(first.parts[1].c_str(), R_OK) == 0) {
+      note(describe_pipeline({first}, "", "") + ": the input file of the next stage");
+      expression.inputFromFile = first.parts[1];
+      has_input = true;
+    } else {
+      break;
+    }
+    commands.erase(commands.begin());
+  }
+  for (size_t i = 1; i + 1 < commands.size();) {
+    if (is_identity_stage(commands[i]) && drains_input(commands, i + 1)) {
+      note(describe_pipeline({commands[i]}, "", "") + ": dropped, it copies its input unchanged");
+      commands.erase(commands.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// `shell -n`: prints the pipeline as it would run, with the rewrites of the
+// optimizer, instead of running it.
+int explain_expression(Expression& expression) {
+  bool prefixed = !expression.commands[0].parts.empty() &&
+                  (expression.commands[0].parts[0] == "time" || expression.commands[0].parts[0] == "pin" ||
+                   expression.commands[0].parts[0] == "cache");
+  vector<string> notes;
+  if (optimize_pipelines && !prefixed) {
+    optimize_expression(expression, &notes);
+  }
+  string plan = describe_pipeline(expression.commands, expression.inputFromFile, expression.outputToFile);
+  if (expression.inputInline) {
+    plan += " <<< document";
+  }
+  if (expression.background) {
+    plan += " &";
+  }
+  shell_out << plan << "\n";
+  for (const string& text : notes) {
+    shell_out << "  # " << text << "\n";
+  }
+  shell_out << flush;
+  return 0;
+}
+
+// Runs a parsed command line. Returns its exit status.
+int execute_expression(Expression& expression, JobTable& jobs) {
+  // Check for empty expression
+  if (expression.commands.size() == 0) {
+    shell_err << strerror(EINVAL) << endl;
+    return EINVAL;
+  }
+
+  // Variables and patterns are expanded before anything runs.
+  if (!expand_expression(expression)) {
+    return 1;
+  }
+  // `io` changes the hints of the redirections for the rest of the line.
+  IoPolicyScope io_scope;
+  if (!expression.commands[0].parts.empty() && expression.commands[0].parts[0] == "io" && io_prefix(expression) != 0) {
+    return 2;
+  }
+  if (explain_pipelines) {
+    return explain_expression(expression);
+  }
+  
+  if (!expression.commands[0].parts.empty() && expression.commands[0].parts[0] == "time") {
+    return time_pipeline(expression, jobs);
+  }
+
+  // An inline document becomes a pipe or memfd for the first command.
+  int in_fd = -1;
+  if (expression.inputInline && (in_fd = open_document(expression.inputDocument)) == -1) {
+    return 1;
+  }
+
+  int status;
+  if (!expression.commands[0].parts.empty() && expression.commands[0].parts[0] == "pin") {
+    status = pin_pipeline(expression, jobs, in_fd);
+    if (in_fd != -1) close(in_fd);
+    return status;
+  }
+  if (!expression.commands[0].parts.empty() && expression.commands[0].parts[0] == "cache") {
+    status = cache_pipeline(expression, jobs, in_fd);
+    if (in_fd != -1) close(in_fd);
+    return status;
+  }
+
+  // Execute commands. Builtins (like `cd` and `exit`) run inside the shell where possible.
+  if (optimize_pipelines) {
+    optimize_expression(expression, nullptr);
+  }
+  status = execute_commands(expression.commands, jobs, expression.inputFromFile, expression.outputToFile, expression.background, in_fd);
+  if (in_fd != -1) close(in_fd);
+  return status;
+}
+
+// Names in a directory, sorted, with a '/' after those of subdirectories.
+struct DirListing {
+  timespec mtime = {0, 0};
+  vector<string> names;
+};
+
+// Lists directory `dir`, only the executable files if `executables` is set.
+// Returns false if it cannot be read.
+bool list_directory(const string& dir, bool executables, DirListing& listing) {
+  DIR* d = opendir(dir.empty() ? "." : dir.c_str());
+  if (!d) {
+    return false;
+  }
+  listing.names.clear();
+  while (dirent* entry = readdir(d)) {
+    string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+      struct stat st;
+      is_dir = fstatat(dirfd(d), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (executables) {
+      if (!is_dir && faccessat(dirfd(d), entry->d_name, X_OK, 0) == 0) {
+        listing.names.push_back(name);
+      }
+    } else {
+      listing.names.push_back(is_dir ? name + "/" : name);
+    }
+  }
+  closedir(d);
+  sort(listing.names.begin(), listing.names.end());
+  return true;
+}
+
+// Prefix tree of command names. The nodes live in one vector, and the
+// children of a node are sorted by their byte, so completions come out sorted.
+struct CommandTrie {
+  struct Node {
+    vector<pair<char, uint32_t>> children;
+    bool terminal = false;
+  };
+  vector<Node> nodes = vector<Node>(1);
+
+  void insert(string_view name) {
+    uint32_t node = 0;
+    for (char c : name) {
+      auto& children = nodes[node].children;
+      auto it = lower_bound(children.begin(), children.end(), pair<char, uint32_t>{c, 0});
+      if (it == children.end() || it->first != c) {
+        it = children.insert(it, {c, uint32_t(nodes.size())});
+        nodes.emplace_back(); // Invalidates `children`, not the value of `it->second`.
+      }
+      node = it->second;
+    }
+    nodes[node].terminal = true;
+  }
+
+  // Appends the names that start with `prefix` to `out`.
+  void complete(string_view prefix, vector<string>& out) const {
+    uint32_t node = 0;
+    for (char c : prefix) {
+      auto& children = nodes[node].children;
+      auto it = lower_bound(children.begin(), children.end(), pair<char, uint32_t>{c, 0});
+      if (it == children.end() || it->first != c) {
+        return;
+      }
+      node = it->second;
+    }
+    string name(prefix);
+    collect(node, name, out);
+  }
+
+  void collect(uint32_t node, string& name, vector<string>& out) const {
+    if (nodes[node].terminal) {
+      out.push_back(name);
+    }
+    for (auto [c, child] : nodes[node].children) {
+      name += c;
+      collect(child, name, out);
+      name.pop_back();
+    }
+  }
+};
+
+// Executables of $PATH for command completion. A background thread builds the
+// trie and rebuilds it when $PATH or the mtime of one of its directories
+// changes, so a slow (network) file system never holds up the prompt: until
+// the first build is done, only builtins are completed.
+struct CompletionIndex {
+  mutex lock;
+  int wake_fd = eventfd(0, EFD_CLOEXEC); // Written to make the thread check for changes.
+  string path_var; // $PATH to index. getenv is for the shell's thread only.
+  bool stop = false;
+  shared_ptr<const CommandTrie> trie; // Latest build.
+
+  ~CompletionIndex() {
+    if (wake_fd != -1) close(wake_fd);
+  }
+};
+
+// Makes the thread of `index` check $PATH again (or end, if `stop` is set).
+void wake_completion_index(CompletionIndex& index) {
+  signal_eventfd(index.wake_fd);
+}
+
+// Body of the thread that builds the trie. It owns the directory listings.
+void build_completion_index(shared_ptr<CompletionIndex> index) {
+  unordered_map<string, DirListing> listings;
+  string indexed_path;
+  while (true) {
+    uint64_t requests;
+    if (read(index->wake_fd, &requests, sizeof(requests)) == -1 && errno != EINTR) {
+      return;
+    }
+    unique_lock<mutex> guard(index->lock);
+    if (index->stop) {
+      return;
+    }
+    string path_var = index->path_var;
+    guard.unlock();
+
+    bool changed = path_var != indexed_path;
+    vector<string> dirs = split_string(path_var, ':');
+    for (const string& dir : dirs) {
+      timespec mtime = dir_mtime(dir);
+      auto it = listings.find(dir);
+      if (it == listings.end() || it->second.mtime.tv_sec != mtime.tv_sec || it->second.mtime.tv_nsec != mtime.tv_nsec) {
+        DirListing& listing = listings[dir];
+        listing.mtime = mtime;
+        if (!list_directory(dir, true, listing)) {
+          listing.names.clear();
+        }
+        changed = true;
+      }
+    }
+    if (!changed) {
+      continue;
+    }
+    for (auto it = listings.begin(); it != listings.end();) {
+      it = find(dirs.begin(), dirs.end(), it->first) == dirs.end() ? listings.erase(it) : next(it);
+    }
+
+    auto trie = make_shared<CommandTrie>();
+    for (const auto& [dir, listing] : listings) {
+      for (const string& name : listing.names) {
+        trie->insert(name);
+      }
+    }
+    indexed_path = path_var;
+    guard.lock();
+    index->trie = move(trie);
+  }
+}
+
+// Line editor of an interactive session.
+struct LineEditor {
+  int fd;
+  termios saved;  // Settings of the terminal while commands run.
+  string pending; // Input that is not handled yet, like a partial escape sequence.
+  shared_ptr<CompletionIndex> index = make_shared<CompletionIndex>();
+  unordered_map<string, DirListing> listings; // For file name completion, by directory.
+
+  explicit LineEditor(int fd) : fd(fd) {
+    // Detached: at exit the thread may still be in a slow readdir, and it
+    // only touches the index it shares.
+    if (index->wake_fd != -1) {
+      thread(build_completion_index, index).detach();
+    }
+  }
+  ~LineEditor() {
+    lock_guard<mutex> guard(index->lock);
+    index->stop = true;
+    wake_completion_index(*index);
+  }
+};
+
+// Listing of directory `dir` for file name completion, read again only when
+// the directory's mtime changed.
+const DirListing& cached_listing(LineEditor& editor, const string& dir) {
+  string key = dir;
+  if (dir.empty() || dir[0] != '/') {
+    char buffer[PATH_MAX];
+    key = string(getcwd(buffer, sizeof(buffer)) ? buffer : "") + "/" + dir;
+  }
+  timespec mtime = dir_mtime(key);
+  DirListing& listing = editor.listings[key];
+  if (listing.mtime.tv_sec != mtime.tv_sec || listing.mtime.tv_nsec != mtime.tv_nsec || mtime.tv_sec == 0) {
+    listing.mtime = mtime;
+    if (!list_directory(key, false, listing)) {
+      listing.names.clear();
+    }
+  }
+  return listing;
+}
+
+// Candidates for the word that ends at `cursor`: commands (builtins and the
+// executables of $PATH) for the first word of a command, file names for any
+// other. Returns where the word starts.
+size_t find_completions(LineEditor& editor, const string& line, size_t cursor, vector<string>& matches) {
+  size_t start = cursor;
+  while (start > 0 && !isspace(line[start - 1]) && !strchr("|<>&", line[start - 1])) {
+    start--;
+  }
+  string word = line.substr(start, cursor - start);
+  size_t before = line.find_last_not_of(" \t", start == 0 ? string::npos : start - 1);
+  bool command = (start == 0 || before == string::npos || line[before] == '|') && word.find('/') == string::npos;
+
+  matches.clear();
+  if (command) {
+    for (const auto& [name, builtin] : builtins) {
+      if (name.compare(0, word.size(), word) == 0) {
+        matches.push_back(name);
+      }
+    }
+    shared_ptr<const CommandTrie> trie;
+    {
+      lock_guard<mutex> guard(editor.index->lock);
+      trie = editor.index->trie;
+    }
+    if (trie) {
+      trie->complete(word, matches);
+    }
+    sort(matches.begin(), matches.end());
+    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+  } else {
+    size_t slash = word.rfind('/');
+    string dir = slash == string::npos ? "" : word.substr(0, slash + 1);
+    string base = word.substr(dir.size());
+    for (const string& name : cached_listing(editor, dir).names) {
+      if (name.compare(0, base.size(), base) == 0 && (name[0] != '.' || (!base.empty() && base[0] == '.'))) {
+        matches.push_back(dir + name);
+      }
+    }
+  }
+  return start;
+}
 
-    string commandLine = request_command_line(showPrompt);
+// Shows `text` as the line being edited, with the cursor at `cursor`.
+void redraw_line(const string& prompt, const string& text, size_t cursor) {
+  string output = "\r" + prompt + text + "\e[K";
+  if (cursor < text.size()) {
+    output += "\e[" + to_string(text.size() - cursor) + "D";
+  }
+  write_all(shell_io.out, output);
+}
 
-    bool parse_success = true;
-    Expression expression = parse_command_line(commandLine, parse_success);
-    if (!parse_success) continue; // Don't execute any bad inputs.
+// Completes the word before the cursor as far as all candidates agree, and
+// lists the candidates if that does not get any further.
+void complete_line(LineEditor& editor, string& line, size_t& cursor) {
+  vector<string> matches;
+  size_t start = find_completions(editor, line, cursor, matches);
+  if (matches.empty()) {
+    write_all(shell_io.out, "\a");
+    return;
+  }
+  size_t common = matches[0].size();
+  for (const string& match : matches) {
+    size_t i = 0;
+    while (i < common && i < match.size() && match[i] == matches[0][i]) i++;
+    common = i;
+  }
+  string completion = matches[0].substr(0, common);
+  if (matches.size() == 1 && completion.back() != '/') {
+    completion += ' ';
+  }
+  if (completion.size() > cursor - start) {
+    line.replace(start, cursor - start, completion);
+    cursor = start + completion.size();
+    return;
+  }
+  string list = "\r\n";
+  for (const string& match : matches) {
+    size_t slash = match.size() < 2 ? string::npos : match.find_last_of('/', match.size() - 2);
+    list += match.substr(slash == string::npos ? 0 : slash + 1) + "  ";
+  }
+  write_all(shell_io.out, list + "\r\n");
+}
 
-    execute_expression(expression, bg_pids);
+// Length of the escape sequence at the start of `keys`: 1 for a lone escape
+// (or Alt with a key), 0 if the sequence is not complete yet.
+size_t escape_length(const string& keys) {
+  if (keys.size() < 2) {
+    return 0;
+  }
+  if (keys[1] != '[' && keys[1] != 'O') {
+    return 1;
+  }
+  for (size_t i = 2; i < keys.size(); ++i) {
+    if (isalpha(keys[i]) || keys[i] == '~') {
+      return i + 1;
+    }
   }
   return 0;
 }
+
+// Reads a command line from the terminal, with editing: cursor movement
+// (arrows, Ctrl-A/E/B/F), deletion (Backspace, Delete, Ctrl-K/U/W), history
+// (Up/Down, and Ctrl-R for an incremental search), Tab completion, Ctrl-C to
+// drop the line and Ctrl-D on an empty line for the end of the input. Jobs
+// that finish meanwhile are reported, and the line is shown again below.
+// Returns false at the end of the input.
+bool edit_command_line(LineEditor& editor, JobTable& jobs, History& history, const string& prompt, string& line) {
+  termios raw;
+  if (tcgetattr(editor.fd, &editor.saved) == -1) {
+    return false;
+  }
+  raw = editor.saved;
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_iflag &= ~(ICRNL | IXON);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(editor.fd, TCSADRAIN, &raw);
+
+  // Check $PATH for changes in the background while the user types.
+  {
+    const char* path = getenv("PATH");
+    lock_guard<mutex> guard(editor.index->lock);
+    editor.index->path_var = path ? path : "/bin:/usr/bin";
+    wake_completion_index(*editor.index);
+  }
+
+  // The history is brought up to date when a key first needs it, not for
+  // every prompt.
+  size_t newest = 0;   // Entries at that point.
+  size_t browsing = 0; // History entry shown, or `newest` for the new line.
+  bool synced = false;
+  auto sync = [&] {
+    if (!synced) {
+      sync_history(history);
+      newest = browsing = history.entries.size();
+      synced = true;
+    }
+  };
+  string edited; // The new line while browsing.
+  bool searching = false;                   // Ctrl-R
+  string query;
+  long found = -1;
+
+  line.clear();
+  size_t cursor = 0;
+  bool done = false, more = true;
+  redraw_line(prompt, line, cursor);
+
+  auto show_search = [&] {
+    string text = "(reverse-i-search)`" + query + "': " + string(found == -1 ? "" : history_entry(history, found));
+    redraw_line("", text, text.size());
+  };
+  auto search = [&](size_t before) {
+    long id = search_history(history, query, false, before);
+    if (id != -1 || query.empty()) found = id;
+  };
+
+  while (!done) {
+    if (editor.pending.empty()) {
+      // The epoll set is level-triggered: look at what is ready first, so the
+      // line can make room for a job report.
+      bool input_ready = jobs.input_fd != editor.fd;
+      while (!input_ready) {
+        epoll_event event;
+        if (epoll_wait(jobs.epoll_fd, &event, 1, -1) != 1) {
+          continue;
+        }
+        if (event.data.u64 == EVENT_INPUT) {
+          input_ready = true;
+        } else if (is_output_event(event.data.u64)) {
+          drain_output_event(jobs, event.data.u64); // Captured output leaves the line alone.
+        } else {
+          write_all(shell_io.out, "\r\e[K");
+          handle_job_events(jobs, 0, input_ready);
+          searching ? show_search() : redraw_line(prompt, line, cursor);
+        }
+      }
+      char buffer[256];
+      ssize_t n = read(editor.fd, buffer, sizeof(buffer));
+      if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+        more = false;
+        break;
+      }
+      editor.pending.append(buffer, n > 0 ? n : 0);
+      continue;
+    }
+
+    // An escape sequence (\e[X, \eOX or \e[n~) may arrive in pieces.
+    string key(1, editor.pending[0]);
+    if (key[0] == '\e') {
+      size_t length = escape_length(editor.pending);
+      if (length == 0) {
+        pollfd more_input = {editor.fd, POLLIN, 0};
+        char buffer[256];
+        ssize_t n = poll(&more_input, 1, 50) == 1 ? read(editor.fd, buffer, sizeof(buffer)) : 0;
+        if (n > 0) {
+          editor.pending.append(buffer, n);
+          continue;
+        }
+        length = editor.pending.size(); // A lone escape or a cut off sequence: ignored below.
+      }
+      key = editor.pending.substr(0, length);
+    }
+    editor.pending.erase(0, key.size());
+
+    if (searching) {
+      unsigned char c = key[0];
+      if (key == "\x12") {
+        search(found == -1 ? 0 : found);
+      } else if (key == "\x7f" || key == "\b") {
+        if (!query.empty()) query.pop_back();
+        search(newest);
+      } else if (key.size() == 1 && c >= 0x20) {
+        query += key;
+        search(found == -1 ? newest : found + 1);
+      } else if (key == "\x03" || key == "\x07") {
+        searching = false;
+        redraw_line(prompt, line, cursor);
+      } else {
+        // Any other key takes the match and is handled as usual.
+        searching = false;
+        if (found != -1) {
+          line = history_entry(history, found);
+          cursor = line.size();
+        }
+        editor.pending.insert(0, key);
+        redraw_line(prompt, line, cursor);
+      }
+      if (searching) {
+        show_search();
+      }
+      continue;
+    }
+
+    if (key == "\r" || key == "\n") {
+      done = true;
+    } else if (key == "\x04") {
+      if (line.empty()) {
+        more = false;
+        break;
+      }
+      if (cursor < line.size()) line.erase(cursor, 1);
+    } else if (key == "\x7f" || key == "\b") {
+      if (cursor > 0) line.erase(--cursor, 1);
+    } else if (key == "\e[3~") {
+      if (cursor < line.size()) line.erase(cursor, 1);
+    } else if (key == "\x01" || key == "\e[H" || key == "\eOH") {
+      cursor = 0;
+    } else if (key == "\x05" || key == "\e[F" || key == "\eOF") {
+      cursor = line.size();
+    } else if (key == "\x02" || key == "\e[D" || key == "\eOD") {
+      if (cursor > 0) cursor--;
+    } else if (key == "\x06" || key == "\e[C" || key == "\eOC") {
+      if (cursor < line.size()) cursor++;
+    } else if (key == "\x0b") {
+      line.erase(cursor);
+    } else if (key == "\x15") {
+      line.erase(0, cursor);
+      cursor = 0;
+    } else if (key == "\x17") {
+      size_t start = line.find_last_not_of(' ', cursor == 0 ? 0 : cursor - 1);
+      start = start == string::npos ? 0 : line.find_last_of(' ', start);
+      start = start == string::npos ? 0 : start + 1;
+      line.erase(start, cursor - start);
+      cursor = start;
+    } else if (key == "\x0c") {
+      write_all(shell_io.out, "\e[H\e[2J");
+    } else if (key == "\x03") {
+      write_all(shell_io.out, "^C\r\n");
+      line.clear();
+      cursor = 0;
+      browsing = newest;
+    } else if (key == "\e[A" || key == "\eOA" || key == "\e[B" || key == "\eOB") {
+      sync();
+      bool up = key.back() == 'A';
+      if (up ? browsing == 0 : browsing == newest) {
+        continue;
+      }
+      if (browsing == newest) {
+        edited = line;
+      }
+      browsing += up ? -1 : 1;
+      line = browsing == newest ? edited : string(history_entry(history, browsing));
+      cursor = line.size();
+    } else if (key == "\x12") {
+      sync();
+      searching = true;
+      query.clear();
+      found = -1;
+      show_search();
+      continue;
+    } else if (key == "\t") {
+      complete_line(editor, line, cursor);
+    } else if (key.size() == 1 && (unsigned char)key[0] >= 0x20) {
+      line.insert(cursor++, key);
+    }
+    redraw_line(prompt, line, cursor);
+  }
+
+  write_all(shell_io.out, "\r\n");
+  tcsetattr(editor.fd, TCSADRAIN, &editor.saved);
+  return more || done;
+}
+
+// Applies the settings that can be changed through environment variables.
+void read_environment_settings() {
+  // Runtime override of the launch backend chosen at build time.
+  const char* launch = getenv("BSHELL_LAUNCH");
+  if (launch && strcmp(launch, "fork") == 0) {
+    launch_backend = LaunchBackend::Fork;
+  } else if (launch && strcmp(launch, "spawn") == 0) {
+    launch_backend = LaunchBackend::Spawn;
+  }
+  const char* movers = getenv("BSHELL_MOVERS");
+  if (movers && strcmp(movers, "0") == 0) {
+    use_data_movers = false;
+  }
+  // Background jobs write into ring buffers instead of the terminal.
+  const char* job_output = getenv("BSHELL_JOB_OUTPUT");
+  uint64_t size;
+  if (job_output && parse_size(job_output, size)) {
+    job_output_size = size;
+  }
+  const char* spill = getenv("BSHELL_JOB_SPILL");
+  if (spill && *spill) {
+    job_spill_dir = spill;
+  }
+  // Hints for the files of all redirections.
+  const char* io = getenv("BSHELL_IO");
+  IoPolicy policy;
+  if (io && parse_io_hints(io, policy)) {
+    io_input_policy = io_output_policy = policy;
+  }
+  const char* optimize = getenv("BSHELL_OPTIMIZE");
+  if (optimize && strcmp(optimize, "0") == 0) {
+    optimize_pipelines = false;
+  }
+  // Tracing from the start; the trace is written to the file when the shell ends.
+  const char* trace = getenv("BSHELL_TRACE");
+  if (trace && *trace && (tracing || start_tracing())) {
+    trace_file = trace;
+  }
+}
+
+// Reads everything from `fd` into `script` with large read(2) calls. Returns 0
+// or an errno.
+int read_script(int fd, string& script) {
+  const size_t chunk = 1 << 20;
+  while (true) {
+    size_t used = script.size();
+    script.resize(used + chunk);
+    ssize_t n = read(fd, &script[used], chunk);
+    script.resize(used + (n > 0 ? n : 0));
+    if (n == 0) return 0;
+    if (n < 0 && errno != EINTR) return errno;
+  }
+}
+
+// A line of a script, parsed up front.
+struct ScriptLine {
+  size_t number;
+  Expression expression;
+};
+
+// Makes `session` the running session until the end of the scope.
+struct ActiveSession {
+  SessionIO previous_io;
+  History* previous_history;
+  PathCache* previous_path_cache;
+
+  explicit ActiveSession(Session& session)
+      : previous_io(shell_io), previous_history(active_history), previous_path_cache(active_path_cache) {
+    shell_io = session.io;
+    active_history = &session.history;
+    active_path_cache = &session.path_cache;
+  }
+  ~ActiveSession() {
+    shell_io = previous_io;
+    active_history = previous_history;
+    active_path_cache = previous_path_cache;
+  }
+};
+
+// Records `result`, the status of a line, in the session. An `exit` in it
+// ends the session.
+int finish_line(Session& session, int result) {
+  if (result & EXIT_REQUESTED) {
+    session.exited = true;
+    result &= 0xff;
+  }
+  return session.status = result;
+}
+
+Session::Session(SessionIO io) : io(io) {}
+
+int Session::run(string_view line) {
+  ActiveSession active(*this);
+  int errors = parse_command_line(line, arena);
+  if (errors) {
+    print_parse_errors(errors);
+    return status = 2; // Don't execute any bad inputs.
+  }
+  return finish_line(*this, execute_expression(arena.expression, jobs));
+}
+
+// All lines are parsed first and every parse error is reported with its line
+// number before anything is executed. Lines with errors are skipped, just like
+// in the interactive loop. The commands are looked up in $PATH up front as
+// well, so executing a line only costs the launch itself.
+int Session::run_script(string_view script) {
+  ActiveSession active(*this);
+  vector<ScriptLine> lines;
+
+  size_t number = 0;
+  for (size_t start = 0; start < script.size();) {
+    size_t end = script.find('\n', start);
+    if (end == string::npos) end = script.size();
+    number++;
+
+    int errors = parse_command_line(script.substr(start, end - start), arena);
+    size_t line_number = number;
+    size_t next = end + 1;
+    if (arena.heredoc_open && next < script.size()) {
+      // The body of the heredoc is taken from the script directly.
+      string_view rest = script.substr(next);
+      size_t used = take_heredoc(rest, arena.heredoc, arena.expression.inputDocument);
+      used = used == string_view::npos ? rest.size() : used;
+      number += count(rest.begin(), rest.begin() + used, '\n');
+      next += used;
+    }
+    if (errors) {
+      print_parse_errors(errors, "line " + to_string(line_number) + ": ");
+    } else {
+      lines.push_back({line_number, move(arena.expression)});
+    }
+    start = next;
+  }
+
+  // Resolve all commands now, so the cache answers every lookup later on.
+  validate_path_cache();
+  for (const ScriptLine& line : lines) {
+    for (const Command& cmd : line.expression.commands) {
+      if (!cmd.parts.empty() && !find_builtin(cmd)) {
+        resolve_ahead(cmd.parts[0]);
+      }
+    }
+  }
+
+  for (ScriptLine& line : lines) {
+    if (exited) {
+      break;
+    }
+    // Report background jobs that have finished in the meantime.
+    reap_jobs(jobs);
+    finish_line(*this, execute_expression(line.expression, jobs));
+  }
+  return status;
+}
+
+int Session::run_input(int fd, bool showPrompt) {
+  ActiveSession active(*this);
+
+  // Reused for every line, so reading doesn't allocate once it has warmed up.
+  string commandLine;
+  InputReader input;
+  input.fd = fd;
+
+  // Finished background jobs are reported while waiting for input.
+  watch_input(jobs, fd);
+
+  // Terminals get the line editor, which shows the prompt itself.
+  unique_ptr<LineEditor> editor;
+  if (showPrompt && isatty(fd)) {
+    editor = make_unique<LineEditor>(fd);
+  }
+
+  while (!exited) {
+    if (editor) {
+      if (!edit_command_line(*editor, jobs, history, prompt_text(), commandLine)) {
+        break;
+      }
+    } else {
+      if (showPrompt) {
+        display_prompt();
+      }
+      if (!read_command_line(input, jobs, showPrompt, commandLine)) {
+        break;
+      }
+    }
+    if (history.fd != -1) {
+      if (!expand_history(history, commandLine)) {
+        continue;
+      }
+      add_history(history, commandLine);
+    }
+
+    // A heredoc goes on until the line with its delimiter.
+    if (commandLine.find("<<") != string::npos && parse_command_line(commandLine, arena) == 0 && arena.heredoc_open) {
+      string delimiter = arena.heredoc;
+      string body;
+      while (body != delimiter) {
+        if (editor) {
+          if (!edit_command_line(*editor, jobs, history, "> ", body)) break;
+        } else {
+          if (showPrompt) {
+            shell_out << "> ";
+            flush(shell_out);
+          }
+          if (!read_command_line(input, jobs, showPrompt, body)) break;
+        }
+        commandLine += '\n';
+        commandLine += body;
+      }
+    }
+    run(commandLine);
+  }
+  return status;
+}
+
+int Session::capture(string_view line, string* out, string* err) {
+  SessionIO saved = io;
+  int out_fd = out ? memfd_create("session-out", MFD_CLOEXEC) : -1;
+  int err_fd = err ? memfd_create("session-err", MFD_CLOEXEC) : -1;
+  if ((out && out_fd == -1) || (err && err_fd == -1)) {
+    print_error("memfd_create");
+  }
+  if (out_fd != -1) io.out = out_fd;
+  if (err_fd != -1) io.err = err_fd;
+
+  int result = run(line);
+  io = saved;
+
+  for (auto [fd, text] : {pair<int, string*>{out_fd, out}, {err_fd, err}}) {
+    if (fd != -1) {
+      text->clear();
+      lseek(fd, 0, SEEK_SET);
+      read_script(fd, *text);
+      close(fd);
+    }
+  }
+  return result;
+}
+
+// Runs the script in file `path` (`-` for standard input) in batch mode. A
+// regular file is mapped into memory and parsed where it lies, anything else
+// is read into memory first.
+int shell_script(const char* path) {
+  read_environment_settings();
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    print_error(path);
+    return errno;
+  }
+  string buffer;
+  string_view script;
+  void* map = MAP_FAILED;
+  size_t mapped = 0;
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset != -1 && st.st_size > offset) {
+    // mmap needs a page aligned offset.
+    off_t aligned = offset & ~off_t(sysconf(_SC_PAGESIZE) - 1);
+    mapped = st.st_size - aligned;
+    map = mmap(nullptr, mapped, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (map != MAP_FAILED) {
+      madvise(map, mapped, MADV_SEQUENTIAL);
+      script = string_view(static_cast<const char*>(map) + (offset - aligned), st.st_size - offset);
+      // Commands that read the inherited standard input start after the script.
+      lseek(fd, st.st_size, SEEK_SET);
+    }
+  }
+  int error = 0;
+  if (map == MAP_FAILED) {
+    error = read_script(fd, buffer);
+    script = buffer;
+  }
+  if (fd != STDIN_FILENO) close(fd);
+  if (error) {
+    errno = error;
+    print_error(path);
+    return error;
+  }
+  Session session;
+  int status = session.run_script(script);
+  if (map != MAP_FAILED) {
+    munmap(map, mapped);
+  }
+  if (!trace_file.empty()) {
+    write_trace(trace_file);
+  }
+  return status;
+}
+
+int shell(bool showPrompt) {
+  read_environment_settings();
+
+  // Without a prompt and with a file as standard input (`shell -t < script`),
+  // the whole input is there already: run it in batch mode. Pipes keep being
+  // read line by line, since more lines may still be on their way.
+  struct stat st;
+  if (!showPrompt && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+    return shell_script("-");
+  }
+
+  // Interactive shells keep a history, others only if BSHELL_HISTFILE asks for one.
+  Session session;
+  const char* histfile = getenv("BSHELL_HISTFILE");
+  const char* home = getenv("HOME");
+  if (histfile && *histfile) {
+    open_history(session.history, histfile);
+  } else if (showPrompt && home) {
+    open_history(session.history, string(home) + "/.bshell_history");
+  }
+  int status = session.run_input(STDIN_FILENO, showPrompt);
+  if (!trace_file.empty()) {
+    write_trace(trace_file);
+  }
+  return status;
+}
+
+// Reads exactly `n` bytes. Returns false at the end of the input or on errors.
+bool read_all(int fd, char* data, size_t n) {
+  while (n > 0) {
+    ssize_t got = read(fd, data, n);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    data += got;
+    n -= got;
+  }
+  return true;
+}
+
+// Receives the next request of a server connection: the command line, the
+// client's standard input, output and error, and its working directory.
+// Returns false when the client is done or sent something else.
+bool receive_request(int connection, string& line, SessionIO& io, int& cwd) {
+  uint32_t length;
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  iovec header = {&length, sizeof(length)};
+  msghdr message = {};
+  message.msg_iov = &header;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t got;
+  while ((got = recvmsg(connection, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+  }
+  if (got <= 0) {
+    return false;
+  }
+
+  vector<int> fds;
+  for (cmsghdr* c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      size_t n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int* data = reinterpret_cast<int*>(CMSG_DATA(c));
+      fds.insert(fds.end(), data, data + n);
+    }
+  }
+  bool valid = fds.size() == 4 && !(message.msg_flags & MSG_CTRUNC) &&
+               read_all(connection, reinterpret_cast<char*>(&length) + got, sizeof(length) - got) &&
+               length <= max_request_length;
+  if (valid) {
+    line.resize(length);
+    valid = read_all(connection, line.data(), length);
+  }
+  if (!valid) {
+    for (int fd : fds) close(fd);
+    return false;
+  }
+  io = {fds[0], fds[1], fds[2]};
+  cwd = fds[3];
+  return true;
+}
+
+// Serves one client until it closes the connection or runs `exit`, in a
+// forked copy of the server, so its jobs and variables stay its own.
+void serve_connection(int connection, Session& session) {
+  string line;
+  int cwd;
+  while (!session.exited && receive_request(connection, line, session.io, cwd)) {
+    int32_t status = fchdir(cwd) == 0 ? session.run_script(line) : (print_error("fchdir"), errno);
+    for (int fd : {session.io.in, session.io.out, session.io.err, cwd}) {
+      close(fd);
+    }
+    session.io = {};
+    if (send(connection, &status, sizeof(status), MSG_NOSIGNAL) != sizeof(status)) {
+      break;
+    }
+  }
+  close(connection);
+}
+
+int shell_server(const char* path) {
+  read_environment_settings();
+  validate_path_cache();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    print_error(path);
+    return errno;
+  }
+  strcpy(address.sun_path, path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (listener == -1 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+      listen(listener, SOMAXCONN) == -1) {
+    print_error(path);
+    return errno;
+  }
+
+  // Workers are forked ahead of time and wait in accept() themselves. A worker
+  // that gets a connection reports it through `busy`, and the server forks a
+  // new spare; nobody waits for the workers.
+  int busy[2];
+  if (pipe2(busy, O_CLOEXEC) == -1) {
+    print_error("pipe");
+    return errno;
+  }
+  struct sigaction ignore = {}, previous;
+  ignore.sa_handler = SIG_IGN;
+  sigaction(SIGCHLD, &ignore, &previous);
+  const int n_spares = 2;
+  int spares = 0;
+  pid_t server = getpid();
+  while (true) {
+    while (spares < n_spares) {
+      pid_t pid = fork();
+      if (pid == -1) {
+        print_error("fork");
+        sleep(1);
+        continue;
+      }
+      if (pid == 0) {
+        sigaction(SIGCHLD, &previous, nullptr);
+        close(busy[0]);
+        // Spares end with the server; connections in progress are finished.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != server) {
+          exit(0);
+        }
+        // The session is set up while the worker waits.
+        Session session;
+        int connection;
+        while ((connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) == -1 && errno == EINTR) {
+        }
+        prctl(PR_SET_PDEATHSIG, 0);
+        write(busy[1], "", 1);
+        close(busy[1]);
+        close(listener);
+        if (connection != -1) {
+          serve_connection(connection, session);
+        }
+        exit(0);
+      }
+      spares++;
+    }
+    char byte;
+    if (read(busy[0], &byte, 1) == 1) {
+      spares--;
+    } else if (errno != EINTR) {
+      print_error("read");
+      return errno;
+    }
+  }
+}
@@ -0,0 +1,305 @@
+#ifndef BSHELL_SHELL_H
+#define BSHELL_SHELL_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// An output redirection of a command: `> file`, `>> file`, `2> file`,
+// `2>> file` or `2>&1` (fd 2 without a path).
+struct Redirection {
+  int fd;
+  std::string path;
+  bool append = false;
+  bool expandable = false; // Whether the path is expanded like Command::expandable parts.
+};
+
+struct Command {
+  std::vector<std::string> parts = {};
+  // Where standard output and error go besides (for a command that is not
+  // the last) the next command. An output with several targets gets all of
+  // the data in every one.
+  std::vector<Redirection> redirections = {};
+  // Per part, whether it is an unquoted word with `$`, `*`, `?` or `[` in it
+  // that is replaced by its expansion before the command runs. Empty if the
+  // command has no such words.
+  std::vector<bool> expandable = {};
+  // Ranges [begin, end) of the parts that were produced by patterns, in order.
+  // If the command does not fit into ARG_MAX, these parts are spread over
+  // several invocations, each with all the other parts.
+  std::vector<std::pair<size_t, size_t>> splits = {};
+};
+
+struct Expression {
+  std::vector<Command> commands;
+  std::string inputFromFile;
+  std::string inputDocument; // Input given on the command line itself: `<<< word` or a `<<WORD` heredoc.
+  bool inputInline = false;  // Whether inputDocument is the input of the first command.
+  std::string outputToFile;  // If the last command has nothing but a single `> file`, else in its redirections.
+  bool background = false;
+  // Whether inputFromFile and outputToFile are expanded like Command::expandable parts.
+  bool inputExpandable = false, outputExpandable = false;
+};
+
+// Captured standard output and error of a background job (see job_output_size).
+struct JobOutput;
+
+// A background job: all processes of one pipeline that was started with `&`,
+// or of a foreground pipeline that was stopped.
+struct Job {
+  int id;
+  pid_t pgid;              // Process group of the job.
+  std::vector<pid_t> pids; // Processes of the pipeline, in order.
+  std::vector<int> pidfds; // Per process, -1 once it is reaped or without pidfd support.
+  size_t running;          // Processes that are not reaped yet.
+  bool stopped = false;
+  int status = 0;          // Wait status of the last process of the pipeline.
+  std::string description; // Command line, for `jobs` and the completion message.
+  std::shared_ptr<JobOutput> output; // Its captured output, if any.
+};
+
+// Resolved-path cache for command names (like the `hash` of bash). Negative
+// results are cached as well. All entries are dropped as soon as $PATH changes
+// or one of its directories is modified.
+struct PathCache {
+  std::string path_var;                                 // $PATH the entries belong to.
+  std::vector<std::pair<std::string, timespec>> dirs;   // Directories of $PATH with their mtime.
+  std::unordered_map<std::string, std::pair<std::string, unsigned>> hits; // name -> (path, number of hits)
+  std::unordered_map<std::string, int> misses;          // name -> errno of the failed lookup
+  std::unordered_map<std::string, std::string> ahead;   // name -> path, looked up before use
+};
+
+// Background jobs by job id. Children are reaped through an epoll set that
+// holds a pidfd per process (or a signalfd for SIGCHLD on kernels without
+// pidfd_open) and standard input, so the shell notices finished jobs while it
+// waits for the next line.
+struct JobTable {
+  std::map<int, Job> jobs;
+  int epoll_fd = -1;
+  int signal_fd = -1;         // Only used without pidfd_open.
+  int input_fd = -1;          // Where command lines are read from, if it is in the epoll set.
+  // Captured output of finished jobs, by job id until the id is used again.
+  std::map<int, std::shared_ptr<JobOutput>> finished_output;
+
+  JobTable() = default;
+  JobTable(const JobTable&) = delete;
+  JobTable& operator=(const JobTable&) = delete;
+  ~JobTable();
+};
+
+// How the processes of a pipeline are started.
+// Fork:  fork() per stage, redirections are set up in the child (the original path).
+// Spawn: posix_spawn() per stage, redirections become spawn file actions. glibc
+//        implements this with clone(CLONE_VM|CLONE_VFORK), so no page tables are copied.
+enum class LaunchBackend { Fork, Spawn };
+
+// Build option: compile with -DBSHELL_DEFAULT_LAUNCH_FORK to make fork() the default.
+// At runtime the environment variable BSHELL_LAUNCH=fork|spawn overrides it.
+extern LaunchBackend launch_backend;
+
+// Whether `cat` and `cp` without options run inside the shell (zero-copy with
+// copy_file_range/sendfile/splice) instead of exec'ing the real programs.
+// BSHELL_MOVERS=0 turns this off.
+extern bool use_data_movers;
+
+// Capacity in bytes of a ring buffer per background job that captures its
+// standard output and error, so they do not write to the terminal in between
+// the prompt. `jobs -o` and `tail %n` show what it holds. 0 (the default): no
+// capture. BSHELL_JOB_OUTPUT=size (with a K or M suffix) sets it.
+extern size_t job_output_size;
+// If not empty, output that a full ring buffer is about to overwrite is
+// appended to a file in this directory instead of being dropped.
+// BSHELL_JOB_SPILL=dir sets it.
+extern std::string job_spill_dir;
+
+// Hints that the shell gives the kernel about the files a pipeline reads and
+// writes through redirections, so that a pipeline over large files does not
+// push out the page cache that everything else on the machine relies on. Each
+// hint applies where it makes sense: to the input file (`< file`), to the
+// output files (`> file`, `>> file`, `2> file`), or (dontneed) to both.
+struct IoPolicy {
+  bool sequential = false;     // Input: posix_fadvise SEQUENTIAL, a larger readahead window.
+  bool willneed = false;       // Input: posix_fadvise WILLNEED, reading starts in the background.
+  uint64_t readahead = 0;      // Input: this many bytes are read with readahead(2) before the stages start.
+  bool noatime = false;        // Input: opened with O_NOATIME, where the shell may.
+  bool dontneed = false;       // What the pipeline has read or written is dropped from the page cache behind it.
+  uint64_t throttle = 0;       // Outputs: written back with sync_file_range every this many bytes.
+  uint64_t allocate = 0;       // Outputs: this many bytes are allocated with fallocate first.
+  bool allocate_input = false; // Outputs: as many bytes are allocated as the input file has.
+};
+
+// Hints for the input and the output files of every pipeline. `io -i hints
+// -o hints pipeline` replaces them for one command line. BSHELL_IO=hints
+// (e.g. `dontneed,throttle=64M`) sets both.
+extern IoPolicy io_input_policy, io_output_policy;
+
+// Whether pipelines are rewritten before they run, where that keeps their
+// output and exit status exactly: useless `cat` stages become input files,
+// identity stages are dropped, and /bin/cat and friends become the builtins.
+// BSHELL_OPTIMIZE=0 turns this off.
+extern bool optimize_pipelines;
+
+// `shell -n`: print every pipeline as it would run, with the rewrites, instead
+// of running it.
+extern bool explain_pipelines;
+
+// `set -o pipefail`: the exit status of a pipeline is that of its last stage
+// that failed (0 if none did) instead of that of its last stage.
+extern bool pipefail;
+// `set -o failfast`: as soon as a stage of a foreground pipeline fails, the
+// rest of its process group gets SIGTERM, and the exit status of the pipeline
+// is that of the stage that failed. A stage that dies of SIGPIPE does not count.
+extern bool failfast;
+
+// A token of a command line: a slice of the line itself, or of ParseArena::scratch
+// if quotes had to be removed from the middle of it.
+struct Token {
+  bool in_scratch;
+  size_t offset, length;
+  bool quoted = false; // Whether quotes were removed from it.
+};
+
+// Memory for parsing command lines that is reused from line to line.
+struct ParseArena {
+  Expression expression;            // Result of the last parse.
+  std::string scratch;              // Tokens that are not a slice of the line.
+  std::vector<Token> tokens;        // Tokens of all commands.
+  std::vector<size_t> command_ends; // Per command: index in tokens past its last token.
+  std::string heredoc;              // Delimiter of a `<<` heredoc of the last parse, or empty.
+  bool heredoc_open = false;        // Whether the line ended before the delimiter of the heredoc.
+};
+
+enum ParseError {
+  PARSE_ERROR_QUOTES = 1, // Unbalanced quotes.
+  PARSE_ERROR_PIPE = 2,   // Empty command between `|`.
+};
+
+std::vector<std::string> split_string(const std::string& str, char delimiter = ' ');
+// Splits `line` into arena.tokens, grouped per command by arena.command_ends.
+// Returns a combination of the PARSE_ERROR_ flags.
+int lex_command_line(std::string_view line, ParseArena& arena);
+// The text of a token of `line`, lexed into `arena`.
+std::string_view token_text(std::string_view line, const ParseArena& arena, const Token& token);
+// A `<<WORD` heredoc takes the lines after the first one up to a line that
+// is just WORD; if `line` ends before that, arena.heredoc_open is set.
+int parse_command_line(std::string_view line, ParseArena& arena);
+Expression parse_command_line(const std::string& commandLine, bool& success);
+// `in_fd`, if not -1, is the standard input of the first command instead of file_in.
+int execute_commands(std::vector<Command>& commands, JobTable& jobs,
+                     std::string& file_in, std::string& file_out, bool background, int in_fd = -1);
+
+// Command history in an append-only file that all sessions share. A record is
+// "\x1e<line>\n", appended with a single O_APPEND write, so records of
+// concurrent shells never interleave; a reader skips to the next \x1e after a
+// damaged one and leaves a record without its newline for later. The file is
+// memory-mapped, and a thread of the session splits it into entries and
+// indexes them: all of it as soon as it is opened, then what any shell
+// appends. Neither opening the file nor a prompt costs anything for its size;
+// a lookup only waits for what the thread has not caught up with yet, like a
+// search right after a large file is opened (about 1 ms per thousand entries,
+// BM_HistoryFirstSearch).
+
+// Entries of the history file and their index, as the session has them or as
+// the thread hands them over.
+struct HistoryBatch {
+  std::vector<std::pair<uint64_t, uint32_t>> entries; // Offset and length per line, oldest first.
+  // Entry numbers per trigram of the line, and per first trigram (the prefix),
+  // in ascending order. A trigram is three bytes packed into an integer.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> prefixes;
+};
+
+struct History : HistoryBatch {
+  int fd = -1;
+  const char* map = nullptr;
+  size_t mapped = 0; // Size of the mapping.
+
+  // Shared with the thread, which has a mapping of its own.
+  std::mutex lock;
+  int wake_fd = -1; // Eventfd written to make the thread look at the file.
+  int done_fd = -1; // Eventfd the thread writes to after each pass.
+  size_t requested = 0; // Size of the file that a lookup waits for.
+  size_t checked = 0;   // Size of the file at the end of the thread's last pass.
+  bool stop = false;
+  HistoryBatch pending; // Split and indexed, but not taken by the session yet.
+  std::thread indexer;
+
+  History() = default;
+  History(const History&) = delete;
+  History& operator=(const History&) = delete;
+  ~History();
+};
+
+// Opens (and creates) the history file at `path`. Returns false on errors.
+bool open_history(History& history, const std::string& path);
+// Appends a line to the history file.
+void add_history(History& history, std::string_view line);
+// Number of the newest entry before `before` that contains `text` (or starts
+// with it, if `prefix` is set), or -1.
+long search_history(History& history, std::string_view text, bool prefix, size_t before);
+
+// Standard input, output and error of a session. Commands inherit them, and
+// the shell writes its own output (prompt, job reports, errors) to them.
+struct SessionIO {
+  int in = STDIN_FILENO;
+  int out = STDOUT_FILENO;
+  int err = STDERR_FILENO;
+};
+
+// A shell that can be embedded: it runs command lines it is given and returns
+// their exit status, on file descriptors of the caller's choice. `exit` ends
+// the session, not the process. Sessions do share the process itself (current
+// directory, environment, the PATH cache), so only one should run at a time.
+struct Session {
+  SessionIO io;
+  JobTable jobs;
+  History history;      // Lines read by run_input; no file: no history.
+  PathCache path_cache; // Commands looked up in $PATH, listed by `hash`.
+  bool exited = false;  // Set by `exit`.
+  int status = 0;       // Exit status of the last line, or the one given to `exit`.
+  ParseArena arena;
+
+  explicit Session(SessionIO io = {});
+
+  // Runs one command line (followed by the body of its heredoc, if it has
+  // one). Returns its exit status (2 for a parse error).
+  int run(std::string_view line);
+  // Runs a script in batch mode: every line is parsed before the first one
+  // runs. Returns the status of the last line that ran.
+  int run_script(std::string_view script);
+  // Reads lines from `fd` and runs them until the end of the input or `exit`,
+  // reporting finished background jobs while it waits. `!prefix` at the start
+  // of a line is replaced by the newest history entry starting with `prefix`,
+  // and lines are added to the history. With a prompt, a terminal gets the
+  // line editor (history keys and Tab completion). Returns `status`.
+  int run_input(int fd, bool showPrompt);
+  // Runs one command line with its output and errors collected in `out` and
+  // `err` (nullptr: to the session's own fds).
+  int capture(std::string_view line, std::string* out, std::string* err);
+};
+
+int shell(bool showPrompt);
+int shell_script(const char* path);
+
+// Server mode: listens on the UNIX stream socket at `path` and runs command
+// lines for clients, from workers forked off the warm server ahead of time.
+// A request is a 4-byte length (host byte order) with the client's standard
+// input, output and error and its working directory (an O_PATH fd) attached
+// as SCM_RIGHTS, followed by that many bytes of command lines, which run in
+// that directory. The answer is the 4-byte exit status of the last line. A
+// connection can carry any number of requests; each one gets a worker of its
+// own, so clients run concurrently.
+int shell_server(const char* path);
+const uint32_t max_request_length = 64 << 20;
+
+#endif
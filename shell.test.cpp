@@ -1,20 +1,47 @@
 #include <gtest/gtest.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "shell.h"
 
 using namespace std;
 
-// shell to run tests on
+// shell binary for the tests that run it as a program
+#ifndef SHELL
 #define SHELL "../build/shell -t"
 //#define SHELL "/bin/sh"
+#endif
+
+// client of the server mode
+#ifndef CLIENT
+#define CLIENT "../build/shell_client"
+#endif
 
-// declarations of methods you want to test (should match exactly)
-vector<string> split_string(const string& str, char delimiter = ' ');
+// directory with the files 1, 2, 3 and 4 that the commands run in
+#ifndef TEST_DIR
+#define TEST_DIR "../test-dir"
+#endif
 
 namespace {
 
 void Execute(std::string command, std::string expectedOutput);
 void Execute(std::string command, std::string expectedOutput, std::string expectedOutputFile, std::string expectedOutputFileContent);
+void ExecuteBinary(std::string command, std::string expectedOutput, int expectedStatus);
+std::string filecontents(const std::string& str);
+int ReferenceLex(const std::string& line, std::vector<std::vector<std::string>>& commands);
+std::thread StopChild(const std::string& name);
 
 TEST(Shell, split_string) {
 	std::vector<std::string> expected;
@@ -40,6 +67,28 @@ TEST(Shell, split_string) {
 	EXPECT_EQ(expected, split_string("cmd1 arg1 < inputfile | cmd2 arg2 > outputfile"));
 }
 
+TEST(Shell, LexerMatchesReference) {
+	// Random lines of the bytes that matter to the lexer get the same tokens
+	// and errors as from the two-pass parser that it replaced.
+	const char alphabet[] = "ab |'\"\t\n\r";
+	std::mt19937 random(5);
+	ParseArena arena;
+	for (int i = 0; i < 200000; i++) {
+		std::string line(random() % 24, ' ');
+		for (char& c : line) c = alphabet[random() % (sizeof(alphabet) - 1)];
+		std::vector<std::vector<std::string>> expected, got;
+		int errors = ReferenceLex(line, expected);
+		ASSERT_EQ(errors, lex_command_line(line, arena)) << line;
+		size_t begin = 0;
+		for (size_t end : arena.command_ends) {
+			got.emplace_back();
+			for (size_t j = begin; j < end; j++) got.back().emplace_back(token_text(line, arena, arena.tokens[j]));
+			begin = end;
+		}
+		ASSERT_EQ(expected, got) << line;
+	}
+}
+
 TEST(Shell, ReadFromFile) {
 	Execute("cat < 1", "line 1\nline 2\nline 3\nline 4");
 }
@@ -68,6 +117,662 @@ TEST(Shell, ExecuteChained) {
 	Execute("ls -1 | head -n 2 | tail -n 1", "2\n");
 }
 
+TEST(Shell, DataMovers) {
+	Execute("cp 1 ../foobar", "", "../foobar", "line 1\nline 2\nline 3\nline 4");
+	// A directory is refused before the target is truncated.
+	Execute("cp 1 ../foobar\ncp . ../foobar 2> /dev/null\ncat ../foobar", "line 1\nline 2\nline 3\nline 4");
+	Execute("cat 1 | cat | tail -n 1", "line 4");
+}
+
+TEST(Shell, Builtins) {
+	Execute("echo hello world\nprintf \"%s=%d\\n\" a 1 b 2\necho x | cat\necho -n y | tr y z", "hello world\na=1\nb=2\nx\nz");
+	Execute("echo hi > ../foobar", "", "../foobar", "hi\n");
+
+	// printf pads and truncates %s, %b and %c, also past its 512-byte buffer.
+	Execute("printf \"[%5s|%-3s|%.2s|%4c|%-4b]\\n\" ab c xyz q 'a\\tb'", "[   ab|c  |xy|   q|a\tb ]\n");
+	std::string wide(300, 'w');
+	Execute("printf \"%.3s|%302s|%-301s|\" " + wide + " " + wide + " " + wide, "www|  " + wide + "|" + wide + " |");
+
+	// true, false, test and [ give 0 or 1, and 2 for a malformed expression.
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.run("true"));
+	EXPECT_EQ(1, session.run("false"));
+	EXPECT_EQ(0, session.run("test -f " TEST_DIR "/1"));
+	EXPECT_EQ(1, session.run("[ -d " TEST_DIR "/1 ]"));
+	EXPECT_EQ(0, session.run("[ a = a ]"));
+	EXPECT_EQ(0, session.run("test 2 -lt 10"));
+	EXPECT_EQ(1, session.run("test"));
+	EXPECT_EQ(2, session.capture("[ a = a", &out, &err));
+	EXPECT_EQ(2, session.capture("test 1 -lt x", &out, &err));
+
+	// cd moves the shell itself, pwd prints where it is, and cd alone goes $HOME.
+	char cwd[PATH_MAX], real[PATH_MAX];
+	ASSERT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+	ASSERT_NE(nullptr, realpath(TEST_DIR "/..", real));
+	EXPECT_EQ(0, session.run("cd " TEST_DIR "/.."));
+	EXPECT_EQ(0, session.capture("pwd", &out, &err));
+	EXPECT_EQ(std::string(real) + "\n", out);
+	EXPECT_EQ(1, session.capture("cd 1 2", &out, &err));
+	EXPECT_EQ(1, session.capture("cd /nonexistent", &out, &err));
+	std::string home = getenv("HOME");
+	setenv("HOME", "/", 1);
+	EXPECT_EQ(0, session.run("cd"));
+	EXPECT_EQ(0, session.capture("pwd", &out, &err));
+	EXPECT_EQ("/\n", out);
+	setenv("HOME", home.c_str(), 1);
+	EXPECT_EQ(0, chdir(cwd));
+
+	// A command that only starts with the name of a builtin is not that builtin.
+	std::string bin = TEST_DIR "/../cdbin", cdrom = bin + "/cdrom";
+	mkdir(bin.c_str(), 0755);
+	int fd = open(cdrom.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	EXPECT_EQ(11, write(fd, "echo cdrom\n", 11));
+	close(fd);
+	std::string path = getenv("PATH");
+	setenv("PATH", (bin + ":" + path).c_str(), 1);
+	Execute("cdrom\n", "cdrom\n");
+	setenv("PATH", path.c_str(), 1);
+	unlink(cdrom.c_str());
+	rmdir(bin.c_str());
+}
+
+TEST(Shell, HashBuiltin) {
+	Execute("hash\nls -1 | head -n 1\nhash -r\nhash\n", "hash: hash table empty\n1\nhash: hash table empty\n");
+
+	// A $PATH directory of its own, with scripts without a `#!` line that run with /bin/sh.
+	std::string bin = TEST_DIR "/../hashbin", greet = bin + "/greet", other = bin + "/other";
+	mkdir(bin.c_str(), 0755);
+	auto script = [](const std::string& path) {
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+		EXPECT_EQ(16, write(fd, "echo hello \"$1\"\n", 16));
+		close(fd);
+	};
+	script(greet);
+	std::string path = getenv("PATH");
+	setenv("PATH", (bin + ":" + path).c_str(), 1);
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.run("hash -r"));
+	EXPECT_EQ(0, session.capture("greet a", &out, &err));
+	EXPECT_EQ("hello a\n", out);
+	EXPECT_EQ(0, session.capture("greet b", &out, &err));
+	EXPECT_EQ(0, session.capture("hash", &out, &err));
+	EXPECT_EQ("hits\tcommand\n   2\t" + greet + "\n", out);
+
+	// A miss is remembered while the directories stay unchanged, until `hash -r`.
+	struct stat st;
+	EXPECT_NE(0, session.capture("other", &out, &err));
+	stat(bin.c_str(), &st);
+	script(other);
+	struct timespec times[2] = {st.st_atim, st.st_mtim};
+	utimensat(AT_FDCWD, bin.c_str(), times, 0);
+	EXPECT_NE(0, session.capture("other", &out, &err));
+	EXPECT_EQ(0, session.run("hash -r"));
+	EXPECT_EQ(0, session.capture("other c", &out, &err));
+	EXPECT_EQ("hello c\n", out);
+
+	// Changing $PATH empties the table.
+	setenv("PATH", (path + ":" + bin).c_str(), 1);
+	EXPECT_EQ(0, session.capture("hash", &out, &err));
+	EXPECT_EQ("hash: hash table empty\n", out);
+	setenv("PATH", path.c_str(), 1);
+	unlink(greet.c_str());
+	unlink(other.c_str());
+	rmdir(bin.c_str());
+}
+
+TEST(Shell, InlineInput) {
+	Execute("cat <<< hello world\ncat <<<hi | tr h H", "hello world\nHi\n");
+	Execute("wc -l <<< x > ../foobar", "", "../foobar", "1\n");
+	Execute("cat <<EOF\nline a\n  line b\nEOF\necho after\ntr a b << END | cat\naaa\nEND", "line a\n  line b\nafter\nbbb\n");
+	Execute("cat <<EOF\nno delimiter", "no delimiter\n");
+
+	// Larger than a pipe: a memfd.
+	Session session;
+	std::string out, large(200000, 'x');
+	EXPECT_EQ(0, session.capture("wc -c <<END\n" + large + "\nEND", &out, nullptr));
+	EXPECT_EQ("200001\n", out);
+	EXPECT_EQ(0, session.capture("cat <<< '" + large + "'", &out, nullptr));
+	EXPECT_EQ(large + "\n", out);
+}
+
+TEST(Shell, OutputTargets) {
+	Execute("echo one > ../out1 > ../out2\necho two >> ../out1\ncat ../out1 ../out2", "one\ntwo\none\n");
+	Execute("echo three >> ../out1 >> ../out2 > ../out3\ncat ../out1 ../out2 ../out3", "one\ntwo\nthree\none\nthree\nthree\n");
+	// Fanned out to the files and the next command.
+	Execute("cat < 1 > ../out1 > ../out2 | wc -l\ncat ../out1 ../out2 | wc -c", "3\n54\n");
+	Execute("ls nonexistent 2> ../out1\nwc -l < ../out1\nls 1 nonexistent 2>&1 | wc -l", "1\n2\n");
+	Execute("cd nonexistent 2> ../out1\ncat ../out1", "cd: No such file or directory\n");
+	Execute("rm ../out1 ../out2 ../out3", "");
+	// Applied in the order written: `2>&1` takes standard output as it is at that point.
+	Execute("ls nonexistent 2>&1 > ../out1 | wc -l\nwc -l < ../out1\nls 1 nonexistent > ../out1 2>&1\nwc -l < ../out1", "1\n0\n2\n");
+	ExecuteBinary("ls nonexistent 2>&1 > ../out2\nwc -c < ../out2", "ls: cannot access 'nonexistent': No such file or directory\n0\n", 0);
+	Execute("ls 1 > ../out2 2> /nonexistent/out > ../out3\nls .. | grep -c out3", "0\n");
+	Execute("rm ../out1 ../out2", "");
+}
+
+TEST(Shell, TimePrefix) {
+	Execute("time echo hi | tr h H\ntime -v -j cat 1 | tail -n 1", "Hi\nline 4");
+}
+
+TEST(Shell, PinPrefix) {
+	Execute("pin -c 0 grep Cpus_allowed_list /proc/self/status", "Cpus_allowed_list:\t0\n");
+	Execute("pin -c 0:0 -l nofile=64 cat /proc/self/limits | grep Max.open | tr -s '[:space:]'", "Max open files 64 64 files \n");
+	Execute("pin -a -l cpu=unlimited grep Max.cpu /proc/self/limits | wc -l", "1\n");
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(2, session.capture("pin -l bogus=1 true", &out, &err));
+	EXPECT_EQ("pin: bogus=1: bad limit\n", err);
+}
+
+TEST(Shell, CachePrefix) {
+	setenv("BSHELL_CACHE_DIR", TEST_DIR "/../cache", 1);
+	unsetenv("BSHELL_CACHE_SIZE");
+	Execute("cache -c\n"
+	        "cache sort -r < 1 | head -n 2\ncache sort -r < 1 | head -n 2\n"
+	        "cache sort -r < 1 > ../cached\nrm ../cached\ncache sort -r < 1 > ../cached\ncat ../cached\n"
+	        "cp 1 ../cache_input\ncache -h sort ../cache_input <<< x | wc -l\ntouch ../cache_input\ncache -h sort ../cache_input <<< x | wc -l\n"
+	        "cache echo uncached 2> ../cache_err\ncache -s",
+	        "line 4\nline 3\nline 4\nline 3\nline 4\nline 3\nline 2\nline 1\n4\n4\nuncached\n"
+	        "hits      3\nmisses    3\nuncached  1\nevictions 0\nentries   3\nsize      44B of 1.0G\n"
+	        "directory " TEST_DIR "/../cache\n");
+	// Not cached: what reads the shell's standard input, and a directory argument.
+	Execute("cache sort -r 1 | head -n 1\ncache ls -d ../cache < 1\ncache -s",
+	        "line 4\n../cache\nhits      3\nmisses    3\nuncached  3\nevictions 0\nentries   3\nsize      44B of 1.0G\n"
+	        "directory " TEST_DIR "/../cache\n");
+	// A changed input is a miss; the least recently used entries go first.
+	setenv("BSHELL_CACHE_SIZE", "30", 1);
+	Execute("echo >> ../cache_input\necho line5 >> ../cache_input\ncache sort < ../cache_input | tail -n 1\ncache -s",
+	        "line5\nhits      3\nmisses    4\nuncached  3\nevictions 2\nentries   2\nsize      8B of 30B\n"
+	        "directory " TEST_DIR "/../cache\n");
+	unsetenv("BSHELL_CACHE_SIZE");
+	Execute("rm -r ../cache ../cached ../cache_input ../cache_err", "");
+}
+
+TEST(Shell, Expansion) {
+	Execute("mkdir -p ../glob/sub/deep ../glob/.hidden\n"
+	        "touch ../glob/a.c ../glob/b.c ../glob/c.h ../glob/sub/x.c ../glob/sub/deep/y.c ../glob/.hidden/z.c ../glob/.d.c", "");
+	Execute("echo ../glob/*.c\necho ../glob/?.[ch]\necho ../glob/[!a].*\necho ../glob/*/\necho ../glob/**/*.c",
+	        "../glob/a.c ../glob/b.c\n../glob/a.c ../glob/b.c ../glob/c.h\n../glob/b.c ../glob/c.h\n../glob/sub/\n"
+	        "../glob/a.c ../glob/b.c ../glob/sub/deep/y.c ../glob/sub/x.c\n");
+	// Quoted words and patterns without matches stay as they are.
+	Execute("echo '../glob/*' \"../glob/*.c\" ../glob/*.zz [", "../glob/* ../glob/*.c ../glob/*.zz [\n");
+	setenv("BSHELL_TEST_VAR", "value", 1);
+	Execute("echo $BSHELL_TEST_VAR ${BSHELL_TEST_VAR}s $BSHELL_TEST_UNSET '$BSHELL_TEST_VAR'", "value values $BSHELL_TEST_VAR\n");
+	// The files of redirections, and the command lines that parallel parses.
+	Execute("echo one > ../glob/sub/out\necho two >> ../glob/su*/o* 2> ../glob/$BSHELL_TEST_VAR\ncat < ../glob/s?b/out\n"
+	        "echo three > '../glob/*.q'\ncat \"../glob/*.q\" ../glob/value\nparallel -k 'echo ../glob/*.c {} | cat' ::: 1",
+	        "one\ntwo\nthree\n../glob/a.c ../glob/b.c 1\n");
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(1, session.capture("echo x > " TEST_DIR "/../glob/*.c", &out, &err));
+	EXPECT_EQ(TEST_DIR "/../glob/*.c: ambiguous redirect\n", err);
+	EXPECT_EQ(1, session.capture("cat < $BSHELL_TEST_UNSET", &out, &err));
+	EXPECT_EQ("$BSHELL_TEST_UNSET: ambiguous redirect\n", err);
+	Execute("rm -r ../glob", "");
+}
+
+TEST(Shell, ExpansionBeyondArgMax) {
+	// 2.5 MB of arguments: more than ARG_MAX with the usual 8 MB stack limit.
+	std::string dir = TEST_DIR "/../argmax";
+	mkdir(dir.c_str(), 0755);
+	for (int i = 0; i < 10000; i++) {
+		std::string name = dir + "/" + std::to_string(i) + std::string(240, 'x');
+		close(open(name.c_str(), O_CREAT | O_WRONLY, 0644));
+	}
+	// Split into two invocations, each of which also gets the fixed `../argmax`.
+	Execute("/bin/echo ../argmax/* | wc -w\nls -d ../argmax/* ../argmax | wc -l", "10000\n10002\n");
+	// A word between two patterns is in every invocation: `ls` complains about
+	// MID once per invocation, and there are two with an 8 MB stack limit.
+	struct rlimit stack, limited;
+	getrlimit(RLIMIT_STACK, &stack);
+	limited = {8 << 20, stack.rlim_max};
+	setrlimit(RLIMIT_STACK, &limited);
+	Execute("ls -d ../argmax/1* MID ../argmax/* 2>&1 | grep -c MID\nls -d ../argmax/1* MID ../argmax/* 2> /dev/null | wc -l",
+	        "2\n11111\n");
+	setrlimit(RLIMIT_STACK, &stack);
+	Execute("rm -r ../argmax", "");
+}
+
+TEST(Shell, Server) {
+	char buffer[512];
+	std::string dir = getcwd(buffer, sizeof(buffer));
+	std::string socket = dir + "/server.sock";
+	pid_t server = fork();
+	if (server == 0) {
+		_exit(shell_server(socket.c_str()));
+	}
+	for (int i = 0; i < 500 && access(socket.c_str(), F_OK) != 0; i++) {
+		usleep(10000);
+	}
+	auto client = [&](const std::string& args, std::string& output) {
+		std::string command = "cd " TEST_DIR "; { " + args + "; } > '" + dir + "/output' 2>&1";
+		int rc = system(command.c_str());
+		output = filecontents(dir + "/output");
+		return WEXITSTATUS(rc);
+	};
+	std::string run = "timeout 10 " CLIENT " " + socket + " ", output;
+	EXPECT_EQ(0, client(run + "'echo hi | tr h H'", output));
+	EXPECT_EQ("Hi\n", output);
+	EXPECT_EQ(1, client(run + "false", output));
+	EXPECT_EQ(0, client("echo abc | " + run + "tr a A", output));
+	EXPECT_EQ("Abc\n", output);
+	// Commands run in the client's directory; `cd` only lasts for its request.
+	EXPECT_EQ(0, client(run + "cd /; " + run + "pwd", output));
+	EXPECT_EQ(TEST_DIR "\n", output);
+	// Clients run concurrently: the reader waits for the writer.
+	EXPECT_EQ(0, client("mkfifo ../fifo; " + run + "cat ../fifo & " + run + "'echo x > ../fifo'; wait", output));
+	EXPECT_EQ("x\n", output);
+	unlink(TEST_DIR "/../fifo");
+	kill(server, SIGTERM);
+	waitpid(server, nullptr, 0);
+	unlink(socket.c_str());
+}
+
+TEST(Shell, LongPipeline) {
+	// The shell holds a few descriptors at a time, however long the pipeline is.
+	rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	rlimit lowered = {64, files.rlim_max};
+	setrlimit(RLIMIT_NOFILE, &lowered);
+	std::string line = "cat < 1";
+	for (int i = 0; i < 500; i++) {
+		line += i == 250 ? " | echo middle" : " | cat";
+	}
+	Execute(line + " | tr m M", "Middle\n");
+	setrlimit(RLIMIT_NOFILE, &files);
+}
+
+TEST(Shell, StatsBuiltin) {
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.run("stats on"));
+	EXPECT_EQ(0, session.capture("ls / | wc -l", &out, &err));
+	EXPECT_EQ(0, session.capture("stats", &out, &err));
+	EXPECT_EQ(0u, out.find("phase        count       p50       p99       max\nparse            2 "));
+	EXPECT_NE(std::string::npos, out.find("\nlaunch           2 "));
+	EXPECT_NE(std::string::npos, out.find("\nwait             1 "));
+	EXPECT_EQ(0, session.run("stats -w trace_test.json"));
+	std::string trace = filecontents("trace_test.json");
+	EXPECT_EQ(0u, trace.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"parse\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":"));
+	EXPECT_NE(std::string::npos, trace.find("\"name\":\"launch\""));
+	EXPECT_NE(std::string::npos, trace.find("\"args\":{\"command\":\"wc\"}}"));
+	unlink("trace_test.json");
+	EXPECT_EQ(0, session.run("stats off"));
+	EXPECT_EQ(0, session.run("stats -r"));
+	EXPECT_EQ(0, session.capture("stats", &out, &err));
+	EXPECT_EQ("phase        count       p50       p99       max\n"
+	          "parse            0         -         -         -\n"
+	          "lookup           0         -         -         -\n"
+	          "launch           0         -         -         -\n"
+	          "exec             0         -         -         -\n"
+	          "wait             0         -         -         -\n"
+	          "reap             0         -         -         -\n"
+	          "pipeline         0         -         -         -\n", out);
+	EXPECT_EQ(2, session.capture("stats bogus", &out, &err));
+	EXPECT_EQ("usage: stats [on | off | -r | -w file]\n", err);
+}
+
+TEST(Shell, Optimizer) {
+	// Every line has the same output, errors and status with and without the rewrites.
+	std::string file = TEST_DIR "/1";
+	std::vector<std::string> lines = {
+		"cat " + file + " | grep 2", "cat " + file + " | cat | wc -l", "cat < " + file + " | tee | cat - | head -n 1",
+		"/bin/cat " + file + " | /bin/cat | tail -n 1", "cat " TEST_DIR "/nonexistent | wc -l", "/bin/echo -n a | cat -u | cat",
+		"/bin/true | cat | /bin/false", "cat <<< document | cat | tr a-z A-Z", "cat " + file + " " + file + " | cat | wc -c",
+		"/bin/echo --version | head -c 4", "cat " TEST_DIR " | wc -l",
+	};
+	Session session;
+	for (const std::string& line : lines) {
+		std::string out, err, optimized_out, optimized_err;
+		optimize_pipelines = false;
+		int status = session.capture(line, &out, &err);
+		optimize_pipelines = true;
+		EXPECT_EQ(status, session.capture(line, &optimized_out, &optimized_err)) << line;
+		EXPECT_EQ(out, optimized_out) << line;
+		EXPECT_EQ(err, optimized_err) << line;
+	}
+	// A stage with a file operand does not read its input: the writer in front
+	// of it dies of SIGPIPE, which pipefail reports, in both cases.
+	std::string big = TEST_DIR "/../big";
+	{
+		std::ofstream(big) << std::string(1 << 20, 'x');
+	}
+	std::string line = "cat " + big + " | wc -l " + file;
+	EXPECT_EQ(0, session.run("set -o pipefail"));
+	std::string out, err, optimized_out, optimized_err;
+	optimize_pipelines = false;
+	int status = session.capture(line, &out, &err);
+	optimize_pipelines = true;
+	EXPECT_EQ(status, session.capture(line, &optimized_out, &optimized_err)) << line;
+	EXPECT_EQ(out, optimized_out) << line;
+	EXPECT_NE(0, status);
+	EXPECT_EQ(0, session.run("set +o pipefail"));
+	unlink(big.c_str());
+
+	explain_pipelines = true;
+	EXPECT_EQ(0, session.capture("cat " + file + " | cat | grep 2 > out", &out, &err));
+	EXPECT_EQ("grep 2 < " + file + " > out\n  # cat " + file + ": the input file of the next stage\n"
+	          "  # cat: dropped, the next stage reads its input\n", out);
+	EXPECT_EQ(0, session.capture("/bin/cat 1 | wc", &out, &err));
+	EXPECT_EQ("cat 1 | wc\n  # /bin/cat: the builtin cat\n", out);
+	EXPECT_EQ(0, session.capture("ls | cat", &out, &err));
+	EXPECT_EQ("ls | cat\n", out);
+	// head may exit before it has read everything: the stages in front of it are kept.
+	EXPECT_EQ(0, session.capture("cat " + file + " | cat | head -n 1", &out, &err));
+	EXPECT_EQ("cat " + file + " | cat | head -n 1\n", out);
+	EXPECT_EQ(0, session.capture("cat " + file + " | cat | tr a-z A-Z | sort", &out, &err));
+	EXPECT_EQ("tr a-z A-Z < " + file + " | sort\n  # cat " + file + ": the input file of the next stage\n"
+	          "  # cat: dropped, the next stage reads its input\n", out);
+	explain_pipelines = false;
+}
+
+TEST(Shell, Jobs) {
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.capture("wait", &out, &err));
+	EXPECT_EQ("", out);
+	EXPECT_EQ(127, session.capture("wait %1", &out, &err));
+	EXPECT_EQ("wait: %1: no such job\n", err);
+	EXPECT_EQ(1, session.capture("fg", &out, &err));
+	EXPECT_EQ("fg: no current job\n", err);
+
+	// Every pipeline is one job; `wait %n` gives the status of its last stage.
+	EXPECT_EQ(0, session.capture("sleep 0.2 | cat &", &out, &err));
+	EXPECT_EQ(0u, out.find("[1] "));
+	EXPECT_EQ(0, session.capture("sleep 0.2 | ls /nonexistent &", &out, &err));
+	EXPECT_EQ(0u, out.find("[2] "));
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("[1] running  sleep 0.2 | cat\n[2] running  sleep 0.2 | ls /nonexistent\n", out);
+	EXPECT_EQ(2, session.capture("wait %2", &out, &err));
+	EXPECT_EQ(0, session.capture("wait", &out, &err));
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("", out);
+
+	// A finished job is reported as soon as the table is looked at.
+	EXPECT_EQ(0, session.capture("true &", &out, &err));
+	usleep(100000);
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("[1] done  true\n", out);
+
+	// A stopped job is continued by `bg`, and `fg` waits for it.
+	std::thread stopper = StopChild("sleep");
+	EXPECT_EQ(128 + SIGSTOP, session.capture("sleep 0.2", &out, &err));
+	stopper.join();
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("[1] stopped  sleep 0.2\n", out);
+	EXPECT_EQ(0, session.capture("bg %1", &out, &err));
+	EXPECT_EQ("[1] sleep 0.2 &\n", out);
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("[1] running  sleep 0.2\n", out);
+	EXPECT_EQ(0, session.capture("fg %1", &out, &err));
+	EXPECT_EQ("sleep 0.2\n", out);
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("", out);
+}
+
+TEST(Shell, JobOutput) {
+	std::string seq;
+	for (int i = 1; i <= 100; i++) seq += std::to_string(i) + "\n";
+	job_output_size = 64;
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.capture("seq 1 100 &", &out, &err));
+	EXPECT_EQ(0u, out.find("[1] "));
+	EXPECT_EQ(0, session.capture("ls /nonexistent &", &out, &err));
+	EXPECT_EQ(0, session.capture("wait", &out, &err));
+	EXPECT_EQ(0, session.capture("tail -n 2 %1", &out, &err));
+	EXPECT_EQ("99\n100\n", out);
+	EXPECT_EQ(0, session.capture("jobs -o %1", &out, &err));
+	EXPECT_EQ(seq.substr(seq.size() - 64), out);
+	EXPECT_EQ("jobs: %1: " + std::to_string(seq.size() - 64) + " earlier bytes dropped\n", err);
+	EXPECT_EQ(0, session.capture("tail %2", &out, &err));
+	EXPECT_NE(std::string::npos, out.find("/nonexistent"));
+	EXPECT_EQ(1, session.capture("tail %3", &out, &err));
+	EXPECT_EQ("tail: %3: no captured output\n", err);
+	EXPECT_EQ(0, session.capture("tail -n 1 " TEST_DIR "/1", &out, &err));
+	EXPECT_EQ("line 4", out);
+
+	// With a spill directory, nothing is lost.
+	mkdir("job_spill", 0755);
+	job_spill_dir = "job_spill";
+	EXPECT_EQ(0, session.capture("seq 1 100 &", &out, &err));
+	EXPECT_EQ(0, session.capture("wait", &out, &err));
+	EXPECT_EQ(0, session.capture("jobs -o %1", &out, &err));
+	std::string spill = err.substr(err.find("job_spill/"));
+	spill.pop_back();
+	EXPECT_EQ(seq, filecontents(spill) + out);
+	unlink(spill.c_str());
+	rmdir("job_spill");
+	job_spill_dir.clear();
+	job_output_size = 0;
+}
+
+TEST(Shell, Pipefail) {
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.capture("/bin/false | true", &out, &err));
+	EXPECT_EQ(0, session.capture("set -o pipefail", &out, &err));
+	EXPECT_EQ(1, session.capture("/bin/false | true", &out, &err));
+	EXPECT_EQ(1, session.capture("ls /nonexistent | /bin/false | true", &out, &err));
+	EXPECT_EQ(2, session.capture("/bin/false | ls /nonexistent | true", &out, &err));
+	EXPECT_EQ(1, session.capture("cat /nonexistent | true", &out, &err));
+	EXPECT_EQ(141, session.capture("yes | head -n 1", &out, &err));
+	// The builtin cat, whose reader goes away, gets the status of SIGPIPE too.
+	std::string big = TEST_DIR "/../big";
+	{
+		std::ofstream(big) << std::string(1 << 20, 'x');
+	}
+	EXPECT_EQ(141, session.capture("cat " + big + " | head -c 3 | wc -c", &out, &err));
+	EXPECT_EQ("3\n", out);
+	EXPECT_EQ(0, session.capture("set -o", &out, &err));
+	EXPECT_EQ("pipefail\ton\nfailfast\toff\n", out);
+
+	// failfast stops the rest of the pipeline as soon as a stage fails, without
+	// reporting the stages it terminates.
+	EXPECT_EQ(0, session.capture("set +o pipefail", &out, &err));
+	EXPECT_EQ(0, session.capture("set -o failfast", &out, &err));
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_EQ(1, session.capture("sleep 10 | /bin/false", &out, &err));
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+	EXPECT_EQ("", err);
+	EXPECT_EQ(0, session.capture("yes | head -n 1", &out, &err));
+	EXPECT_EQ(0, session.capture("cat " + big + " | head -c 3 | wc -c", &out, &err));
+	EXPECT_EQ("3\n", out);
+	unlink(big.c_str());
+	EXPECT_EQ(1, session.capture("set -o bogus", &out, &err));
+	EXPECT_EQ("set: bogus: invalid option name\n", err);
+	EXPECT_EQ(0, session.capture("set +o failfast", &out, &err));
+}
+
+TEST(Shell, StoppedPipeline) {
+	// Without the terminal, a pipeline stays in the process group of the shell.
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.capture("head -c 200 /proc/self/stat", &out, &err));
+	std::istringstream fields(out.substr(out.rfind(')') + 2));
+	std::string state;
+	pid_t parent = 0, group = 0;
+	fields >> state >> parent >> group;
+	EXPECT_EQ(getpgrp(), group);
+
+	// It still becomes a job when it stops, which `wait` skips and `wait %n` refuses.
+	std::thread stopper = StopChild("sleep");
+	EXPECT_EQ(128 + SIGSTOP, session.capture("sleep 0.2", &out, &err));
+	stopper.join();
+	EXPECT_NE(std::string::npos, out.find("[1] stopped  sleep 0.2\n")) << out;
+	EXPECT_EQ(0, session.capture("wait", &out, &err));
+	EXPECT_EQ(1, session.capture("wait %1", &out, &err));
+	EXPECT_EQ("wait: %1: job is stopped\n", err);
+	EXPECT_EQ(0, session.capture("bg", &out, &err));
+	EXPECT_EQ(0, session.capture("wait %1", &out, &err));
+	EXPECT_EQ(0, session.capture("jobs", &out, &err));
+	EXPECT_EQ("", out);
+
+	// The children of the application that runs the session stay its own to reap,
+	// whether they finish before the pipeline or while it runs.
+	for (int delay : {0, 100000}) {
+		pid_t child = fork();
+		if (child == 0) {
+			usleep(delay);
+			_exit(7);
+		}
+		usleep(50000);
+		EXPECT_EQ(0, session.capture("sleep 0.2", &out, &err));
+		int status = 0;
+		EXPECT_EQ(child, waitpid(child, &status, 0));
+		EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 7);
+	}
+}
+
+TEST(Shell, IoPolicy) {
+	// The hints change what the kernel caches, not what the pipeline reads or writes.
+	std::string file = TEST_DIR "/1";
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.capture("io -i sequential,willneed,readahead=1M,noatime,dontneed wc -l < " + file, &out, &err));
+	EXPECT_EQ("3\n", out);
+	EXPECT_EQ(0, session.capture("io -i dontneed -o dontneed,throttle=4K,allocate tr a-z A-Z < " + file + " > io_out", &out, &err));
+	EXPECT_EQ("LINE 1\nLINE 2\nLINE 3\nLINE 4", filecontents("io_out"));
+	EXPECT_EQ(0, session.capture("io -o throttle=1K cat " + file + " >> io_out", &out, &err));
+	EXPECT_EQ("LINE 1\nLINE 2\nLINE 3\nLINE 4line 1\nline 2\nline 3\nline 4", filecontents("io_out"));
+	EXPECT_EQ(0, session.capture("io -o allocate=1M echo hi > io_out", &out, &err));
+	EXPECT_EQ("hi\n", filecontents("io_out"));
+	io_output_policy.dontneed = true;
+	EXPECT_EQ(0, session.capture("echo global > io_out", &out, &err));
+	EXPECT_EQ("global\n", filecontents("io_out"));
+	io_output_policy = {};
+	EXPECT_EQ(127, session.capture("io -i dontneed wc -l < " TEST_DIR "/nonexistent", &out, &err));
+	EXPECT_EQ(0u, err.find("open input"));
+	EXPECT_EQ(2, session.capture("io -i bogus wc -l", &out, &err));
+	EXPECT_EQ("io: bogus: bad hints\n", err);
+	EXPECT_EQ(2, session.capture("io wc -l", &out, &err));
+	EXPECT_EQ("usage: io [-i hints] [-o hints] pipeline\n", err);
+	unlink("io_out");
+}
+
+TEST(Shell, SessionStatus) {
+	Session session;
+	EXPECT_EQ(0, session.run("true"));
+	EXPECT_EQ(1, session.run("false"));
+	EXPECT_EQ(0, session.run("false | true"));
+	EXPECT_EQ(2, session.run("echo 'unbalanced"));
+	EXPECT_FALSE(session.exited);
+	EXPECT_EQ(7, session.run("exit 7"));
+	EXPECT_TRUE(session.exited);
+	EXPECT_EQ(7, session.status);
+}
+
+TEST(Shell, SessionCapture) {
+	Session session;
+	std::string out, err;
+	EXPECT_EQ(0, session.capture("echo hi | tr h H", &out, &err));
+	EXPECT_EQ("Hi\n", out);
+	EXPECT_EQ("", err);
+	EXPECT_NE(0, session.capture("ls /nonexistent", &out, &err));
+	EXPECT_EQ("", out);
+	EXPECT_NE("", err);
+	EXPECT_EQ(1, session.capture("cd /nonexistent", &out, &err));
+	EXPECT_EQ("cd: No such file or directory\n", err);
+}
+
+TEST(Shell, History) {
+	unlink("history");
+	int in = memfd_create("input", MFD_CLOEXEC);
+	int out = memfd_create("output", MFD_CLOEXEC);
+	std::string lines = "echo one\necho two\n!echo\n!1\n!nothing\nhistory -s two\n";
+	ASSERT_EQ(ssize_t(lines.size()), write(in, lines.data(), lines.size()));
+	lseek(in, 0, SEEK_SET);
+	{
+		Session session({STDIN_FILENO, out, out});
+		ASSERT_TRUE(open_history(session.history, "history"));
+		session.run_input(in, false);
+		EXPECT_EQ(3, search_history(session.history, "echo", true, 5));
+	}
+	EXPECT_EQ("one\ntwo\necho two\ntwo\necho one\none\n!nothing: event not found\n"
+	          "    5  history -s two\n    3  echo two\n    2  echo two\n",
+	          filecontents("/proc/self/fd/" + std::to_string(out)));
+	close(in);
+	close(out);
+	unlink("history");
+
+	// The thread of a session splits and indexes what any session appends, and
+	// one that goes away while it is still at work stops it.
+	{
+		std::ofstream file("history");
+		for (int i = 0; i < 100000; ++i) file << "\x1e" "echo " << i << "\n";
+	}
+	{
+		History first, second;
+		ASSERT_TRUE(open_history(first, "history"));
+		ASSERT_TRUE(open_history(second, "history"));
+		{
+			History third;
+			ASSERT_TRUE(open_history(third, "history"));
+		}
+		EXPECT_EQ(99999, search_history(first, "echo 99999", true, size_t(-1)));
+		add_history(second, "echo appended");
+		EXPECT_EQ(100000, search_history(first, "appended", false, size_t(-1)));
+		EXPECT_EQ(-1, search_history(first, "appended", false, 100000));
+	}
+	unlink("history");
+}
+
+TEST(Shell, LineEditor) {
+	unlink("history");
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	ASSERT_NE(-1, master);
+	ASSERT_EQ(0, grantpt(master));
+	ASSERT_EQ(0, unlockpt(master));
+	int terminal = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	ASSERT_NE(-1, terminal);
+	termios raw;
+	tcgetattr(terminal, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(terminal, TCSANOW, &raw);
+
+	// Completion of a builtin and of a path, Up for the previous line, a
+	// Ctrl-R search and Ctrl-D to end it.
+	std::string keys = "ech\tfirst\rcat test-d\t1\r\e[A\e[A\r\x12" "fir\r\x04";
+	ASSERT_EQ(ssize_t(keys.size()), write(master, keys.data(), keys.size()));
+	{
+		Session session({terminal, terminal, terminal});
+		ASSERT_TRUE(open_history(session.history, "history"));
+		session.run_input(terminal, true);
+		EXPECT_EQ(4, search_history(session.history, "", false, 100) + 1);
+	}
+	close(terminal);
+
+	std::string output;
+	char buffer[4096];
+	ssize_t n;
+	while ((n = read(master, buffer, sizeof(buffer))) > 0) {
+		output.append(buffer, n);
+	}
+	close(master);
+	unlink("history");
+
+	auto count = [&](const std::string& text) {
+		size_t found = 0;
+		for (size_t pos = output.find(text); pos != std::string::npos; pos = output.find(text, pos + 1)) found++;
+		return found;
+	};
+	EXPECT_EQ(3u, count("\r\nfirst\n"));
+	EXPECT_EQ(1u, count("\r\nline 1\nline 2\nline 3\nline 4"));
+	EXPECT_NE(std::string::npos, output.find("echo first"));
+	EXPECT_NE(std::string::npos, output.find("(reverse-i-search)`fir': echo first"));
+}
+
+TEST(Shell, Binary) {
+	ExecuteBinary("echo hi\nexit 3\necho no", "hi\n", 3);
+}
+
+TEST(Shell, ParallelBuiltin) {
+	Execute("parallel -j 2 -k echo ::: a b c\nparallel -k 'cat {} | tail -n 1' ::: 1 1", "a\nb\nc\nline 4line 4");
+	Execute("parallel -j 3 echo x{} > ../foobar ::: 1", "", "../foobar", "x1\n");
+}
+
 
 //////////////// HELPERS
 
@@ -111,30 +816,115 @@ void filewrite(const std::string& str, std::string content) {
 	close(fd);
 }
 
-void Execute(std::string command, std::string expectedOutput) {
+// split_respecting_quotes of the parser before the single-pass lexer.
+std::vector<std::string> ReferenceSplit(const std::string& line, char delimiter, bool& balanced, bool keep_empty) {
+	auto blank = [](const std::string& str) { return str.find_first_not_of(' ') == std::string::npos; };
+	std::vector<std::string> parts;
+	std::string current;
+	bool in_single = false, in_double = false;
+	for (char c : line) {
+		if (c == '\'' && !in_double) {
+			in_single = !in_single;
+		} else if (c == '"' && !in_single) {
+			in_double = !in_double;
+		} else if (!in_single && !in_double && ((isspace(c) && delimiter == ' ') || c == delimiter)) {
+			if (keep_empty || !blank(current)) parts.push_back(current);
+			current.clear();
+		} else {
+			current.push_back(c);
+		}
+	}
+	if (in_single || in_double) balanced = false;
+	if (keep_empty || !blank(current)) parts.push_back(current);
+	return parts;
+}
+
+// The tokens of every command of `line` as the parser before the single-pass
+// lexer split them: on `|` first, then every command on whitespace, dropping
+// commands of only spaces and tabs. Returns the PARSE_ERROR_ flags.
+int ReferenceLex(const std::string& line, std::vector<std::vector<std::string>>& commands) {
+	bool balanced = true, empty = false;
+	std::vector<std::string> segments = ReferenceSplit(line, '|', balanced, true);
+	for (const std::string& segment : segments) {
+		if (segment.find_first_not_of(" \t") == std::string::npos) {
+			empty = true;
+			continue;
+		}
+		commands.push_back(ReferenceSplit(segment, ' ', balanced, false));
+	}
+	return (balanced ? 0 : PARSE_ERROR_QUOTES) | (empty && segments.size() > 1 ? PARSE_ERROR_PIPE : 0);
+}
+
+// From a thread of its own, stops the first child of the calling thread that
+// runs program `name`, once it runs it.
+std::thread StopChild(const std::string& name) {
+	std::string children = "/proc/self/task/" + std::to_string(gettid()) + "/children";
+	return std::thread([=] {
+		while (true) {
+			std::ifstream list(children);
+			pid_t pid;
+			while (list >> pid) {
+				std::string comm;
+				std::ifstream("/proc/" + std::to_string(pid) + "/comm") >> comm;
+				if (comm == name) {
+					kill(pid, SIGSTOP);
+					return;
+				}
+			}
+			usleep(1000);
+		}
+	});
+}
+
+// Runs `command` as a script in a session of its own in TEST_DIR, with
+// /dev/null as standard input and error. Returns the exit status of the last
+// line and the output in `output`.
+int RunSession(const std::string& command, std::string& output) {
 	char buffer[512];
 	std::string dir = getcwd(buffer, sizeof(buffer));
-	filewrite("input", command);
-	std::string cmdstring = std::string("cd ../test-dir; " SHELL " < '") +  dir + "/input' > '" + dir + "/output' 2> /dev/null";
-	system(cmdstring.c_str());
-	std::string got = filecontents("output");
+	int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	int out = memfd_create("output", MFD_CLOEXEC);
+	int rc;
+	{
+		EXPECT_EQ(0, chdir(TEST_DIR));
+		Session session({null, out, null});
+		rc = session.run_script(command);
+		EXPECT_EQ(0, chdir(dir.c_str()));
+	}
+	output = filecontents("/proc/self/fd/" + std::to_string(out));
+	close(out);
+	close(null);
+	return rc;
+}
+
+void Execute(std::string command, std::string expectedOutput) {
+	std::string got;
+	RunSession(command, got);
 	EXPECT_EQ(expectedOutput, got);
 }
 
 void Execute(std::string command, std::string expectedOutput, std::string expectedOutputFile, std::string expectedOutputFileContent) {
-	char buffer[512];
-	std::string dir = getcwd(buffer, sizeof(buffer));
-	std::string expectedOutputLocation = "../test-dir/" + expectedOutputFile;
+	std::string expectedOutputLocation = TEST_DIR "/" + expectedOutputFile;
 	unlink(expectedOutputLocation.c_str());
-	filewrite("input", command);
-	std::string cmdstring = std::string("cd ../test-dir; " SHELL " < '") + dir + "/input' > '" + dir + "/output' 2> /dev/null";
-	int rc = system(cmdstring.c_str());
+	std::string got;
+	int rc = RunSession(command, got);
 	EXPECT_EQ(0, rc);
-	std::string got = filecontents("output");
 	EXPECT_EQ(expectedOutput, got) << command;
 	std::string gotOutputFileContents = filecontents(expectedOutputLocation);
 	EXPECT_EQ(expectedOutputFileContent, gotOutputFileContents) << command;
 	unlink(expectedOutputLocation.c_str());
 }
 
+// Runs `command` through the shell binary, like a user would.
+void ExecuteBinary(std::string command, std::string expectedOutput, int expectedStatus) {
+	char buffer[512];
+	std::string dir = getcwd(buffer, sizeof(buffer));
+	filewrite("input", command);
+	std::string cmdstring = std::string("cd " TEST_DIR "; " SHELL " < '") +  dir + "/input' > '" + dir + "/output' 2> /dev/null";
+	int rc = system(cmdstring.c_str());
+	EXPECT_EQ(expectedStatus, WEXITSTATUS(rc));
+	std::string got = filecontents("output");
+	EXPECT_EQ(expectedOutput, got);
+}
+
 }